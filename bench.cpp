@@ -0,0 +1,510 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <malloc.h>
+#include <boost/asio.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+
+#include "connection.h"
+#include "fake_connection.h"
+#include "incoming_connection.h"
+#include "frame.h"
+
+#ifdef USE_PANTHEIOS
+const PAN_CHAR_T PANTHEIOS_FE_PROCESS_IDENTITY[] = "bench";
+#endif
+
+/*
+ * Times the primitives every call goes through, one at a time, so a drop in throughput can be put down to one of them.
+ *
+ * Usage: bench [filter] [runs]
+ *
+ * Only benchmarks whose names contain the filter are run. Each is run a number of times (7 by default),
+ * each run long enough to be timed reliably, and the median, fastest and slowest time per operation are reported.
+ *
+ * It also measures how much memory an idle connection takes, and fails if a low-footprint one takes more
+ * than FOOTPRINT_BUDGET, so it can be run to catch connections growing.
+ */
+
+namespace Bench {
+
+typedef std::chrono::steady_clock Clock;
+
+static const Clock::duration RUN_TIME = std::chrono::milliseconds(50); // Roughly how long each run of the calibrated benchmarks takes
+
+static const size_t FOOTPRINT_CONNECTIONS = 500; // Connections opened to measure the footprint with
+static const double FOOTPRINT_BUDGET = 1024; // Most heap bytes an idle low-footprint connection may take beyond its socket
+
+/**
+ * Keep the compiler from optimizing away work whose result is never used.
+ */
+template<typename T>
+inline void keep(const T & value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+class Runner
+{
+    public:
+        Runner(const std::string & filter, size_t runs)
+            : _filter{filter}
+            , _runs{std::max<size_t>(runs, 1)}
+        {
+            std::printf("%-44s %12s %12s %12s %12s\n", "benchmark", "ns/op", "min", "max", "ops/run");
+        }
+
+        /**
+         * Time an operation, repeating it as often as it takes to time it reliably.
+         *
+         * @param name      Name to report it under
+         * @param operation Does one operation
+         */
+        template<typename Operation>
+        void measure(const std::string & name, Operation operation)
+        {
+            if (!wanted(name)) {
+                return;
+            }
+
+            // Double the count until a run takes long enough to time, then scale it up to the full run time
+            size_t operations = 1;
+            while (true) {
+                Clock::time_point start = Clock::now();
+                for (size_t i = 0; i < operations; ++i) {
+                    operation();
+                }
+                Clock::duration elapsed = Clock::now() - start;
+                if (elapsed >= RUN_TIME / 10) {
+                    operations = std::max<size_t>(operations, operations * RUN_TIME.count() / std::max<Clock::rep>(elapsed.count(), 1));
+                    break;
+                }
+                operations *= 2;
+            }
+
+            measure(name, operations, [] {}, [&operation, operations] {
+                for (size_t i = 0; i < operations; ++i) {
+                    operation();
+                }
+            });
+        }
+
+        /**
+         * Time a fixed number of operations that change some state, setting the state up before each run.
+         *
+         * @param name          Name to report it under
+         * @param operations    Operations each run does
+         * @param setup         Sets up the state for a run; not timed
+         * @param run           Does all the operations
+         */
+        template<typename Setup, typename Run>
+        void measure(const std::string & name, size_t operations, Setup setup, Run run)
+        {
+            if (!wanted(name)) {
+                return;
+            }
+
+            run(); // Warm the caches and the allocator up
+
+            std::vector<double> times;
+            for (size_t i = 0; i < _runs; ++i) {
+                setup();
+                Clock::time_point start = Clock::now();
+                run();
+                times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / operations);
+            }
+
+            std::sort(times.begin(), times.end());
+            std::printf("%-44s %12.1f %12.1f %12.1f %12zu\n", name.c_str(), times[times.size() / 2], times.front(), times.back(), operations);
+            std::fflush(stdout);
+        }
+
+        bool wanted(const std::string & name) const
+        {
+            return name.find(_filter) != std::string::npos;
+        }
+
+    private:
+        std::string _filter;
+        size_t _runs;
+};
+
+/*
+ * Methods with the game's signatures that do next to nothing, so only the machinery around them is timed.
+ */
+
+static size_t printed = 0;
+
+void printMessage(SydNet::StringView message, SydNet::Connection::Pointer connection)
+{
+    printed += message.length();
+}
+
+void printMessageCopy(const std::string & message, SydNet::Connection::Pointer connection)
+{
+    printed += message.length();
+}
+
+int mul(int x, SydNet::Connection::Pointer connection)
+{
+    return x * 5;
+}
+
+struct BenchRPCs
+{
+    static constexpr SydNet::RPCRegistry::Entry entries[] = {
+        CLIENT_RPC_ENTRY(printMessage),
+        CLIENT_RPC_ENTRY(printMessageCopy),
+        CLIENT_RPC_ENTRY(mul),
+    };
+};
+
+constexpr SydNet::RPCRegistry::Entry BenchRPCs::entries[];
+
+#undef SYDNET_RPC_REGISTRY
+#define SYDNET_RPC_REGISTRY Bench::BenchRPCs
+
+/**
+ * Time encoding arguments, running the method from them and decoding its result.
+ */
+static void invoker(Runner & runner, const std::string & kind, const SydNet::Connection::RPCInvoker & invoker)
+{
+    SydNet::Connection::Pointer connection = SydNet::FakeConnection::create(invoker);
+    const std::string message(32, 'x');
+
+    runner.measure(kind + " serialize mul(int)", [&invoker] {
+        std::stringstream serialized;
+        invoker.serialize(CLIENT_RPC(mul), serialized, 3);
+        keep(serialized);
+    });
+    runner.measure(kind + " serialize printMessage(32 chars)", [&invoker, &message] {
+        std::stringstream serialized;
+        invoker.serialize(CLIENT_RPC(printMessageCopy), serialized, message);
+        keep(serialized);
+    });
+
+    std::stringstream mulParams;
+    invoker.serialize(CLIENT_RPC(mul), mulParams, 3);
+    const std::string mulArgs = mulParams.str();
+    std::stringstream printParams;
+    invoker.serialize(CLIENT_RPC(printMessageCopy), printParams, message);
+    const std::string printArgs = printParams.str();
+
+    runner.measure(kind + " invoke mul(int)", [&invoker, &mulArgs, &connection] {
+        std::stringstream result;
+        keep(invoker.invoke("client_rpc_mul", mulArgs.data(), mulArgs.length(), result, connection));
+        keep(result);
+    });
+    runner.measure(kind + " invoke printMessage(32 chars)", [&invoker, &printArgs, &connection] {
+        std::stringstream result;
+        keep(invoker.invoke("client_rpc_printMessageCopy", printArgs.data(), printArgs.length(), result, connection));
+    });
+    if (invoker.registered("client_rpc_printMessage")) {
+        // Views only decode from the registry
+        runner.measure(kind + " invoke printMessage(32 chars, view)", [&invoker, &printArgs, &connection] {
+            std::stringstream result;
+            keep(invoker.invoke("client_rpc_printMessage", printArgs.data(), printArgs.length(), result, connection));
+        });
+    }
+
+    std::stringstream mulResult;
+    invoker.invoke("client_rpc_mul", mulArgs.data(), mulArgs.length(), mulResult, connection);
+    const std::string mulReturned = mulResult.str();
+
+    runner.measure(kind + " deserialize mul result", [&invoker, &mulReturned] {
+        keep(invoker.deserialize(CLIENT_RPC(mul), mulReturned.data(), mulReturned.length()));
+    });
+}
+
+/**
+ * Time encoding and decoding a snapshot-sized array of each kind, and report how many bytes each takes.
+ */
+template<typename Encoded, typename Array>
+static void array(Runner & runner, const std::string & kind, const Array & values)
+{
+    std::ostringstream sample;
+    SydNet::Codec::Value<Encoded>::write(sample, values);
+    const std::string encoded = sample.str();
+
+    std::string name = "array " + kind + " (" + std::to_string(values.size()) + ", " + std::to_string(encoded.size()) + " bytes)";
+    runner.measure(name + " encode", [&values] {
+        std::ostringstream output;
+        SydNet::Codec::Value<Encoded>::write(output, values);
+        keep(output);
+    });
+    runner.measure(name + " decode", [&encoded] {
+        SydNet::Codec::Reader reader{encoded.data(), encoded.length()};
+        keep(SydNet::Codec::Value<Encoded>::read(reader));
+    });
+}
+
+static void arrays(Runner & runner)
+{
+    // Entity IDs in order and positions to the centimetre, as a snapshot carries them
+    std::vector<int32_t> ids;
+    std::vector<float> positions;
+    for (int32_t i = 0; i < 1000; ++i) {
+        ids.push_back(100000 + i * 3 + i % 2);
+        positions.push_back(static_cast<float>((i * 7919) % 20000) / 100.0f - 100.0f);
+    }
+
+    array<std::vector<int32_t>>(runner, "ints plain", ids);
+    array<SydNet::Packed<int32_t>>(runner, "ints packed", ids);
+    array<SydNet::Packed<int32_t, SydNet::PackedAs::Deltas>>(runner, "ints packed deltas", ids);
+    array<std::vector<float>>(runner, "floats plain", positions);
+    array<SydNet::Quantized<100>>(runner, "floats quantized", positions);
+}
+
+/**
+ * Time writing frames into a buffer and picking them apart again, as the socket transports do.
+ */
+static void frames(Runner & runner)
+{
+    boost::asio::streambuf buffer;
+    const std::string params(8, 'p');
+    const std::string name{"client_rpc_mul"};
+
+    runner.measure("frame encode call", [&buffer, &name, &params] {
+        std::ostream stream{&buffer};
+        SydNet::Frame::writeCall(stream, 1, name, params);
+        buffer.consume(buffer.size());
+    });
+    runner.measure("frame encode result", [&buffer, &params] {
+        std::ostream stream{&buffer};
+        SydNet::Frame::writeResult(stream, 1, params);
+        buffer.consume(buffer.size());
+    });
+
+    std::ostringstream encoded;
+    SydNet::Frame::writeCall(encoded, 1, name, params);
+    const std::string frame = encoded.str();
+
+    runner.measure("frame decode call", [&frame] {
+        // The steps RealConnection takes: the size, then the frame's parts where they lie
+        const char * data = frame.data();
+        SydNet::Frame::Size size = SydNet::Frame::readSize(data);
+        data += sizeof(size);
+        keep(SydNet::Frame::isControl(data, size));
+        SydNet::Frame::Parts parts;
+        keep(SydNet::Frame::decode(data, size, parts));
+        std::string name(parts.name, parts.nameLength);
+        keep(name);
+        keep(parts.requestID);
+    });
+}
+
+/**
+ * Time the map every server keeps its clients in, at the sizes a busy server gets to.
+ */
+static void connectionMap(Runner & runner, size_t entries)
+{
+    boost::uuids::random_generator generator;
+    std::vector<boost::uuids::uuid> uuids;
+    for (size_t i = 0; i < entries; ++i) {
+        uuids.push_back(generator());
+    }
+
+    // Every entry points at the same connection; only the map is being timed
+    SydNet::Connection::RPCInvoker invoker;
+    SydNet::Connection::Pointer connection = SydNet::FakeConnection::create(invoker);
+    SydNet::Connection::ConnectionMap map;
+    std::string size = std::to_string(entries / 1000) + "k";
+
+    runner.measure("connection map insert (" + size + ")", entries, [&map] { map.clear(); }, [&map, &uuids, &connection] {
+        for (const boost::uuids::uuid & uuid: uuids) {
+            map[uuid] = connection;
+        }
+    });
+
+    runner.measure("connection map find (" + size + ")", entries, [] {}, [&map, &uuids] {
+        for (const boost::uuids::uuid & uuid: uuids) {
+            keep(map.find(uuid));
+        }
+    });
+
+    runner.measure("connection map iterate and lock (" + size + ")", entries, [] {}, [&map] {
+        // As a broadcast to every peer does
+        for (auto & peer: map) {
+            SydNet::Connection::Pointer locked{peer.second};
+            keep(locked);
+        }
+    });
+
+    runner.measure("connection map erase (" + size + ")", entries, [&map, &uuids, &connection] {
+        for (const boost::uuids::uuid & uuid: uuids) {
+            map[uuid] = connection;
+        }
+    }, [&map, &uuids] {
+        for (const boost::uuids::uuid & uuid: uuids) {
+            map.erase(uuid);
+        }
+    });
+}
+
+static size_t heapUsed()
+{
+#if defined(__GLIBC_PREREQ) && __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#else
+    return static_cast<unsigned>(mallinfo().uordblks);
+#endif
+}
+
+/**
+ * Measure the heap an idle server-side connection takes once it has had a frame, beyond what its socket takes.
+ *
+ * @return  Bytes per connection
+ */
+static double footprint(bool lowFootprint)
+{
+    SydNet::IOService ioService;
+    boost::asio::ip::tcp::acceptor acceptor{ioService, boost::asio::ip::tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}};
+    SydNet::Connection::RPCInvoker invoker;
+    invoker.registry<BenchRPCs>();
+    SydNet::Connection::ConnectionMap peers;
+    boost::uuids::random_generator generator;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> sockets;
+    std::vector<SydNet::Connection::Pointer> connections;
+
+    std::ostringstream heartbeat;
+    SydNet::Frame::writeControl(heartbeat, SydNet::Frame::HEARTBEAT);
+    const std::string frame = heartbeat.str();
+
+    // What a bare socket waiting to read takes, to take out of the connections' share
+    size_t start = heapUsed();
+    for (size_t i = 0; i < FOOTPRINT_CONNECTIONS; ++i) {
+        sockets.emplace_back(new boost::asio::ip::tcp::socket{ioService});
+        sockets.back()->connect(acceptor.local_endpoint());
+        sockets.emplace_back(new boost::asio::ip::tcp::socket{ioService});
+        acceptor.accept(*sockets.back());
+        sockets.back()->async_read_some(boost::asio::null_buffers(), [](const boost::system::error_code &, size_t) {});
+    }
+    ioService.poll();
+    size_t bare = heapUsed() - start;
+
+    start = heapUsed();
+    for (size_t i = 0; i < FOOTPRINT_CONNECTIONS; ++i) {
+        sockets.emplace_back(new boost::asio::ip::tcp::socket{ioService});
+        sockets.back()->connect(acceptor.local_endpoint());
+        boost::asio::write(*sockets.back(), boost::asio::buffer(frame));
+
+        std::shared_ptr<SydNet::IncomingConnection> connection = std::static_pointer_cast<SydNet::IncomingConnection>(
+                SydNet::IncomingConnection::create(invoker, ioService, generator(), &peers));
+        acceptor.accept(connection->socket());
+        connection->lowFootprint(lowFootprint);
+        connection->beginReading([](boost::system::error_code) {});
+        connections.push_back(connection);
+    }
+    while (ioService.poll()) {
+    }
+    size_t used = heapUsed() - start;
+
+    for (SydNet::Connection::Pointer & connection: connections) {
+        connection->disconnect();
+    }
+    ioService.poll();
+
+    return (static_cast<double>(used) - bare) / FOOTPRINT_CONNECTIONS;
+}
+
+/**
+ * Measure idle connections' memory, with and without the low-footprint mode.
+ *
+ * @return  False if a low-footprint connection takes more than its budget
+ */
+static bool footprints(Runner & runner)
+{
+    bool withinBudget = true;
+    for (bool lowFootprint: {false, true}) {
+        std::string name = lowFootprint ? "connection footprint (idle, low footprint)" : "connection footprint (idle)";
+        if (!runner.wanted(name)) {
+            continue;
+        }
+
+        double bytes = footprint(lowFootprint);
+        std::printf("%-44s %12.0f bytes beyond the socket; %zu bytes of object\n", name.c_str(), bytes, sizeof(SydNet::IncomingConnection));
+        if (lowFootprint && bytes > FOOTPRINT_BUDGET) {
+            std::printf("Over the budget of %.0f bytes\n", FOOTPRINT_BUDGET);
+            withinBudget = false;
+        }
+    }
+    return withinBudget;
+}
+
+/**
+ * Time making the UUIDs every connection is given.
+ */
+static void uuids(Runner & runner)
+{
+    boost::uuids::random_generator generator;
+    runner.measure("uuid generate", [&generator] {
+        keep(generator());
+    });
+    runner.measure("uuid generator construct", [] {
+        boost::uuids::random_generator fresh;
+        keep(fresh);
+    });
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+    using namespace Bench;
+
+    Runner runner{argc > 1 ? argv[1] : "", argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 7};
+
+    SydNet::Connection::RPCInvoker registered;
+    registered.registry<BenchRPCs>();
+    invoker(runner, "registry", registered);
+
+    SydNet::Connection::RPCInvoker cached = registered;
+    cached.cache(CLIENT_RPC(mul));
+    invoker(runner, "cached", cached);
+
+    SydNet::Connection::RPCInvoker dynamic;
+    dynamic.registerFunction(CLIENT_RPC(printMessageCopy));
+    dynamic.registerFunction(CLIENT_RPC(mul));
+    invoker(runner, "dynamic", dynamic);
+
+    arrays(runner);
+    frames(runner);
+    connectionMap(runner, 10000);
+    connectionMap(runner, 100000);
+    uuids(runner);
+    bool withinBudget = footprints(runner);
+
+    keep(printed);
+    return withinBudget ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "capture.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/system/system_error.hpp>
+
+#include "log.h"
+
+namespace SydNet {
+
+const char Capture::MAGIC[8] = {'S', 'Y', 'D', 'C', 'A', 'P', '1', '\0'};
+
+static void throwErrno(int error = errno)
+{
+    throw boost::system::system_error{boost::system::error_code{error, boost::system::system_category()}};
+}
+
+/*****************
+ * Public methods
+ *****************/
+
+Capture::Capture(const std::string & path, size_t chunkSize)
+    : _file{::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)} // It has every client's traffic in it
+    , _map{NULL}
+    , _mapped{0}
+    , _used{HEADER_SIZE}
+    , _chunkSize{chunkSize}
+    , _start{std::chrono::steady_clock::now()}
+    , _stopped{false}
+{
+    if (_file < 0) {
+        throwErrno();
+    }
+
+    int error = grow(HEADER_SIZE);
+    if (error) {
+        // The destructor won't run to close it
+        ::close(_file);
+        throwErrno(error);
+    }
+
+    uint64_t started = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    std::memcpy(_map, MAGIC, sizeof(MAGIC));
+    std::memcpy(_map + sizeof(MAGIC), &started, sizeof(started));
+    setUsed();
+}
+
+void Capture::record(Direction direction, const boost::uuids::uuid & uuid, const char * data, size_t length)
+{
+    if (_stopped) {
+        return;
+    }
+    int error = grow(_used + RECORD_HEADER_SIZE + length);
+    if (error) {
+        // Losing the rest of the capture beats taking the server down over it; what's there so far is kept
+        LOG_WARNING("Capture stopped: ", boost::system::error_code{error, boost::system::system_category()}.message());
+        _stopped = true;
+        return;
+    }
+
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+    uint8_t directionByte = static_cast<uint8_t>(direction);
+    uint32_t length32 = static_cast<uint32_t>(length);
+
+    char * position = _map + _used;
+    std::memcpy(position, &time, sizeof(time));
+    position += sizeof(time);
+    std::memcpy(position, &directionByte, sizeof(directionByte));
+    position += sizeof(directionByte);
+    std::memcpy(position, uuid.data, sizeof(uuid.data));
+    position += sizeof(uuid.data);
+    std::memcpy(position, &length32, sizeof(length32));
+    position += sizeof(length32);
+    std::memcpy(position, data, length);
+
+    _used += RECORD_HEADER_SIZE + length;
+    setUsed();
+}
+
+Capture::~Capture()
+{
+    if (_map) {
+        ::munmap(_map, _mapped);
+    }
+    if (_file >= 0) {
+        if (::ftruncate(_file, _used)) {} // Drop the unused tail; nothing to be done if it fails
+        ::close(_file);
+    }
+}
+
+
+/******************
+* Private methods
+******************/
+
+int Capture::grow(size_t needed)
+{
+    if (needed <= _mapped) {
+        return 0;
+    }
+
+    // Set the blocks aside now; writing through the mapping to a hole the disk has no room for would raise SIGBUS
+    size_t size = (needed + _chunkSize - 1) / _chunkSize * _chunkSize;
+    if (int error = ::posix_fallocate(_file, _mapped, size - _mapped)) {
+        return error;
+    }
+
+    // The old mapping stays usable until the new one is made
+    void * map = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+    if (map == MAP_FAILED) {
+        return errno;
+    }
+    if (_map) {
+        ::munmap(_map, _mapped);
+    }
+    _map = static_cast<char *>(map);
+    _mapped = size;
+    return 0;
+}
+
+void Capture::setUsed()
+{
+    uint64_t used = _used;
+    std::memcpy(_map + sizeof(MAGIC) + sizeof(uint64_t), &used, sizeof(used));
+}
+
+
+/*****************
+ * Public methods
+ *****************/
+
+CaptureReader::CaptureReader(const std::string & path)
+    : _file{::open(path.c_str(), O_RDONLY)}
+    , _map{NULL}
+    , _mapped{0}
+    , _used{0}
+    , _position{Capture::HEADER_SIZE}
+    , _started{0}
+{
+    struct stat status;
+    if (_file < 0 || ::fstat(_file, &status)) {
+        throwErrno();
+    }
+    _mapped = status.st_size;
+
+    if (_mapped < Capture::HEADER_SIZE) {
+        throw std::runtime_error("Capture file is too short");
+    }
+
+    void * map = ::mmap(NULL, _mapped, PROT_READ, MAP_SHARED, _file, 0);
+    if (map == MAP_FAILED) {
+        throwErrno();
+    }
+    _map = static_cast<const char *>(map);
+
+    if (std::memcmp(_map, Capture::MAGIC, sizeof(Capture::MAGIC))) {
+        throw std::runtime_error("Not a capture file");
+    }
+
+    uint64_t used;
+    std::memcpy(&_started, _map + sizeof(Capture::MAGIC), sizeof(_started));
+    std::memcpy(&used, _map + sizeof(Capture::MAGIC) + sizeof(uint64_t), sizeof(used));
+    _used = std::min<size_t>(used, _mapped);
+}
+
+bool CaptureReader::next(Capture::Record & record)
+{
+    if (_position + Capture::RECORD_HEADER_SIZE > _used) {
+        return false;
+    }
+
+    const char * position = _map + _position;
+    uint8_t direction;
+    std::memcpy(&record.time, position, sizeof(record.time));
+    position += sizeof(record.time);
+    std::memcpy(&direction, position, sizeof(direction));
+    position += sizeof(direction);
+    std::memcpy(record.uuid.data, position, sizeof(record.uuid.data));
+    position += sizeof(record.uuid.data);
+    std::memcpy(&record.length, position, sizeof(record.length));
+    position += sizeof(record.length);
+
+    if (_position + Capture::RECORD_HEADER_SIZE + record.length > _used) {
+        return false; // Cut off part way through a record
+    }
+
+    record.direction = static_cast<Capture::Direction>(direction);
+    record.data = position;
+    _position += Capture::RECORD_HEADER_SIZE + record.length;
+    return true;
+}
+
+CaptureReader::~CaptureReader()
+{
+    if (_map) {
+        ::munmap(const_cast<char *>(_map), _mapped);
+    }
+    if (_file >= 0) {
+        ::close(_file);
+    }
+}
+
+}
@@ -0,0 +1,145 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <boost/uuid/uuid.hpp>
+
+namespace SydNet {
+
+/**
+ * Append-only, memory-mapped record of the frames going through connections.
+ *
+ * The file starts with a header of MAGIC, the capture's start time (nanoseconds since the epoch)
+ * and the number of bytes used. Each record after it is its time (nanoseconds since the start),
+ * direction, connection UUID, length and the frame itself (without its size prefix).
+ */
+class Capture
+{
+    public:
+        typedef enum { Inbound = 0, Outbound = 1 } Direction;
+
+        struct Record
+        {
+            uint64_t time; // Nanoseconds since the capture started
+            Direction direction;
+            boost::uuids::uuid uuid;
+            const char * data; // Points into the mapping; valid while the capture is open
+            uint32_t length;
+        };
+
+        /**
+         * Create a new capture file, replacing any existing one. Only its owner can read it.
+         *
+         * @param path      Path of the file
+         * @param chunkSize How much the file grows by when it fills up
+         * @throw boost::system::system_error if the file couldn't be made
+         */
+        Capture(const std::string & path, size_t chunkSize = 16 * 1024 * 1024);
+
+        /**
+         * Append a frame. Once the file can't grow (e.g. the disk is full), capturing stops with a warning.
+         *
+         * @param direction Whether the frame was received or sent
+         * @param uuid      UUID of the connection it went through
+         * @param data      The frame, without its size prefix
+         * @param length    Length of the frame
+         */
+        void record(Direction direction, const boost::uuids::uuid & uuid, const char * data, size_t length);
+
+        ~Capture();
+
+        Capture & operator=(const Capture &) = delete;
+        Capture(const Capture &) = delete;
+
+        static const char MAGIC[8];
+        static const size_t HEADER_SIZE = sizeof(MAGIC) + 2 * sizeof(uint64_t);
+        static const size_t RECORD_HEADER_SIZE = sizeof(uint64_t) + 1 + 16 + sizeof(uint32_t);
+
+    private:
+        // Returns 0, or the error it couldn't grow with
+        int grow(size_t needed);
+
+        void setUsed();
+
+        int _file;
+        char * _map;
+        size_t _mapped;
+        size_t _used;
+        size_t _chunkSize;
+        std::chrono::steady_clock::time_point _start;
+        bool _stopped; // The file couldn't grow, so nothing more is recorded
+};
+
+/**
+ * Reads the records back out of a capture file.
+ */
+class CaptureReader
+{
+    public:
+        /**
+         * Open a capture file.
+         *
+         * @param path  Path of the file
+         */
+        explicit CaptureReader(const std::string & path);
+
+        /**
+         * Read the next record.
+         *
+         * @param record    Set to the record read
+         * @return          False at the end of the capture
+         */
+        bool next(Capture::Record & record);
+
+        /**
+         * Get when the capture started.
+         *
+         * @return  Nanoseconds since the epoch
+         */
+        uint64_t started() const
+        {
+            return _started;
+        }
+
+        ~CaptureReader();
+
+        CaptureReader & operator=(const CaptureReader &) = delete;
+        CaptureReader(const CaptureReader &) = delete;
+
+    private:
+        int _file;
+        const char * _map;
+        size_t _mapped;
+        size_t _used;
+        size_t _position;
+        uint64_t _started;
+};
+
+}
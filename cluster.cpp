@@ -0,0 +1,514 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "cluster.h"
+
+/**
+ * Macros used to list and call the methods nodes call on each other, the same way as the RPC macros.
+ */
+#define CLUSTER_RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&Cluster::x), &Cluster::x>("cluster_rpc_" #x)
+#define CLUSTER_RPC(x) RPC_CHECKED("cluster_rpc_" #x, x)
+
+#undef SYDNET_RPC_REGISTRY
+#define SYDNET_RPC_REGISTRY SydNet::ClusterRPCs
+
+namespace SydNet {
+
+namespace {
+    const TimerWheel::Clock::duration REDIAL = std::chrono::seconds(1); // Wait before dialing a node again
+
+    // Most bytes of UUIDs put in one frame, leaving room for the rest of it (a call's name and parameters, if it's one
+    // being forwarded); more go in another
+    const size_t MAX_FRAME = Frame::MAX_SIZE - 256;
+    const size_t MAX_UUID_BYTES = MAX_FRAME / sizeof(boost::uuids::uuid) * sizeof(boost::uuids::uuid);
+
+    std::string encode(const boost::uuids::uuid & client)
+    {
+        return std::string(reinterpret_cast<const char *>(client.data), client.size());
+    }
+
+    template<typename Function>
+    void forEach(StringView clients, Function function)
+    {
+        boost::uuids::uuid client;
+        for (size_t offset = 0; offset + client.size() <= clients.length(); offset += client.size()) {
+            std::copy(clients.data() + offset, clients.data() + offset + client.size(), client.begin());
+            function(client);
+        }
+    }
+}
+
+// Every method nodes call on each other
+struct ClusterRPCs
+{
+    static constexpr RPCRegistry::Entry entries[] = {
+        CLUSTER_RPC_ENTRY(joined),
+        CLUSTER_RPC_ENTRY(left),
+        CLUSTER_RPC_ENTRY(forward),
+        CLUSTER_RPC_ENTRY(forwardCall),
+    };
+};
+
+constexpr RPCRegistry::Entry ClusterRPCs::entries[];
+
+std::mutex Cluster::_registryMutex;
+std::unordered_map<const Connection *, std::weak_ptr<Cluster::Node>> Cluster::_registry;
+
+/**
+ * Stands in for a client connected to another node, passing calls made on it on to that node.
+ */
+class Cluster::RemoteConnection: public Connection
+{
+    public:
+        /**
+         * Create a connection standing in for a client of another node
+         *
+         * @param invoker   RPC invoker the server's clients use
+         * @param uuid      UUID of the client
+         * @param node      Node the client is connected to
+         * @param peers     The server's clients
+         * @return          A shared Pointer to a new connection object
+         */
+        static Pointer create(const RPCInvoker & invoker, const boost::uuids::uuid & uuid,
+                const std::shared_ptr<Node> & node, ConnectionMap * peers)
+        {
+            return Pointer{new RemoteConnection{invoker, uuid, node, peers}};
+        }
+
+        ConnectionMap & peers()
+        {
+            return *_peers;
+        }
+
+        // Can't copy this class
+        RemoteConnection & operator=(const RemoteConnection &) = delete;
+        RemoteConnection(const RemoteConnection &) = delete;
+
+    private:
+        RemoteConnection(const RPCInvoker & invoker, const boost::uuids::uuid & uuid,
+                const std::shared_ptr<Node> & node, ConnectionMap * peers)
+            : Connection{Remote, invoker, uuid}
+            , _node{node}
+            , _peers{peers}
+        {
+        }
+
+        void remoteExecute(const std::string & name, const std::string & params, RequestID requestID, StreamID stream)
+        {
+            if (std::shared_ptr<Node> node = _node.lock()) {
+                if (handedOver(node->cluster->_ioService, name, params, nullptr, requestID, stream)) {
+                    return; // Only the network thread may touch the pending calls
+                }
+                node->cluster->send(node, uuid(), name, params, stream);
+            } else {
+                LOG_WARNING("Call to a client of a node no longer linked dropped");
+            }
+        }
+
+        void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID stream)
+        {
+            if (std::shared_ptr<Node> node = _node.lock()) {
+                if (handedOver(node->cluster->_ioService, name, params, callback, 0, stream)) {
+                    return;
+                }
+
+                // The callback belongs to this connection, so keep it around until the result is back
+                Pointer self = shared_from_this();
+                node->cluster->sendCall(node, uuid(), name, params,
+                        [self, callback](const char * result, size_t length) { callback(result, length); }, stream);
+            } else {
+                LOG_WARNING("Call to a client of a node no longer linked dropped");
+            }
+        }
+
+        std::weak_ptr<Node> _node; // Node the client is connected to
+        ConnectionMap * _peers; // The server's clients
+};
+
+
+/***************
+ * Constructors
+ ***************/
+
+Cluster::Cluster(RealServer & server, IOService & ioService, unsigned short port)
+    : _server(server)
+    , _ioService(ioService)
+    , _invoker{methods()}
+    , _links{_invoker, ioService, port}
+    , _timers{new TimerWheel{ioService}}
+    , _timeouts()
+    , _uuidGen{}
+    , _nodes{}
+    , _remote{}
+    , _peers{}
+{
+    _server.onMembership(std::bind(&Cluster::handleMembership, this, std::placeholders::_1, std::placeholders::_2));
+    _links.onMembership(std::bind(&Cluster::handleLink, this, std::placeholders::_1, std::placeholders::_2));
+}
+
+Cluster::~Cluster()
+{
+    _server.onMembership(RealServer::MembershipHandler{});
+    _links.onMembership(RealServer::MembershipHandler{});
+
+    for (auto & peer: _peers) {
+        if (OutgoingConnection * link = static_cast<OutgoingConnection *>(peer->link.get())) {
+            link->onDisconnect(OutgoingConnection::DisconnectHandler{});
+            try {
+                link->disconnect();
+            } catch (const boost::system::system_error & e) {
+                LOG_INFO("Error dropping a link: ", e.what());
+            }
+        }
+    }
+
+    while (!_nodes.empty()) {
+        dropNode(_nodes.begin()->first);
+    }
+}
+
+
+/*****************
+ * Public methods
+ *****************/
+
+void Cluster::join(const boost::asio::ip::tcp::endpoint & node)
+{
+    std::shared_ptr<Peer> peer = std::make_shared<Peer>(this, node);
+    _peers.push_back(peer);
+    dial(peer);
+}
+
+void Cluster::timeouts(const RealConnection::Timeouts & timeouts)
+{
+    _timeouts = timeouts;
+    _links.timeouts(timeouts);
+}
+
+
+/******************
+ * Private methods
+ ******************/
+
+Connection::RPCInvoker Cluster::methods()
+{
+    Connection::RPCInvoker invoker;
+    invoker.registry<ClusterRPCs>();
+    return invoker;
+}
+
+void Cluster::joined(StringView clients, Connection::Pointer link)
+{
+    if (std::shared_ptr<Node> node = nodeOf(link)) {
+        forEach(clients, [&node](const boost::uuids::uuid & client) { node->cluster->addRemote(node, client); });
+    }
+}
+
+void Cluster::left(StringView clients, Connection::Pointer link)
+{
+    if (std::shared_ptr<Node> node = nodeOf(link)) {
+        forEach(clients, [&node](const boost::uuids::uuid & client) { node->cluster->removeRemote(*node, client); });
+    }
+}
+
+void Cluster::forward(StringView clients, StringView name, StringView params, Connection::StreamID stream,
+        Connection::Pointer link)
+{
+    std::shared_ptr<Node> node = nodeOf(link);
+    if (!node) {
+        return;
+    }
+
+    Connection::ConnectionMap & local = node->cluster->_server.clients();
+    const std::string method = name.to_string();
+    const std::string encoded = params.to_string();
+    forEach(clients, [&](const boost::uuids::uuid & client) {
+        auto iter = local.find(client);
+        if (iter == local.end()) {
+            return; // It left while the call was on its way
+        }
+        Connection::Pointer connection = iter->second.lock();
+        if (connection && !connection->remote()) {
+            connection->executeEncoded(method, encoded, stream);
+        }
+    });
+}
+
+Responder<std::string> Cluster::forwardCall(StringView client, StringView name, StringView params,
+        Connection::StreamID stream, Connection::Pointer link)
+{
+    Responder<std::string> responder;
+    std::shared_ptr<Node> node = nodeOf(link);
+    if (!node) {
+        return responder;
+    }
+
+    Connection::ConnectionMap & local = node->cluster->_server.clients();
+    forEach(client, [&](const boost::uuids::uuid & target) {
+        auto iter = local.find(target);
+        Connection::Pointer connection = iter != local.end() ? iter->second.lock() : Connection::Pointer{};
+        if (!connection || connection->remote()) {
+            LOG_INFO("Call to client ", target, " which has left dropped");
+            return; // The caller hears nothing, as if the client had dropped
+        }
+        connection->executeEncodedCallback(name.to_string(), params.to_string(),
+                [responder](const char * result, size_t length) { responder.respond(std::string(result, length)); }, stream);
+    });
+    return responder;
+}
+
+std::shared_ptr<Cluster::Node> Cluster::nodeOf(const Connection::Pointer & link)
+{
+    std::lock_guard<std::mutex> lock{_registryMutex};
+    auto iter = _registry.find(link.get());
+    return iter != _registry.end() ? iter->second.lock() : std::shared_ptr<Node>{};
+}
+
+void Cluster::handleMembership(const boost::uuids::uuid & client, bool joins)
+{
+    for (auto & node: _nodes) {
+        if (Connection::Pointer link = node.second->link.lock()) {
+            if (joins) {
+                link->execute(CLUSTER_RPC(joined), encode(client));
+            } else {
+                link->execute(CLUSTER_RPC(left), encode(client));
+            }
+        }
+    }
+}
+
+void Cluster::handleLink(const boost::uuids::uuid & link, bool joins)
+{
+    auto iter = _links.clients().find(link);
+    if (joins && iter != _links.clients().end()) {
+        LOG_NOTICE("Node linked: ", link);
+        addNode(iter->second.lock());
+        return;
+    }
+
+    // The link is already gone from the map; find its node the long way round
+    for (auto & node: _nodes) {
+        Connection::Pointer connection = node.second->link.lock();
+        if (!connection || connection->uuid() == link) {
+            LOG_NOTICE("Node unlinked: ", link);
+            dropNode(node.first);
+            return;
+        }
+    }
+}
+
+void Cluster::dial(const std::shared_ptr<Peer> & peer)
+{
+    std::weak_ptr<Peer> weakPeer = peer;
+    peer->link = OutgoingConnection::create(_invoker, _ioService, peer->endpoint,
+            std::bind(&Cluster::handleDial, weakPeer, std::placeholders::_1));
+    peer->link->uuid(_uuidGen());
+}
+
+void Cluster::handleDial(const std::weak_ptr<Peer> & weakPeer, const boost::system::error_code & error)
+{
+    std::shared_ptr<Peer> peer = weakPeer.lock();
+    if (!peer) {
+        return;
+    }
+    Cluster & cluster = *peer->cluster;
+
+    if (error) {
+        LOG_INFO("Node at ", peer->endpoint, " not there: ", error.message());
+        cluster._timers->schedule(peer->retry, REDIAL, [weakPeer] {
+            if (std::shared_ptr<Peer> peer = weakPeer.lock()) {
+                peer->cluster->dial(peer);
+            }
+        });
+        return;
+    }
+
+    LOG_NOTICE("Node linked: ", peer->endpoint);
+    std::shared_ptr<OutgoingConnection> link = std::static_pointer_cast<OutgoingConnection>(peer->link);
+    link->onDisconnect(std::bind(&Cluster::handlePeerDisconnect, weakPeer, std::placeholders::_1));
+    if (cluster._timeouts.heartbeat.count() || cluster._timeouts.idle.count() || cluster._timeouts.request.count()) {
+        link->timeouts(cluster._timers, cluster._timeouts);
+    }
+    cluster.addNode(link);
+}
+
+void Cluster::handlePeerDisconnect(const std::weak_ptr<Peer> & weakPeer, const boost::system::error_code & error)
+{
+    std::shared_ptr<Peer> peer = weakPeer.lock();
+    if (!peer) {
+        return;
+    }
+
+    LOG_NOTICE("Node at ", peer->endpoint, " unlinked: ", error.message());
+    peer->cluster->dropNode(peer->link.get());
+    peer->cluster->_timers->schedule(peer->retry, REDIAL, [weakPeer] {
+        if (std::shared_ptr<Peer> peer = weakPeer.lock()) {
+            peer->cluster->dial(peer);
+        }
+    });
+}
+
+void Cluster::addNode(const Connection::Pointer & link)
+{
+    if (!link) {
+        return;
+    }
+
+    std::shared_ptr<Node> node = std::make_shared<Node>(this, link);
+    _nodes[link.get()] = node;
+    {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry[link.get()] = node;
+    }
+
+    // Tell it who's here, as many to a frame as fit; it tells us likewise
+    std::string clients = members(_server.clients());
+    for (size_t offset = 0; offset < clients.length(); offset += MAX_UUID_BYTES) {
+        link->execute(CLUSTER_RPC(joined), clients.substr(offset, MAX_UUID_BYTES));
+    }
+}
+
+void Cluster::dropNode(const Connection * link)
+{
+    auto iter = _nodes.find(link);
+    if (iter == _nodes.end()) {
+        return;
+    }
+
+    std::shared_ptr<Node> node = iter->second;
+    _nodes.erase(iter);
+    {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry.erase(link);
+    }
+
+    while (!node->clients.empty()) {
+        const boost::uuids::uuid client = *node->clients.begin(); // Not a reference: removing it erases it
+        removeRemote(*node, client);
+    }
+    node->pending.clear();
+}
+
+void Cluster::addRemote(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client)
+{
+    Connection::ConnectionMap & clients = _server.clients();
+    if (clients.count(client)) {
+        return; // Already known, or one of ours
+    }
+
+    Connection::Pointer connection = RemoteConnection::create(_server.invoker(), client, node, &clients);
+    clients[client] = connection;
+    _remote[client] = connection;
+    node->clients.insert(client);
+}
+
+void Cluster::removeRemote(Node & node, const boost::uuids::uuid & client)
+{
+    node.clients.erase(client);
+
+    auto iter = _remote.find(client);
+    if (iter == _remote.end()) {
+        return;
+    }
+
+    Connection::ConnectionMap & clients = _server.clients();
+    auto entry = clients.find(client);
+    if (entry != clients.end() && entry->second.lock() == iter->second) {
+        clients.erase(entry);
+    }
+    _remote.erase(iter);
+}
+
+void Cluster::send(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client,
+        const std::string & name, const std::string & params, Connection::StreamID stream)
+{
+    // Consecutive calls the same but for who they're to are passed on as one, as long as it fits in a frame
+    if (node->pending.empty() || node->pending.back().name != name || node->pending.back().params != params
+            || node->pending.back().stream != stream
+            || node->pending.back().clients.length() + client.size() + name.length() + params.length() > MAX_FRAME) {
+        node->pending.push_back(Group{std::string{}, name, params, stream});
+    }
+    node->pending.back().clients.append(reinterpret_cast<const char *>(client.data), client.size());
+
+    // Pass them on once whatever's making them is done
+    if (!node->flushing) {
+        node->flushing = true;
+        std::weak_ptr<Node> weakNode = node;
+        _ioService.post([weakNode] {
+            if (std::shared_ptr<Node> node = weakNode.lock()) {
+                flush(*node);
+            }
+        });
+    }
+}
+
+void Cluster::sendCall(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client,
+        const std::string & name, const std::string & params,
+        const Connection::RemoteExecuteCallback & callback, Connection::StreamID stream)
+{
+    Connection::Pointer link = node->link.lock();
+    if (!link) {
+        return;
+    }
+
+    // Calls to the client made before this one go first
+    flush(*node);
+    link->executeCallback(CLUSTER_RPC(forwardCall),
+            [callback](const std::string & result) { callback(result.data(), result.length()); },
+            encode(client), name, params, stream);
+}
+
+void Cluster::flush(Node & node)
+{
+    node.flushing = false;
+    Connection::Pointer link = node.link.lock();
+    if (link) {
+        for (const Group & group: node.pending) {
+            try {
+                link->execute(CLUSTER_RPC(forward), group.clients, group.name, group.params, group.stream);
+            } catch (const std::length_error & e) {
+                // Only a call too big to send even to one client gets here
+                LOG_ERROR("Call to ", group.name, " not passed on to another node: ", e.what());
+            }
+        }
+    }
+    node.pending.clear();
+}
+
+std::string Cluster::members(const Connection::ConnectionMap & clients)
+{
+    std::string members;
+    for (auto & client: clients) {
+        Connection::Pointer connection = client.second.lock();
+        if (connection && !connection->remote()) {
+            members += encode(client.first);
+        }
+    }
+    return members;
+}
+
+}
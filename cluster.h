@@ -0,0 +1,213 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "real_server.h"
+#include "outgoing_connection.h"
+
+namespace SydNet {
+
+struct ClusterRPCs;
+
+/**
+ * Links server processes into one world, possibly on several hosts.
+ *
+ * Nodes link to each other over ordinary connections, calling each other through RPCs of their own. Each
+ * tells the others which clients join and leave it, and every node puts the clients of the others in its
+ * server's clients() (and so every client's peers()) as connections standing in for them; remote() tells
+ * them apart. Calls made on a remote client are passed on to its node and sent on from there. Calls with
+ * the same arguments to clients on the same node, as a broadcast loop over peers() makes, go over once
+ * for the lot of them.
+ *
+ * Every node listens for links from the others, and links to each node started before it (see join()), so
+ * each pair of nodes is linked once. Links are redialed when they drop; meanwhile the other node's clients
+ * are left out. The interest grid stays per node: nearby broadcasts only reach clients on the same node.
+ */
+class Cluster
+{
+    public:
+        /**
+         * Make a server a node of a cluster, listening for links from other nodes.
+         *
+         * @param server    Server whose clients are shared with the other nodes
+         * @param ioService IO service to use for links (the server's own)
+         * @param port      Port to listen for links from other nodes on
+         */
+        Cluster(RealServer & server, IOService & ioService, unsigned short port);
+
+        /**
+         * Link to another node, redialing until it's there and whenever the link drops.
+         *
+         * @param node  Address the other node listens for links on
+         */
+        void join(const boost::asio::ip::tcp::endpoint & node);
+
+        /**
+         * Supervise links with heartbeats and timeouts, so a node that stops answering is let go.
+         *
+         * @param timeouts  Timeouts to use; any left at zero are turned off
+         */
+        void timeouts(const RealConnection::Timeouts & timeouts);
+
+        /**
+         * Get how many other nodes are linked at the moment.
+         *
+         * @return  Number of nodes
+         */
+        size_t nodes() const
+        {
+            return _nodes.size();
+        }
+
+        ~Cluster();
+
+        // Can't copy this class
+        Cluster & operator=(const Cluster &) = delete;
+        Cluster(const Cluster &) = delete;
+
+    private:
+        friend struct ClusterRPCs;
+        class RemoteConnection;
+
+        // Calls with the same arguments to clients of one node, waiting to go over together
+        struct Group
+        {
+            std::string clients; // UUIDs, one after another
+            std::string name;
+            std::string params;
+            Connection::StreamID stream;
+        };
+
+        // Another node, linked to this one
+        struct Node
+        {
+            Node(Cluster * cluster, const Connection::Pointer & link)
+                : cluster{cluster}
+                , key{link.get()}
+                , link{link}
+                , clients{}
+                , pending{}
+                , flushing{false}
+            {
+            }
+
+            Cluster * cluster;
+            const Connection * key; // Link it's known by
+            Connection::WeakPointer link;
+            std::unordered_set<boost::uuids::uuid, boost::hash<boost::uuids::uuid>> clients; // Clients it has
+            std::vector<Group> pending; // Calls to its clients not passed on yet
+            bool flushing; // Pending calls are to be passed on
+
+            Node & operator=(const Node &) = delete;
+            Node(const Node &) = delete;
+        };
+
+        // Node this one links to
+        struct Peer
+        {
+            Peer(Cluster * cluster, const boost::asio::ip::tcp::endpoint & endpoint)
+                : cluster{cluster}
+                , endpoint(endpoint)
+                , link{}
+                , retry{}
+            {
+            }
+
+            Cluster * cluster;
+            boost::asio::ip::tcp::endpoint endpoint;
+            Connection::Pointer link;
+            TimerWheel::Timer retry;
+
+            Peer & operator=(const Peer &) = delete;
+            Peer(const Peer &) = delete;
+        };
+
+        static Connection::RPCInvoker methods();
+
+        // RPCs between nodes
+        static void joined(StringView clients, Connection::Pointer link);
+        static void left(StringView clients, Connection::Pointer link);
+        static void forward(StringView clients, StringView name, StringView params, Connection::StreamID stream,
+                Connection::Pointer link);
+        static Responder<std::string> forwardCall(StringView client, StringView name, StringView params,
+                Connection::StreamID stream, Connection::Pointer link);
+
+        static std::shared_ptr<Node> nodeOf(const Connection::Pointer & link);
+
+        void handleMembership(const boost::uuids::uuid & client, bool joins);
+
+        void handleLink(const boost::uuids::uuid & link, bool joins);
+
+        void dial(const std::shared_ptr<Peer> & peer);
+
+        static void handleDial(const std::weak_ptr<Peer> & weakPeer, const boost::system::error_code & error);
+
+        static void handlePeerDisconnect(const std::weak_ptr<Peer> & weakPeer, const boost::system::error_code & error);
+
+        void addNode(const Connection::Pointer & link);
+
+        void dropNode(const Connection * link);
+
+        void addRemote(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client);
+
+        void removeRemote(Node & node, const boost::uuids::uuid & client);
+
+        void send(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client,
+                const std::string & name, const std::string & params, Connection::StreamID stream);
+
+        void sendCall(const std::shared_ptr<Node> & node, const boost::uuids::uuid & client,
+                const std::string & name, const std::string & params,
+                const Connection::RemoteExecuteCallback & callback, Connection::StreamID stream);
+
+        static void flush(Node & node);
+
+        static std::string members(const Connection::ConnectionMap & clients);
+
+        RealServer & _server;
+        IOService & _ioService;
+        Connection::RPCInvoker _invoker; // Methods nodes call on each other
+        RealServer _links; // Links from other nodes
+        TimerWheel::Pointer _timers;
+        RealConnection::Timeouts _timeouts;
+        boost::uuids::random_generator _uuidGen;
+        std::unordered_map<const Connection *, std::shared_ptr<Node>> _nodes; // Linked nodes, by their links
+        std::unordered_map<boost::uuids::uuid, Connection::Pointer, boost::hash<boost::uuids::uuid>> _remote; // Stand-ins for their clients
+        std::vector<std::shared_ptr<Peer>> _peers;
+
+        static std::mutex _registryMutex;
+        static std::unordered_map<const Connection *, std::weak_ptr<Node>> _registry; // Every node of every cluster, by its link
+};
+
+}
@@ -0,0 +1,446 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+
+#include "packing.h"
+
+namespace SydNet {
+
+/**
+ * A string argument that points into the receive buffer instead of being copied out of it.
+ *
+ * Only valid until the RPC method it was passed to returns. On the sending side it's encoded the same
+ * as a std::string, so callers can pass either.
+ */
+typedef boost::string_ref StringView;
+
+/**
+ * What a packed array packs: its values, or the differences between neighbouring values.
+ *
+ * Differences pack smaller when the values are sorted or change slowly from one to the next, like IDs
+ * or positions along a path.
+ */
+enum class PackedAs { Values, Deltas };
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Weffc++" // Only ever used as the vector it is, never deleted through it
+
+/**
+ * An array of integers argument that's sent bit-packed.
+ *
+ * Values are sent as offsets from the smallest of them, each taking only as many bits as the largest offset
+ * needs, so an array of small or similar values takes a fraction of its full width. It's a vector in every
+ * other way, and on the sending side a plain vector of the same type can be passed for it.
+ */
+template<typename T, PackedAs As = PackedAs::Values>
+class Packed: public std::vector<T>
+{
+    static_assert(std::is_integral<T>::value && sizeof(T) <= sizeof(uint32_t), "Only integers up to 32 bits can be packed");
+
+    public:
+        using std::vector<T>::vector;
+
+        Packed() = default;
+
+        Packed(const std::vector<T> & values)
+            : std::vector<T>(values)
+        {
+        }
+
+        Packed(std::vector<T> && values)
+            : std::vector<T>(std::move(values))
+        {
+        }
+};
+
+/**
+ * An array of floats argument that's sent as bit-packed fixed point, rounded to the nearest 1 / Steps.
+ *
+ * Values must be within 2^31 steps of zero; any further out are clamped. Otherwise it's the same as Packed.
+ */
+template<int Steps, PackedAs As = PackedAs::Values>
+class Quantized: public std::vector<float>
+{
+    static_assert(Steps > 0, "Quantized values need at least one step per unit");
+
+    public:
+        using std::vector<float>::vector;
+
+        Quantized() = default;
+
+        Quantized(const std::vector<float> & values)
+            : std::vector<float>(values)
+        {
+        }
+
+        Quantized(std::vector<float> && values)
+            : std::vector<float>(std::move(values))
+        {
+        }
+};
+
+#pragma GCC diagnostic pop
+
+/**
+ * Lets an istream read from memory the stream doesn't own.
+ */
+class InputBuffer: public std::streambuf
+{
+    public:
+        InputBuffer(const char * data, size_t length)
+        {
+            char * begin = const_cast<char *>(data); // Only ever read from
+            setg(begin, begin, begin + length);
+        }
+};
+
+/**
+ * Encoding of the arguments and results of the RPC methods in a registry.
+ *
+ * Trivially copyable values are copied as they are, strings and arrays of trivially copyable values are
+ * a 32-bit count followed by their contents, Packed and Quantized arrays are a count followed by their
+ * bit-packed values, and anything else goes through a length-prefixed boost archive.
+ */
+namespace Codec {
+    typedef uint32_t Length;
+
+    static const size_t PACK_CHUNK = 256; // Values packed at a time; a multiple of 8 so each chunk ends on a byte
+
+    /**
+     * Reads values straight out of a buffer.
+     */
+    class Reader
+    {
+        public:
+            Reader(const char * data, size_t length)
+                : _position{data}
+                , _end{data + length}
+            {
+            }
+
+            /**
+             * Take the next bytes.
+             *
+             * @param length    Number of bytes
+             * @return          Where they are in the buffer
+             */
+            const char * take(size_t length)
+            {
+                if (length > static_cast<size_t>(_end - _position)) {
+                    throw std::length_error("RPC arguments are shorter than their types say");
+                }
+                const char * data = _position;
+                _position += length;
+                return data;
+            }
+
+            template<typename T>
+            T trivial()
+            {
+                T value;
+                std::memcpy(&value, take(sizeof(value)), sizeof(value));
+                return value;
+            }
+
+            Reader & operator=(const Reader &) = delete;
+            Reader(const Reader &) = delete;
+
+        private:
+            const char * _position;
+            const char * _end;
+    };
+
+    template<typename T>
+    void writeTrivial(std::ostream & output, const T & value)
+    {
+        output.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    inline void writeBytes(std::ostream & output, const char * data, size_t length)
+    {
+        writeTrivial(output, static_cast<Length>(length));
+        output.write(data, length);
+    }
+
+    // Anything boost can serialize
+    template<typename T, typename Enable = void>
+    struct Value
+    {
+        static void write(std::ostream & output, const T & value)
+        {
+            std::ostringstream serialized;
+            {
+                boost::archive::binary_oarchive archive{serialized, boost::archive::no_header};
+                archive << value;
+            }
+            const std::string & bytes = serialized.str();
+            writeBytes(output, bytes.data(), bytes.length());
+        }
+
+        static T read(Reader & reader)
+        {
+            Length length = reader.trivial<Length>();
+            InputBuffer buffer{reader.take(length), length};
+            std::istream input{&buffer};
+            boost::archive::binary_iarchive archive{input, boost::archive::no_header};
+            T value;
+            archive >> value;
+            return value;
+        }
+    };
+
+    template<typename T>
+    struct Value<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+    {
+        static void write(std::ostream & output, const T & value)
+        {
+            writeTrivial(output, value);
+        }
+
+        static T read(Reader & reader)
+        {
+            return reader.trivial<T>();
+        }
+    };
+
+    template<>
+    struct Value<std::string>
+    {
+        static void write(std::ostream & output, const std::string & value)
+        {
+            writeBytes(output, value.data(), value.length());
+        }
+
+        static std::string read(Reader & reader)
+        {
+            Length length = reader.trivial<Length>();
+            return std::string(reader.take(length), length);
+        }
+    };
+
+    template<>
+    struct Value<StringView>
+    {
+        static void write(std::ostream & output, const StringView & value)
+        {
+            writeBytes(output, value.data(), value.length());
+        }
+
+        static StringView read(Reader & reader)
+        {
+            Length length = reader.trivial<Length>();
+            return StringView{reader.take(length), length};
+        }
+    };
+
+    template<typename T>
+    struct Value<std::vector<T>, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+    {
+        static void write(std::ostream & output, const std::vector<T> & value)
+        {
+            writeTrivial(output, static_cast<Length>(value.size()));
+            output.write(reinterpret_cast<const char *>(value.data()), value.size() * sizeof(T));
+        }
+
+        static std::vector<T> read(Reader & reader)
+        {
+            Length count = reader.trivial<Length>();
+            const char * data = reader.take(count * sizeof(T));
+            std::vector<T> value(count);
+            std::memcpy(value.data(), data, count * sizeof(T));
+            return value;
+        }
+    };
+
+    /**
+     * Values being packed or unpacked on this thread, kept so each array doesn't allocate its own.
+     */
+    inline std::vector<uint32_t> & scratch()
+    {
+        static thread_local std::vector<uint32_t> values;
+        return values;
+    }
+
+    /**
+     * Offset an integer so signed values sort the same as unsigned ones.
+     */
+    template<typename T>
+    uint32_t ordered(T value)
+    {
+        return std::is_signed<T>::value ? static_cast<uint32_t>(static_cast<int32_t>(value)) ^ 0x80000000u : static_cast<uint32_t>(value);
+    }
+
+    template<typename T>
+    T unordered(uint32_t value)
+    {
+        return std::is_signed<T>::value ? static_cast<T>(static_cast<int32_t>(value ^ 0x80000000u)) : static_cast<T>(value);
+    }
+
+    /**
+     * Write ordered values packed: the count, the first value if it's the differences that are packed,
+     * the smallest value and the bits each takes, then the bits of each value beyond the smallest.
+     *
+     * Each value takes at least a bit, so a call can't claim more values than it has bits.
+     *
+     * @param output    Where to write them
+     * @param values    Values to pack, which are changed in the process
+     * @param as        What to pack
+     */
+    inline void writePacked(std::ostream & output, std::vector<uint32_t> & values, PackedAs as)
+    {
+        writeTrivial(output, static_cast<Length>(values.size()));
+        if (values.empty()) {
+            return;
+        }
+
+        if (as == PackedAs::Deltas) {
+            writeTrivial(output, values.front());
+            Packing::delta(values.data(), values.size());
+        }
+
+        uint32_t lowest, highest;
+        Packing::range(values.data(), values.size(), lowest, highest);
+        Packing::offset(values.data(), values.size(), 0u - lowest);
+        uint8_t bits = std::max(Packing::width(highest - lowest), 1u);
+        writeTrivial(output, lowest);
+        writeTrivial(output, bits);
+
+        char packed[PACK_CHUNK * sizeof(uint32_t)];
+        for (size_t i = 0; i < values.size(); i += PACK_CHUNK) {
+            size_t count = std::min(PACK_CHUNK, values.size() - i);
+            Packing::pack(values.data() + i, count, bits, packed);
+            output.write(packed, Packing::packedLength(count, bits));
+        }
+    }
+
+    /**
+     * Read values written by writePacked().
+     *
+     * @param reader    Where to read them from
+     * @param as        What was packed
+     * @param values    Set to the ordered values
+     */
+    inline void readPacked(Reader & reader, PackedAs as, std::vector<uint32_t> & values)
+    {
+        Length count = reader.trivial<Length>();
+        values.clear();
+        if (!count) {
+            return;
+        }
+
+        uint32_t first = as == PackedAs::Deltas ? reader.trivial<uint32_t>() : 0;
+        uint32_t lowest = reader.trivial<uint32_t>();
+        unsigned bits = reader.trivial<uint8_t>();
+        if (!bits || bits > 32) {
+            throw std::length_error("Packed RPC argument has an impossible width");
+        }
+
+        const char * data = reader.take(Packing::packedLength(count, bits));
+        values.resize(count);
+        Packing::unpack(data, count, bits, values.data());
+        Packing::offset(values.data(), count, lowest);
+        if (as == PackedAs::Deltas) {
+            Packing::undelta(values.data(), count, first);
+        }
+    }
+
+    template<typename T, PackedAs As>
+    struct Value<Packed<T, As>>
+    {
+        static void write(std::ostream & output, const std::vector<T> & value)
+        {
+            std::vector<uint32_t> & values = scratch();
+            values.resize(value.size());
+            for (size_t i = 0; i < value.size(); ++i) {
+                values[i] = ordered(value[i]);
+            }
+            writePacked(output, values, As);
+        }
+
+        static Packed<T, As> read(Reader & reader)
+        {
+            std::vector<uint32_t> & values = scratch();
+            readPacked(reader, As, values);
+            Packed<T, As> value(values.size());
+            for (size_t i = 0; i < values.size(); ++i) {
+                value[i] = unordered<T>(values[i]);
+            }
+            return value;
+        }
+    };
+
+    template<int Steps, PackedAs As>
+    struct Value<Quantized<Steps, As>>
+    {
+        static void write(std::ostream & output, const std::vector<float> & value)
+        {
+            std::vector<uint32_t> & values = scratch();
+            values.resize(value.size());
+            Packing::quantize(value.data(), value.size(), Steps, values.data());
+            writePacked(output, values, As);
+        }
+
+        static Quantized<Steps, As> read(Reader & reader)
+        {
+            std::vector<uint32_t> & values = scratch();
+            readPacked(reader, As, values);
+            Quantized<Steps, As> value(values.size());
+            Packing::dequantize(values.data(), values.size(), 1.0f / Steps, value.data());
+            return value;
+        }
+    };
+
+    // Whether only this encoding can handle a type, and not a boost archive
+    template<typename T>
+    struct OnlyEncoded: std::false_type {};
+
+    template<>
+    struct OnlyEncoded<StringView>: std::true_type {};
+
+    template<typename T, PackedAs As>
+    struct OnlyEncoded<Packed<T, As>>: std::true_type {};
+
+    template<int Steps, PackedAs As>
+    struct OnlyEncoded<Quantized<Steps, As>>: std::true_type {};
+}
+
+}
@@ -28,6 +28,7 @@ or implied, of Christopher Allen Ogden.
 #pragma once
 
 #include <memory>
+#include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/uuid/uuid.hpp>
@@ -37,17 +38,26 @@ or implied, of Christopher Allen Ogden.
 #include <boost/archive/binary_oarchive.hpp>
 
 #include "invoke.h"
+#include "frame.h"
+#include "io_service.h"
+#include "mpsc_queue.h"
+#include "rpc_registry.h"
+#include "result_cache.h"
 #include "log.h"
 
 /**
  * Macros used to organize functions as being for both sides or just one.
+ * Each checks at compile time that the method is in SYDNET_RPC_REGISTRY under that name and with its type.
  */
-#define RPC(x) "rpc_" #x, x             // Both
-#define CLIENT_RPC(x) "client_" RPC(x)  // Client
-#define SERVER_RPC(x) "server_" RPC(x)  // Server
+#define RPC_CHECKED(name, x) name, SydNet::RPCRegistry::checked<SYDNET_RPC_REGISTRY, SydNet::RPCRegistry::Lookup<SYDNET_RPC_REGISTRY>::index(name)>(x)
+#define RPC(x) RPC_CHECKED("rpc_" #x, x)                // Both
+#define CLIENT_RPC(x) RPC_CHECKED("client_rpc_" #x, x)  // Client
+#define SERVER_RPC(x) RPC_CHECKED("server_rpc_" #x, x)  // Server
 
 namespace SydNet {
 
+class InterestGrid;
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Weffc++" // enable_shared_from_this doesn't need a virtual destructor
 class Connection: public std::enable_shared_from_this<Connection>
@@ -58,8 +68,388 @@ class Connection: public std::enable_shared_from_this<Connection>
         typedef std::shared_ptr<Connection> Pointer;
         typedef std::weak_ptr<Connection> WeakPointer;
 
-        // Stores RPC methods
-        typedef invoke::Invoker<boost::archive::binary_iarchive, boost::archive::binary_oarchive, Pointer> RPCInvoker;
+        // Logical streams a connection's frames are sent on, so bulk traffic doesn't hold up the rest
+        typedef uint8_t StreamID;
+        static const StreamID METHOD_STREAM = 0xff; // Whichever stream the method was registered with (0 if none)
+
+        // Stores RPC methods, along with how each of them should be run. The invoker it's built on is private, so
+        // nothing reaches its methods past the registry, the caches or the copy shared with connections.
+        class RPCInvoker: private invoke::Invoker<boost::archive::binary_iarchive, boost::archive::binary_oarchive, Pointer>
+        {
+                typedef invoke::Invoker<boost::archive::binary_iarchive, boost::archive::binary_oarchive, Pointer> Base;
+
+            public:
+                struct Options
+                {
+                    Options()
+                        : offload{false}
+                        , ordered{false}
+                        , stream{0}
+                        , coalesce{false}
+                        , keyBytes{0}
+                        , cache{}
+                        , cacheCalls{false}
+                    {
+                    }
+
+                    bool offload; // Run on a worker pool instead of the network thread
+                    bool ordered; // Keep offloaded calls from one connection in the order they arrived
+                    StreamID stream; // Stream calls to it and its results are sent on
+                    bool coalesce; // A newer call replaces one still waiting to be sent
+                    size_t keyBytes; // Leading bytes of the encoded arguments that tell coalescing calls apart
+                    std::shared_ptr<ResultCache> cache; // Results kept for calls with the same arguments, if set
+                    bool cacheCalls; // Calls made through this invoker are answered from the cache too
+                };
+
+                RPCInvoker()
+                    : _options{}
+                    , _registry{NULL}
+                    , _caching{false}
+                    , _shared{}
+                {
+                }
+
+                /**
+                 * Get an unchangeable copy of the methods for connections to share.
+                 * Every call gets the same copy until the methods or their options are changed.
+                 *
+                 * @return  The shared copy
+                 */
+                std::shared_ptr<const RPCInvoker> shared() const
+                {
+                    // Connections may be made from several threads at once
+                    std::shared_ptr<const RPCInvoker> shared = std::atomic_load(&_shared);
+                    if (!shared) {
+                        std::shared_ptr<RPCInvoker> copy = std::make_shared<RPCInvoker>(*this);
+                        copy->_shared.reset();
+                        if (std::atomic_compare_exchange_strong(&_shared, &shared, std::shared_ptr<const RPCInvoker>{copy})) {
+                            shared = copy;
+                        }
+                    }
+                    return shared;
+                }
+
+                /**
+                 * Register an RPC method to be looked up by name at run time.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  The method
+                 */
+                template<typename Function>
+                void registerFunction(const std::string & name, Function function)
+                {
+                    changed();
+                    Base::registerFunction(name, function);
+                }
+
+                /**
+                 * Dispatch the methods in a compile-time registry through its perfect hash table.
+                 * Methods registered at run time are still looked for when a name isn't in it.
+                 *
+                 * @tparam Registry Struct listing the methods (see RPCRegistry)
+                 */
+                template<typename Registry>
+                void registry()
+                {
+                    changed();
+                    _registry = &RPCRegistry::Table<Registry>::find;
+                }
+
+                /**
+                 * Find a method in the compile-time registry.
+                 *
+                 * @param name  Name of RPC method
+                 * @return      Its entry, or NULL if there's no registry or it isn't in it
+                 */
+                const RPCRegistry::Entry * registered(const std::string & name) const
+                {
+                    return _registry ? _registry(name.data(), name.length()) : NULL;
+                }
+
+                /**
+                 * Check whether an RPC method has a result to send back; those returning void don't.
+                 * Methods registered at run time are taken to have one, as their types aren't kept.
+                 *
+                 * @param name  Name of RPC method
+                 * @return      True unless it's in the registry and returns void
+                 */
+                bool answers(const std::string & name) const
+                {
+                    const RPCRegistry::Entry * entry = registered(name);
+                    return !entry || entry->answers;
+                }
+
+                /**
+                 * Call an RPC method, decoding its arguments straight from a buffer.
+                 *
+                 * @param name          Name of RPC method
+                 * @param input         Encoded arguments; must stay valid until this returns
+                 * @param length        Length of the encoded arguments
+                 * @param output        Stream to encode the result to
+                 * @param connection    Connection the call came in on
+                 * @param deferred      Set to the result to come, if the method answers through a responder
+                 * @return              True if the method was found
+                 */
+                bool invoke(const std::string & name, const char * input, size_t length, std::ostream & output, Pointer connection,
+                        Deferred::Pointer * deferred = NULL) const
+                {
+                    if (_caching) {
+                        const Options * found = options(name);
+                        if (found && found->cache) {
+                            return invokeCached(*found->cache, name, input, length, output, connection, deferred);
+                        }
+                    }
+                    return invokeDirect(name, input, length, output, connection, deferred);
+                }
+
+                template<typename Function, typename... Args>
+                void serialize(const std::string & name, Function function, std::ostream & output, Args && ... args) const
+                {
+                    if (registered(name)) {
+                        RPCRegistry::serialize(function, output, std::forward<Args>(args)...);
+                    } else {
+                        serializeDynamic(typename RPCRegistry::OnlyInRegistry<Function>::type{},
+                                name, function, output, std::forward<Args>(args)...);
+                    }
+                }
+
+                template<typename Function>
+                auto deserialize(const std::string & name, Function function, const char * input, size_t length) const
+                    -> decltype(RPCRegistry::deserialize(function, input, length))
+                {
+                    if (registered(name)) {
+                        return RPCRegistry::deserialize(function, input, length);
+                    }
+
+                    return deserializeDynamic(typename RPCRegistry::OnlyInRegistry<Function>::type{}, name, function, input, length);
+                }
+
+                /**
+                 * Run an RPC method on a worker pool instead of the network thread, where there is one.
+                 * The method then runs alongside the network thread: it can make calls, but mustn't walk
+                 * peers() or look at the interest grid, which the network thread changes as clients come and go.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition (only there so the RPC macros can be used)
+                 * @param ordered   Keep calls from the same connection in the order they arrived
+                 */
+                template<typename Function>
+                void offload(const std::string & name, Function function, bool ordered = true)
+                {
+                    changed();
+                    Options & options = _options[name];
+                    options.offload = true;
+                    options.ordered = ordered;
+                }
+
+                /**
+                 * Send calls to an RPC method, and its results, on a stream other than the default one.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition (only there so the RPC macros can be used)
+                 * @param stream    Stream to send them on
+                 */
+                template<typename Function>
+                void stream(const std::string & name, Function function, StreamID stream)
+                {
+                    changed();
+                    _options[name].stream = stream;
+                }
+
+                /**
+                 * Have a newer call to an RPC method replace one to it still waiting to be sent, for state
+                 * updates where only the latest value matters. Calls that want a result are never replaced.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition (only there so the RPC macros can be used)
+                 * @param keyBytes  Leading bytes of the encoded arguments that tell calls apart, each keeping its
+                 *                  own latest call (e.g. sizeof(int) for an int ID passed first); 0 keeps one in all
+                 */
+                template<typename Function>
+                void coalesce(const std::string & name, Function function, size_t keyBytes = 0)
+                {
+                    changed();
+                    Options & options = _options[name];
+                    options.coalesce = true;
+                    options.keyBytes = keyBytes;
+                }
+
+                /**
+                 * Keep the results of an RPC method that's a pure function of its arguments, so a call with arguments
+                 * it has already answered is answered without running it again. Results a method gives through a
+                 * responder aren't kept, nor are those of calls over linked connections, which aren't encoded.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition (only there so the RPC macros can be used)
+                 * @param entries   Most results kept; the least recently used go first
+                 * @param ttl       How long a result stays good (zero for as long as it's kept)
+                 * @param calls     Also answer calls made to it through this invoker from the cache, before they're
+                 *                  sent; they then never reach the wire. A call answered that way runs its callback
+                 *                  before executeCallback returns, on the thread that made the call, so a callback
+                 *                  mustn't count on being called later, or on the network thread
+                 */
+                template<typename Function>
+                void cache(const std::string & name, Function function, size_t entries = 1024,
+                        ResultCache::Clock::duration ttl = ResultCache::Clock::duration::zero(), bool calls = false)
+                {
+                    changed();
+                    Options & options = _options[name];
+                    options.cache = std::make_shared<ResultCache>(entries, ttl);
+                    options.cacheCalls = calls;
+                    _caching = true;
+                }
+
+                /**
+                 * Forget every result kept for an RPC method, e.g. once what it works them out from has changed.
+                 * Copies of the invoker, and connections made from it, share its caches.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition (only there so the RPC macros can be used)
+                 */
+                template<typename Function>
+                void invalidate(const std::string & name, Function function) const
+                {
+                    const Options * found = options(name);
+                    if (found && found->cache) {
+                        found->cache->clear();
+                    }
+                }
+
+                /**
+                 * Forget the result kept for a call to an RPC method with particular arguments.
+                 *
+                 * @param name      Name of RPC method
+                 * @param function  Function definition for type-safety checking
+                 * @param args...   Arguments of the call
+                 */
+                template<typename Function, typename... Args>
+                void invalidate(const std::string & name, Function function, Args && ... args) const
+                {
+                    const Options * found = options(name);
+                    if (found && found->cache) {
+                        std::stringstream params;
+                        serialize(name, function, params, std::forward<Args>(args)...);
+                        found->cache->invalidate(params.str());
+                    }
+                }
+
+                /**
+                 * Check whether any RPC method's results are kept, so calls needn't look for a cache otherwise.
+                 *
+                 * @return  True if some method has a cache
+                 */
+                bool caching() const
+                {
+                    return _caching;
+                }
+
+                /**
+                 * Get the stream calls to an RPC method are sent on.
+                 *
+                 * @param name  Name of RPC method
+                 * @return      Stream to send them on
+                 */
+                StreamID stream(const std::string & name) const
+                {
+                    const Options * found = options(name);
+                    return found ? found->stream : 0;
+                }
+
+                /**
+                 * Get how an RPC method should be run.
+                 *
+                 * @param name  Name of RPC method
+                 * @return      Options, or NULL if the method uses the defaults
+                 */
+                const Options * options(const std::string & name) const
+                {
+                    auto iter = _options.find(name);
+                    return iter != _options.end() ? &iter->second : NULL;
+                }
+
+            private:
+                bool invokeDirect(const std::string & name, const char * input, size_t length, std::ostream & output, Pointer connection,
+                        Deferred::Pointer * deferred) const
+                {
+                    if (const RPCRegistry::Entry * entry = registered(name)) {
+                        Deferred::Pointer later = entry->thunk(input, length, output, connection);
+                        if (deferred) {
+                            *deferred = later;
+                        }
+                        return true;
+                    }
+
+                    InputBuffer buffer{input, length};
+                    std::istream inputStream{&buffer};
+                    return Base::invoke(name, inputStream, output, connection);
+                }
+
+                bool invokeCached(ResultCache & cache, const std::string & name, const char * input, size_t length, std::ostream & output,
+                        Pointer connection, Deferred::Pointer * deferred) const
+                {
+                    std::string result;
+                    if (cache.find(input, length, result)) {
+                        output.write(result.data(), result.length());
+                        return true;
+                    }
+
+                    std::stringstream fresh;
+                    Deferred::Pointer later;
+                    if (!invokeDirect(name, input, length, fresh, connection, &later)) {
+                        return false;
+                    }
+                    if (later) {
+                        if (deferred) {
+                            *deferred = later;
+                        }
+                        return true;
+                    }
+
+                    result = fresh.str();
+                    cache.store(std::string(input, length), result);
+                    output.write(result.data(), result.length());
+                    return true;
+                }
+
+                void changed()
+                {
+                    // Connections already made keep the methods they were made with
+                    std::atomic_store(&_shared, std::shared_ptr<const RPCInvoker>{});
+                }
+
+                template<typename Function, typename... Args>
+                void serializeDynamic(std::false_type, const std::string & name, Function function, std::ostream & output, Args && ... args) const
+                {
+                    Base::serialize(name, function, output, std::forward<Args>(args)...);
+                }
+
+                template<typename Function, typename... Args>
+                void serializeDynamic(std::true_type, const std::string & name, Function, std::ostream &, Args && ...) const
+                {
+                    throw std::logic_error("RPC method " + name + " takes views or answers later, so it must be in the registry");
+                }
+
+                template<typename Function>
+                auto deserializeDynamic(std::false_type, const std::string & name, Function function, const char * input, size_t length) const
+                    -> decltype(RPCRegistry::deserialize(function, input, length))
+                {
+                    InputBuffer buffer{input, length};
+                    std::istream inputStream{&buffer};
+                    return Base::deserialize(name, function, inputStream);
+                }
+
+                template<typename Function>
+                auto deserializeDynamic(std::true_type, const std::string & name, Function function, const char *, size_t) const
+                    -> decltype(RPCRegistry::deserialize(function, NULL, 0))
+                {
+                    throw std::logic_error("RPC method " + name + " takes views or answers later, so it must be in the registry");
+                }
+
+                std::unordered_map<std::string, Options> _options;
+                const RPCRegistry::Entry * (*_registry)(const char * name, size_t length); // Finds methods in the registry, if set
+                bool _caching; // Some method has a cache
+                mutable std::shared_ptr<const RPCInvoker> _shared; // Copy the connections share, once one is made
+        };
         
         // Maps connections to UUID
         typedef std::unordered_map<boost::uuids::uuid, Connection::WeakPointer, boost::hash<boost::uuids::uuid>> ConnectionMap;
@@ -84,9 +474,34 @@ class Connection: public std::enable_shared_from_this<Connection>
             _uuid = uuid;
         }
 
+        /**
+         * Get the interest grid of the server this connection belongs to.
+         *
+         * @return  Interest grid, or NULL if there is none
+         */
+        InterestGrid * interest() const
+        {
+            return _interest;
+        }
+
+        /**
+         * Set the interest grid of the server this connection belongs to.
+         *
+         * @param interest  Interest grid to use
+         */
+        void interest(InterestGrid * interest)
+        {
+            _interest = interest;
+        }
+
         /**
          * Execute an RPC on the other end of this connection (or immediately locally if not connected)
          *
+         * Any thread can make calls. Those made off the network thread are encoded where they're made and
+         * handed to the network thread to send, in the order each thread made them. Callbacks run on the
+         * network thread, but for results cached on this side, which are handed back straight away. The network
+         * thread is whichever runs the IO service, or has claimed it (see claimThread).
+         *
          * @param name      Name of RPC method
          * @param function  Function definition for type-safety checking
          * @param args...   Arguments to pass to the RPC method
@@ -97,6 +512,54 @@ class Connection: public std::enable_shared_from_this<Connection>
         template<typename Function, typename Callback, typename... Args>
         inline void executeCallback(std::string && name, Function function, Callback callback, Args && ... args);
 
+        /**
+         * Execute an RPC on the other end of this connection, sending it on a particular stream.
+         *
+         * @param stream    Stream to send the call on (METHOD_STREAM for the method's own)
+         * @param name      Name of RPC method
+         * @param function  Function definition for type-safety checking
+         * @param args...   Arguments to pass to the RPC method
+         */
+        template<typename Function, typename... Args>
+        inline void executeOnStream(StreamID stream, std::string && name, Function function, Args && ... args);
+
+        template<typename Function, typename Callback, typename... Args>
+        inline void executeCallbackOnStream(StreamID stream, std::string && name, Function function, Callback callback, Args && ... args);
+
+        // Result of a call made with its arguments already encoded, still encoded
+        typedef std::function<void(const char * result, size_t length)> RemoteExecuteCallback;
+
+        /**
+         * Execute an RPC on the other end of this connection with its arguments already encoded,
+         * for passing on calls that were encoded somewhere else (e.g. on another node of a cluster).
+         *
+         * @param name      Name of RPC method
+         * @param params    Encoded arguments
+         * @param stream    Stream to send the call on (METHOD_STREAM for the method's own)
+         */
+        inline void executeEncoded(const std::string & name, const std::string & params, StreamID stream = METHOD_STREAM);
+
+        /**
+         * Execute an RPC with its arguments already encoded, and be handed its result still encoded.
+         *
+         * @param name      Name of RPC method
+         * @param params    Encoded arguments
+         * @param callback  Called with the encoded result
+         * @param stream    Stream to send the call on (METHOD_STREAM for the method's own)
+         */
+        inline void executeEncodedCallback(const std::string & name, const std::string & params,
+                const RemoteExecuteCallback & callback, StreamID stream = METHOD_STREAM);
+
+        /**
+         * Check whether the client is connected to another node of the cluster rather than this one.
+         *
+         * @return  True if calls to it are passed on to another node
+         */
+        bool remote() const
+        {
+            return _type == Remote;
+        }
+
         /**
          * Disconnect and cleanly shut down the link
          */
@@ -120,60 +583,261 @@ class Connection: public std::enable_shared_from_this<Connection>
 
     protected:
         // Type of connection
-        typedef enum { Unknown, Outgoing, Incoming, Fake } Type;
+        typedef enum { Unknown, Outgoing, Incoming, Fake, Linked, Remote, Proxied } Type;
 
         // Protected to force the use of the factory methods in children classes
         Connection(Type type,
                    const RPCInvoker & invoker,
                    const boost::uuids::uuid & uuid = boost::uuids::nil_uuid())
-            : _invoker{invoker}
+            : _invoker{invoker.shared()}
             , _uuid(uuid)
+            , _interest{NULL}
             , _type{type}
+            , _submissions{}
+            , _sendingSubmissions{false}
         {
             LOG_DEBUG("Connection created");
         }
 
         // For child class access to the invoker
-        RPCInvoker & invoker() { return _invoker; }
+        const RPCInvoker & invoker() const { return *_invoker; }
+
+        Type type() const { return _type; }
 
         // This needs to exist here for the template method execute to be able to pass on calls
-        typedef uint16_t RequestID;
-        static const RequestID REQUEST_ID_RECEIVED_BIT = 0x8000;
-        virtual void remoteExecute(const std::string & name, const std::string & params, RequestID=0) {}
-        typedef std::function<void(std::istream &)> RemoteExecuteCallback;
-        virtual void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback) {}
+        typedef Frame::RequestID RequestID;
+        static const RequestID REQUEST_ID_RECEIVED_BIT = Frame::REQUEST_ID_RECEIVED_BIT;
+        virtual void remoteExecute(const std::string & name, const std::string & params, RequestID, StreamID) {}
+        virtual void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID) {}
+
+        /**
+         * Hand a call made off the network thread over to it, as only the network thread may send.
+         * The network thread is woken for the first call of a batch and sends the whole batch at once.
+         * On the network thread, sends the calls handed over before this one instead, so they go first.
+         * A thread polling the IO service from a loop of its own must claim it (see claimThread), or its
+         * calls are handed over too.
+         *
+         * @param ioService IO service the connection sends from
+         * @param callback  Called with the result; empty if the result isn't wanted
+         * @return          True if the call was handed over; false if it's to be sent now
+         */
+        inline bool handedOver(IOService & ioService, const std::string & name, const std::string & params,
+                const RemoteExecuteCallback & callback, RequestID requestID, StreamID stream);
+
+        // Linked connections pass calls on as closures instead of serializing them
+        typedef std::function<void(Pointer)> LocalCall;
+        virtual void localExecute(LocalCall call) {}
+        virtual void localComplete(std::function<void()> done) {}
 
     private:
-        RPCInvoker _invoker; // RPC methods
+        // A call made off the network thread, waiting for the network thread to send it
+        struct Submission
+        {
+            std::string name;
+            std::string params;
+            RemoteExecuteCallback callback;
+            RequestID requestID;
+            StreamID stream;
+        };
+
+        inline void sendSubmissions();
+
+        // Runs an encoded call here and sends its encoded result, whenever it turns up
+        static void invokeEncoded(const RPCInvoker & invoker, const std::string & name, const std::string & params,
+                Pointer connection, const Deferred::Sender & sender)
+        {
+            std::ostringstream output;
+            Deferred::Pointer later;
+            if (!invoker.invoke(name, params.data(), params.length(), output, connection, &later)) {
+                LOG_WARNING("Call to unknown RPC method ", name, " dropped");
+                return;
+            }
+
+            if (later) {
+                later->attach(sender);
+            } else {
+                sender(output.str());
+            }
+        }
+
+        // Runs a linked call on the peer's side and sends the result back to run the callback on ours
+        template<typename Call, typename Callback>
+        struct LocalCallback
+        {
+            Pointer self;
+            Call call;
+            Callback callback;
+
+            void operator()(Pointer peer)
+            {
+                Returned<typename std::decay<decltype(call(peer))>::type>::deliver(call(peer), LocalResult<Callback>{self, callback});
+            }
+        };
+
+        // Sends a linked call's result back, whenever it turns up
+        template<typename Callback>
+        struct LocalResult
+        {
+            Pointer self;
+            Callback callback;
+
+            template<typename Result>
+            void operator()(const Result & result) const
+            {
+                self->localComplete(std::bind(callback, result));
+            }
+        };
+
+        std::shared_ptr<const RPCInvoker> _invoker; // RPC methods, shared with the other connections made from the same invoker
         boost::uuids::uuid _uuid;
+        InterestGrid * _interest; // Spatial interest of the server's clients
         Type _type;
+        MPSCQueue<Submission> _submissions; // Calls made off the network thread, waiting for it to send them
+        bool _sendingSubmissions; // True while the network thread is sending them, so calls it makes meanwhile don't
 };
 
 template<typename Function, typename... Args>
 void Connection::execute(std::string && name, Function function, Args && ... args)
 {
-    if (_type != Fake) {
+    executeOnStream(METHOD_STREAM, std::forward<std::string>(name), function, std::forward<Args>(args)...);
+}
+
+template<typename Function, typename Callback, typename... Args>
+void Connection::executeCallback(std::string && name, Function function, Callback callback, Args && ... args)
+{
+    executeCallbackOnStream(METHOD_STREAM, std::forward<std::string>(name), function, callback, std::forward<Args>(args)...);
+}
+
+template<typename Function, typename... Args>
+void Connection::executeOnStream(StreamID stream, std::string && name, Function function, Args && ... args)
+{
+    if (_type == Linked) {
+        localExecute(std::bind(function, std::forward<Args>(args)..., std::placeholders::_1));
+    } else if (_type != Fake) {
         std::stringstream serialized;
-        _invoker.serialize(std::forward<std::string>(name), function, serialized, std::forward<Args>(args)...);
-        remoteExecute(std::forward<std::string>(name), serialized.str());
+        _invoker->serialize(std::forward<std::string>(name), function, serialized, std::forward<Args>(args)...);
+        remoteExecute(std::forward<std::string>(name), serialized.str(), 0, stream);
     } else {
         function(std::forward<Args>(args)..., shared_from_this());
     }
 }
 
 template<typename Function, typename Callback, typename... Args>
-void Connection::executeCallback(std::string && name, Function function, Callback callback, Args && ... args)
+void Connection::executeCallbackOnStream(StreamID stream, std::string && name, Function function, Callback callback, Args && ... args)
 {
-    if (_type != Fake) {
+    if (_type == Linked) {
+        auto call = std::bind(function, std::forward<Args>(args)..., std::placeholders::_1);
+        localExecute(LocalCallback<decltype(call), Callback>{shared_from_this(), std::move(call), callback});
+    } else if (_type != Fake) {
         std::stringstream serialized;
-        _invoker.serialize(std::forward<std::string>(name), function, serialized, std::forward<Args>(args)...);
-        remoteExecute(std::forward<std::string>(name), serialized.str(),
-            [this, name, function, callback](std::istream & resultStream) {
-                callback(_invoker.deserialize(name, function, resultStream));
+        _invoker->serialize(std::forward<std::string>(name), function, serialized, std::forward<Args>(args)...);
+
+        // The result may come in on another connection, should the session be resumed there, so hold on to the methods
+        // rather than to this one
+        std::shared_ptr<const RPCInvoker> invoker = _invoker;
+        const RPCInvoker::Options * options = _invoker->caching() ? _invoker->options(name) : NULL;
+        if (options && options->cache && options->cacheCalls) {
+            // Answer it here if it's been answered before, and keep the answer if it hasn't
+            const std::string params = serialized.str();
+            std::string cached;
+            if (options->cache->find(params.data(), params.length(), cached)) {
+                callback(_invoker->deserialize(name, function, cached.data(), cached.length()));
+                return;
             }
+
+            std::shared_ptr<ResultCache> cache = options->cache;
+            remoteExecute(name, params,
+                [invoker, name, function, callback, cache, params](const char * result, size_t length) {
+                    cache->store(params, std::string(result, length));
+                    callback(invoker->deserialize(name, function, result, length));
+                },
+                stream
+            );
+            return;
+        }
+
+        remoteExecute(std::forward<std::string>(name), serialized.str(),
+            [invoker, name, function, callback](const char * result, size_t length) {
+                callback(invoker->deserialize(name, function, result, length));
+            },
+            stream
         );
     } else {
-        callback(function(std::forward<Args>(args)..., shared_from_this()));
+        typedef typename std::decay<decltype(function(std::forward<Args>(args)..., shared_from_this()))>::type Result;
+        Returned<Result>::deliver(function(std::forward<Args>(args)..., shared_from_this()), callback);
+    }
+}
+
+bool Connection::handedOver(IOService & ioService, const std::string & name, const std::string & params,
+        const RemoteExecuteCallback & callback, RequestID requestID, StreamID stream)
+{
+    if (onThreadOf(ioService)) {
+        if (!_submissions.empty()) {
+            sendSubmissions();
+        }
+        return false;
+    }
+
+    if (_submissions.push(Submission{name, params, callback, requestID, stream})) {
+        Pointer self = shared_from_this();
+        ioService.post([self] { self->sendSubmissions(); });
+    }
+    return true;
+}
+
+void Connection::sendSubmissions()
+{
+    if (_sendingSubmissions) {
+        return; // Already sending them further up the stack
+    }
+
+    _sendingSubmissions = true;
+    _submissions.drain([this](Submission & call) {
+        try {
+            if (call.callback) {
+                remoteExecute(call.name, call.params, std::move(call.callback), call.stream);
+            } else {
+                remoteExecute(call.name, call.params, call.requestID, call.stream);
+            }
+        } catch (const std::length_error & e) {
+            // The thread that made it has moved on; all that can be done is say so
+            LOG_ERROR("Dropped call to ", call.name, ": ", e.what());
+        }
+    });
+    _sendingSubmissions = false;
+}
+
+void Connection::executeEncoded(const std::string & name, const std::string & params, StreamID stream)
+{
+    if (_type == Linked) {
+        std::shared_ptr<const RPCInvoker> methods = _invoker;
+        localExecute([methods, name, params](Pointer peer) {
+            invokeEncoded(*methods, name, params, peer, [](const std::string &) {});
+        });
+    } else if (_type != Fake) {
+        remoteExecute(name, params, 0, stream);
+    } else {
+        invokeEncoded(*_invoker, name, params, shared_from_this(), [](const std::string &) {});
+    }
+}
+
+void Connection::executeEncodedCallback(const std::string & name, const std::string & params,
+        const RemoteExecuteCallback & callback, StreamID stream)
+{
+    if (_type == Linked) {
+        std::shared_ptr<const RPCInvoker> methods = _invoker;
+        Pointer self = shared_from_this();
+        localExecute([methods, name, params, self, callback](Pointer peer) {
+            invokeEncoded(*methods, name, params, peer, [self, callback](const std::string & result) {
+                self->localComplete([callback, result] { callback(result.data(), result.length()); });
+            });
+        });
+    } else if (_type != Fake) {
+        remoteExecute(name, params, callback, stream);
+    } else {
+        invokeEncoded(*_invoker, name, params, shared_from_this(), [callback](const std::string & result) {
+            callback(result.data(), result.length());
+        });
     }
 }
 
@@ -40,6 +40,7 @@ class FakeServer: public Server
             , _connection{FakeConnection::create(invoker)}
             , _connectionMap{}
         {
+            _connection->interest(&interest());
             _connectionMap[_connection->uuid()] = _connection;
         }
 
@@ -0,0 +1,215 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace SydNet {
+
+/**
+ * Wire framing shared by the stream transports.
+ *
+ * A call is sent as [size][request ID][name]['\0'][params] and a result as
+ * [size][request ID | REQUEST_ID_RECEIVED_BIT][result], where size counts the bytes after itself.
+ */
+namespace Frame {
+    typedef uint16_t Size;
+    typedef uint16_t RequestID;
+
+    static const RequestID REQUEST_ID_RECEIVED_BIT = 0x8000;
+    static const size_t MAX_SIZE = std::numeric_limits<Size>::max(); // Most bytes after the size prefix
+    static const char PACKET_END = '\0';
+
+    // Control frames are calls to the empty method name; the first parameter byte says what for
+    typedef uint8_t Control;
+    static const Control HEARTBEAT = 0;
+    static const Control SESSION = 1; // Server to client: [session UUID][session secret]
+    static const Control RESUME = 2; // Client to server: [session UUID][session secret][frames received]
+    static const Control RESUMED = 3; // Server to client: [session UUID], followed by the frames missed
+    static const Control RESUME_FAILED = 4; // Server to client: [new session UUID][its secret]
+    static const Control CLOCK = 5; // [sender's clock], asking for a CLOCK_REPLY
+    static const Control CLOCK_REPLY = 6; // [the CLOCK's clock][our clock when it came][our clock when replying]
+    static const Control TRACE = 7; // Before a result: [request ID][nanoseconds from receiving the call to the result]
+
+    // A session's UUID is no secret (peers see it), so resuming one also takes the random secret only its client was sent
+    static const size_t SECRET_BYTES = 16;
+
+    // Clocks sent in CLOCK frames are nanoseconds since the epoch
+    typedef int64_t Time;
+
+    // Every frame but a control frame is counted, so a client resuming a session can say how far it got
+    typedef uint32_t Sequence;
+
+    // A frame picked apart where it lies; the pointers are into the frame's own buffer
+    struct Parts
+    {
+        RequestID requestID; // Without REQUEST_ID_RECEIVED_BIT
+        bool result; // An answer to one of our calls rather than a call
+        const char * name; // Calls only: the method name, not terminated (empty for control frames)
+        size_t nameLength;
+        const char * payload; // The call's parameters, or the result
+        size_t payloadLength;
+    };
+
+    /**
+     * Read a frame's size prefix.
+     *
+     * @param data  Start of the frame, at its size prefix
+     * @return      Size of the frame after the prefix
+     */
+    inline Size readSize(const char * data)
+    {
+        Size size;
+        std::memcpy(&size, data, sizeof(size));
+        return size;
+    }
+
+    /**
+     * Pick a frame apart into its request ID, method name and payload, without copying any of it.
+     *
+     * @param frame     The frame, without its size prefix
+     * @param length    Length of the frame
+     * @param parts     Set to the frame's parts
+     * @return          False if it's too short or a call without a method name
+     */
+    inline bool decode(const char * frame, size_t length, Parts & parts)
+    {
+        if (length < sizeof(RequestID)) {
+            return false;
+        }
+        std::memcpy(&parts.requestID, frame, sizeof(RequestID));
+        const char * body = frame + sizeof(RequestID);
+        size_t bodyLength = length - sizeof(RequestID);
+
+        parts.result = (parts.requestID & REQUEST_ID_RECEIVED_BIT) != 0;
+        parts.requestID &= ~REQUEST_ID_RECEIVED_BIT;
+        if (parts.result) {
+            parts.name = body;
+            parts.nameLength = 0;
+            parts.payload = body;
+            parts.payloadLength = bodyLength;
+            return true;
+        }
+
+        const char * nameEnd = static_cast<const char *>(std::memchr(body, PACKET_END, bodyLength));
+        if (!nameEnd) {
+            return false;
+        }
+        parts.name = body;
+        parts.nameLength = nameEnd - body;
+        parts.payload = nameEnd + sizeof(PACKET_END);
+        parts.payloadLength = body + bodyLength - parts.payload;
+        return true;
+    }
+
+    /**
+     * Check whether a frame is a control frame.
+     *
+     * @param frame     The frame, without its size prefix
+     * @param length    Length of the frame
+     * @return          True if it's a control frame
+     */
+    inline bool isControl(const char * frame, size_t length)
+    {
+        RequestID requestID;
+        if (length <= sizeof(requestID)) {
+            return false;
+        }
+        std::memcpy(&requestID, frame, sizeof(requestID));
+        return !(requestID & REQUEST_ID_RECEIVED_BIT) && frame[sizeof(requestID)] == PACKET_END;
+    }
+
+    /**
+     * Check that a frame fits its size prefix, as one that didn't would leave the other end reading garbage.
+     *
+     * @param length    Bytes after the size prefix
+     * @return          The length, as a size prefix
+     * @throw std::length_error if it's too long
+     */
+    inline Size checkedSize(size_t length)
+    {
+        if (length > MAX_SIZE) {
+            throw std::length_error("Frame of " + std::to_string(length) + " bytes is too long to send");
+        }
+        return static_cast<Size>(length);
+    }
+
+    /**
+     * Write a call frame. Nothing is written if it's too long.
+     *
+     * @param stream    Stream to write the frame to
+     * @param requestID ID the result should be tagged with (0 if no result is wanted)
+     * @param name      Name of the RPC method
+     * @param params    Serialized parameters
+     * @throw std::length_error if the frame would be longer than MAX_SIZE
+     */
+    inline void writeCall(std::ostream & stream, RequestID requestID, const std::string & name, const std::string & params)
+    {
+        Size size = checkedSize(sizeof(RequestID) + name.length() + sizeof(PACKET_END) + params.length());
+        stream.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        stream.write(reinterpret_cast<const char *>(&requestID), sizeof(requestID));
+        stream << name << PACKET_END;
+        stream << params;
+    }
+
+    /**
+     * Write a result frame. Nothing is written if it's too long.
+     *
+     * @param stream    Stream to write the frame to
+     * @param requestID ID of the request being answered
+     * @param result    Serialized result
+     * @throw std::length_error if the frame would be longer than MAX_SIZE
+     */
+    inline void writeResult(std::ostream & stream, RequestID requestID, const std::string & result)
+    {
+        Size size = checkedSize(sizeof(RequestID) + result.length());
+        requestID |= REQUEST_ID_RECEIVED_BIT;
+        stream.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        stream.write(reinterpret_cast<const char *>(&requestID), sizeof(requestID));
+        stream << result;
+    }
+
+    /**
+     * Write a control frame.
+     *
+     * @param stream    Stream to write the frame to
+     * @param control   What the frame is for
+     * @param payload   Anything that goes with it
+     */
+    inline void writeControl(std::ostream & stream, Control control, const std::string & payload = std::string{})
+    {
+        writeCall(stream, 0, std::string{}, std::string(1, static_cast<char>(control)) + payload);
+    }
+}
+
+}
@@ -0,0 +1,655 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "gateway.h"
+
+#include <limits>
+
+/**
+ * Macros used to list and call the methods gateways and the server call on each other, the same way as the RPC macros.
+ */
+#define GATEWAY_RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&Gateway::x), &Gateway::x>("gateway_rpc_" #x)
+#define GATEWAY_SERVER_RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&GatewayListener::x), &GatewayListener::x>("gateway_server_rpc_" #x)
+#define GATEWAY_RPC(x) RPC_CHECKED("gateway_rpc_" #x, Gateway::x)                      // Gateway
+#define GATEWAY_SERVER_RPC(x) RPC_CHECKED("gateway_server_rpc_" #x, GatewayListener::x) // Server
+
+#undef SYDNET_RPC_REGISTRY
+#define SYDNET_RPC_REGISTRY SydNet::GatewayRPCs
+
+namespace SydNet {
+
+namespace {
+    const TimerWheel::Clock::duration REDIAL = std::chrono::seconds(1); // Wait before dialing the server again
+
+    // Largest frame that can be passed on, leaving room for what it's wrapped in
+    const size_t MAX_FRAME = std::numeric_limits<Frame::Size>::max() - 64;
+
+    std::string encode(const boost::uuids::uuid & client)
+    {
+        return std::string(reinterpret_cast<const char *>(client.data), client.size());
+    }
+
+    bool decode(StringView bytes, boost::uuids::uuid & client)
+    {
+        if (bytes.length() != client.size()) {
+            return false;
+        }
+        std::copy(bytes.begin(), bytes.end(), client.begin());
+        return true;
+    }
+}
+
+// Every method gateways and the server call on each other
+struct GatewayRPCs
+{
+    static constexpr RPCRegistry::Entry entries[] = {
+        GATEWAY_RPC_ENTRY(deliver),
+        GATEWAY_RPC_ENTRY(drop),
+        GATEWAY_SERVER_RPC_ENTRY(attach),
+        GATEWAY_SERVER_RPC_ENTRY(detach),
+        GATEWAY_SERVER_RPC_ENTRY(frame),
+    };
+};
+
+constexpr RPCRegistry::Entry GatewayRPCs::entries[];
+
+namespace {
+    Connection::RPCInvoker gatewayMethods()
+    {
+        Connection::RPCInvoker invoker;
+        invoker.registry<GatewayRPCs>();
+        return invoker;
+    }
+}
+
+std::mutex Gateway::_registryMutex;
+std::unordered_map<const Connection *, Gateway *> Gateway::_registry;
+
+std::mutex GatewayListener::_registryMutex;
+std::unordered_map<const Connection *, GatewayListener *> GatewayListener::_registry;
+
+/**
+ * Stands in for a client of a gateway, handling the frames it passes on and sending frames back through it.
+ */
+class GatewayListener::GatewayConnection: public Connection
+{
+    public:
+        /**
+         * Create a connection standing in for a client of a gateway
+         *
+         * @param invoker   RPC invoker the server's clients use
+         * @param ioService IO service of the link
+         * @param uuid      UUID of the client
+         * @param link      Link from the gateway the client is on
+         * @param peers     The server's clients
+         * @return          A shared Pointer to a new connection object
+         */
+        static std::shared_ptr<GatewayConnection> create(const RPCInvoker & invoker, IOService & ioService,
+                const boost::uuids::uuid & uuid, const Connection::Pointer & link, ConnectionMap * peers)
+        {
+            return std::shared_ptr<GatewayConnection>{new GatewayConnection{invoker, ioService, uuid, link, peers}};
+        }
+
+        ConnectionMap & peers()
+        {
+            return *_peers;
+        }
+
+        /**
+         * Have the gateway hang up on the client.
+         */
+        void disconnect()
+        {
+            if (Connection::Pointer link = _link.lock()) {
+                link->execute(GATEWAY_RPC(drop), encode(uuid()));
+            }
+        }
+
+        /**
+         * Handle a frame from the client.
+         *
+         * @param frame     The frame, without its size prefix
+         * @param length    Length of the frame
+         */
+        void handle(const char * frame, size_t length);
+
+        // Can't copy this class
+        GatewayConnection & operator=(const GatewayConnection &) = delete;
+        GatewayConnection(const GatewayConnection &) = delete;
+
+    private:
+        GatewayConnection(const RPCInvoker & invoker, IOService & ioService, const boost::uuids::uuid & uuid,
+                const Connection::Pointer & link, ConnectionMap * peers)
+            : Connection{Proxied, invoker, uuid}
+            , _ioService(ioService)
+            , _link{link}
+            , _peers{peers}
+            , _nextRequestID{1}
+            , _requestCallbacks{}
+        {
+        }
+
+        void remoteExecute(const std::string & name, const std::string & params, RequestID requestID, StreamID stream);
+
+        void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID stream);
+
+        void sendResult(RequestID requestID, const std::string & result, StreamID stream);
+
+        void send(const std::string & frame, StreamID stream);
+
+        IOService & _ioService; // Where the link's calls run
+        Connection::WeakPointer _link; // Link from the gateway the client is on
+        ConnectionMap * _peers; // The server's clients
+        RequestID _nextRequestID;
+        std::vector<std::pair<RequestID, RemoteExecuteCallback>> _requestCallbacks; // Oldest first
+};
+
+void GatewayListener::GatewayConnection::handle(const char * frame, size_t length)
+{
+    Frame::Parts parts;
+    if (!Frame::decode(frame, length, parts)) {
+        LOG_WARNING(length < sizeof(RequestID) ? "Frame too short from " : "Call without a method name from ", uuid());
+        return;
+    }
+    RequestID requestID = parts.requestID;
+
+    if (parts.result) {
+        for (auto iter = _requestCallbacks.begin(); iter != _requestCallbacks.end(); ++iter) {
+            if (iter->first == requestID) {
+                RemoteExecuteCallback callback = iter->second;
+                _requestCallbacks.erase(iter);
+                callback(parts.payload, parts.payloadLength);
+                break;
+            }
+        }
+        return;
+    }
+
+    std::string name(parts.name, parts.nameLength);
+    if (name.empty()) {
+        return; // Control frames are the gateway's business
+    }
+    const char * params = parts.payload;
+    size_t paramsLength = parts.payloadLength;
+
+    std::stringstream result;
+    Deferred::Pointer deferred;
+    try {
+        if (!invoker().invoke(name, params, paramsLength, result, shared_from_this(), &deferred) || !requestID
+                || !invoker().answers(name)) {
+            return;
+        }
+    } catch (const std::exception & e) {
+        // Only this client is at fault, not the link or the other clients on it
+        LOG_WARNING("Dropping client ", uuid(), " after a call to ", name, " failed: ", e.what());
+        disconnect();
+        return;
+    }
+
+    StreamID stream = invoker().stream(name);
+    if (deferred) {
+        // The result may turn up on any thread; send it from the link's
+        std::weak_ptr<GatewayConnection> weakSelf = std::static_pointer_cast<GatewayConnection>(shared_from_this());
+        IOService & ioService = _ioService;
+        deferred->attach([weakSelf, &ioService, requestID, stream](const std::string & answer) {
+            ioService.post([weakSelf, requestID, stream, answer] {
+                if (std::shared_ptr<GatewayConnection> self = weakSelf.lock()) {
+                    self->sendResult(requestID, answer, stream);
+                }
+            });
+        });
+    } else {
+        sendResult(requestID, result.str(), stream);
+    }
+}
+
+void GatewayListener::GatewayConnection::remoteExecute(const std::string & name, const std::string & params,
+        RequestID requestID, StreamID stream)
+{
+    if (handedOver(_ioService, name, params, nullptr, requestID, stream)) {
+        return; // Only the network thread may use the link
+    }
+
+    std::ostringstream frame;
+    Frame::writeCall(frame, requestID, name, params);
+    send(frame.str(), stream == METHOD_STREAM ? invoker().stream(name) : stream);
+}
+
+void GatewayListener::GatewayConnection::remoteExecute(const std::string & name, const std::string & params,
+        RemoteExecuteCallback callback, StreamID stream)
+{
+    if (handedOver(_ioService, name, params, callback, 0, stream)) {
+        return; // The callback will run on the network thread too
+    }
+
+    // Nothing times requests out here; a client that never answers can only hold on to so many
+    if (_requestCallbacks.size() >= REQUEST_ID_RECEIVED_BIT - 1) {
+        _requestCallbacks.erase(_requestCallbacks.begin());
+    }
+
+    RequestID requestID = _nextRequestID++;
+    if (!_nextRequestID || _nextRequestID & REQUEST_ID_RECEIVED_BIT) {
+        _nextRequestID = 1;
+    }
+    _requestCallbacks.push_back(std::make_pair(requestID, callback));
+    remoteExecute(name, params, requestID, stream);
+}
+
+void GatewayListener::GatewayConnection::sendResult(RequestID requestID, const std::string & result, StreamID stream)
+{
+    std::ostringstream frame;
+    try {
+        Frame::writeResult(frame, requestID, result);
+    } catch (const std::length_error & e) {
+        LOG_ERROR("Dropped result for ", uuid(), ": ", e.what());
+        return;
+    }
+    send(frame.str(), stream);
+}
+
+void GatewayListener::GatewayConnection::send(const std::string & frame, StreamID stream)
+{
+    Connection::Pointer link = _link.lock();
+    if (!link) {
+        LOG_WARNING("Frame to ", uuid(), " dropped; its gateway is gone");
+        return;
+    }
+
+    // Written with its size in front; the gateway only wants what follows it
+    size_t length = frame.length() - sizeof(Frame::Size);
+    if (length > MAX_FRAME) {
+        LOG_WARNING("Frame to ", uuid(), " too big to pass through a gateway dropped");
+        return;
+    }
+    link->execute(GATEWAY_RPC(deliver), encode(uuid()), StringView{frame.data() + sizeof(Frame::Size), length}, stream);
+}
+
+
+/***************
+ * Constructors
+ ***************/
+
+Gateway::Gateway(IOService & ioService, unsigned short port, const boost::asio::ip::tcp::endpoint & server,
+        size_t links, const RealServer::Listening & listening)
+    : _ioService(ioService)
+    , _invoker{gatewayMethods()}
+    , _clients{Connection::RPCInvoker{}, ioService, port, listening}
+    , _timers{new TimerWheel{ioService}}
+    , _timeouts()
+    , _server{server}
+    , _links{}
+    , _pinned{}
+{
+    _clients.onMembership(std::bind(&Gateway::handleMembership, this, std::placeholders::_1, std::placeholders::_2));
+
+    for (size_t i = 0; i < std::max<size_t>(1, links); ++i) {
+        std::shared_ptr<Link> link = std::make_shared<Link>(this, i);
+        _links.push_back(link);
+        dial(link);
+    }
+}
+
+Gateway::~Gateway()
+{
+    _clients.onMembership(RealServer::MembershipHandler{});
+
+    for (auto & link: _links) {
+        {
+            std::lock_guard<std::mutex> lock{_registryMutex};
+            _registry.erase(link->connection.get());
+        }
+        std::shared_ptr<OutgoingConnection> connection = std::static_pointer_cast<OutgoingConnection>(link->connection);
+        connection->onDisconnect(OutgoingConnection::DisconnectHandler{});
+        try {
+            connection->disconnect();
+        } catch (const boost::system::system_error & e) {
+            LOG_INFO("Error dropping a link: ", e.what());
+        }
+    }
+}
+
+GatewayListener::GatewayListener(RealServer & server, IOService & ioService, unsigned short port)
+    : _server(server)
+    , _ioService(ioService)
+    , _invoker{gatewayMethods()}
+    , _links{_invoker, ioService, port}
+    , _gateways{}
+    , _proxied{}
+{
+    _links.onMembership(std::bind(&GatewayListener::handleLink, this, std::placeholders::_1, std::placeholders::_2));
+}
+
+GatewayListener::~GatewayListener()
+{
+    _links.onMembership(RealServer::MembershipHandler{});
+
+    for (auto & gateway: _gateways) {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry.erase(gateway.second.key);
+    }
+    while (!_proxied.empty()) {
+        release(_proxied.begin()->first);
+    }
+}
+
+
+/******************
+ * Private methods
+ ******************/
+
+void Gateway::deliver(StringView client, StringView frame, Connection::StreamID stream, Connection::Pointer link)
+{
+    boost::uuids::uuid uuid;
+    Gateway * gateway = gatewayOf(link);
+    if (!gateway || !decode(client, uuid)) {
+        return;
+    }
+
+    if (std::shared_ptr<RealConnection> connection = gateway->client(uuid)) {
+        connection->sendFrame(frame.data(), frame.length(), stream);
+    }
+}
+
+void Gateway::drop(StringView client, Connection::Pointer link)
+{
+    boost::uuids::uuid uuid;
+    Gateway * gateway = gatewayOf(link);
+    if (!gateway || !decode(client, uuid)) {
+        return;
+    }
+
+    if (std::shared_ptr<RealConnection> connection = gateway->client(uuid)) {
+        LOG_NOTICE("Server hung up on ", uuid);
+        gateway->_ioService.post([connection] {
+            try {
+                connection->disconnect();
+            } catch (const boost::system::system_error & e) {
+                LOG_INFO("Error dropping a client: ", e.what());
+            }
+        });
+    }
+}
+
+Gateway * Gateway::gatewayOf(const Connection::Pointer & link)
+{
+    std::lock_guard<std::mutex> lock{_registryMutex};
+    auto iter = _registry.find(link.get());
+    return iter != _registry.end() ? iter->second : NULL;
+}
+
+void Gateway::handleMembership(const boost::uuids::uuid & client, bool joins)
+{
+    if (!joins) {
+        auto iter = _pinned.find(client);
+        if (iter != _pinned.end()) {
+            Link & link = *_links[iter->second];
+            if (link.up) {
+                link.connection->execute(GATEWAY_SERVER_RPC(detach), encode(client));
+            }
+            _pinned.erase(iter);
+        }
+        return;
+    }
+
+    std::shared_ptr<RealConnection> connection = this->client(client);
+    if (!connection) {
+        return;
+    }
+    connection->frameHandler(std::bind(&Gateway::handleFrame, this, Connection::WeakPointer{connection},
+                std::placeholders::_1, std::placeholders::_2));
+
+    // Clients that turn up while every link is down wait on the one they'd have had
+    Link * link = pick(client);
+    _pinned[client] = link ? link->index : boost::hash<boost::uuids::uuid>{}(client) % _links.size();
+    if (link) {
+        attach(client, *link);
+    }
+}
+
+bool Gateway::handleFrame(const Connection::WeakPointer & weakClient, const char * frame, size_t length)
+{
+    if (Frame::isControl(frame, length)) {
+        return false; // Heartbeats, clocks and sessions end here
+    }
+
+    Connection::Pointer client = weakClient.lock();
+    if (!client) {
+        return true;
+    }
+
+    auto iter = _pinned.find(client->uuid());
+    if (iter == _pinned.end() || !_links[iter->second]->up) {
+        LOG_DEBUG("Frame from ", client->uuid(), " dropped; no link to the server");
+        return true;
+    }
+    if (length > MAX_FRAME) {
+        LOG_WARNING("Frame from ", client->uuid(), " too big to pass on dropped");
+        return true;
+    }
+
+    _links[iter->second]->connection->execute(GATEWAY_SERVER_RPC(frame), encode(client->uuid()), StringView{frame, length});
+    return true;
+}
+
+void Gateway::dial(const std::shared_ptr<Link> & link)
+{
+    std::weak_ptr<Link> weakLink = link;
+    link->connection = OutgoingConnection::create(_invoker, _ioService, _server,
+            std::bind(&Gateway::handleDial, weakLink, std::placeholders::_1));
+}
+
+void Gateway::handleDial(const std::weak_ptr<Link> & weakLink, const boost::system::error_code & error)
+{
+    std::shared_ptr<Link> link = weakLink.lock();
+    if (!link) {
+        return;
+    }
+    Gateway & gateway = *link->gateway;
+
+    if (error) {
+        LOG_INFO("Server at ", gateway._server, " not there: ", error.message());
+        gateway.redial(link);
+        return;
+    }
+
+    LOG_NOTICE("Linked to server: ", gateway._server);
+    std::shared_ptr<OutgoingConnection> connection = std::static_pointer_cast<OutgoingConnection>(link->connection);
+    connection->onDisconnect(std::bind(&Gateway::handleLinkDisconnect, weakLink, std::placeholders::_1));
+    if (gateway._timeouts.heartbeat.count() || gateway._timeouts.idle.count() || gateway._timeouts.request.count()) {
+        connection->timeouts(gateway._timers, gateway._timeouts);
+    }
+    {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry[connection.get()] = &gateway;
+    }
+    link->up = true;
+
+    // Clients waiting on it can go ahead
+    for (auto & pinned: gateway._pinned) {
+        if (pinned.second == link->index) {
+            gateway.attach(pinned.first, *link);
+        }
+    }
+}
+
+void Gateway::handleLinkDisconnect(const std::weak_ptr<Link> & weakLink, const boost::system::error_code & error)
+{
+    std::shared_ptr<Link> link = weakLink.lock();
+    if (!link) {
+        return;
+    }
+    Gateway & gateway = *link->gateway;
+
+    LOG_NOTICE("Link to server dropped: ", error.message());
+    link->up = false;
+    {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry.erase(link->connection.get());
+    }
+
+    // The server has let its clients go; start them afresh on another link, if there is one
+    for (auto & pinned: gateway._pinned) {
+        if (pinned.second == link->index) {
+            if (Link * other = gateway.pick(pinned.first)) {
+                pinned.second = other->index;
+                gateway.attach(pinned.first, *other);
+            }
+        }
+    }
+
+    gateway.redial(link);
+}
+
+void Gateway::redial(const std::shared_ptr<Link> & link)
+{
+    std::weak_ptr<Link> weakLink = link;
+    _timers->schedule(link->retry, REDIAL, [weakLink] {
+        if (std::shared_ptr<Link> link = weakLink.lock()) {
+            link->gateway->dial(link);
+        }
+    });
+}
+
+Gateway::Link * Gateway::pick(const boost::uuids::uuid & client)
+{
+    // Spread clients over the links by UUID, skipping any that are down
+    size_t first = boost::hash<boost::uuids::uuid>{}(client) % _links.size();
+    for (size_t i = 0; i < _links.size(); ++i) {
+        Link & link = *_links[(first + i) % _links.size()];
+        if (link.up) {
+            return &link;
+        }
+    }
+    return NULL;
+}
+
+void Gateway::attach(const boost::uuids::uuid & client, Link & link)
+{
+    link.connection->execute(GATEWAY_SERVER_RPC(attach), encode(client));
+}
+
+std::shared_ptr<RealConnection> Gateway::client(const boost::uuids::uuid & client)
+{
+    auto iter = _clients.clients().find(client);
+    if (iter == _clients.clients().end()) {
+        return std::shared_ptr<RealConnection>{};
+    }
+    return std::static_pointer_cast<RealConnection>(iter->second.lock());
+}
+
+void GatewayListener::attach(StringView client, Connection::Pointer link)
+{
+    boost::uuids::uuid uuid;
+    GatewayListener * listener = listenerOf(link);
+    if (!listener || !decode(client, uuid)) {
+        return;
+    }
+
+    if (listener->_server.clients().count(uuid)) {
+        LOG_WARNING("Client ", uuid, " from a gateway is already here");
+        return;
+    }
+
+    std::shared_ptr<GatewayConnection> connection = GatewayConnection::create(listener->_server.invoker(),
+            listener->_ioService, uuid, link, &listener->_server.clients());
+    listener->_proxied[uuid] = connection;
+    listener->_gateways[link->uuid()].clients.insert(uuid);
+    listener->_server.adopt(connection);
+}
+
+void GatewayListener::detach(StringView client, Connection::Pointer link)
+{
+    boost::uuids::uuid uuid;
+    GatewayListener * listener = listenerOf(link);
+    if (!listener || !decode(client, uuid)) {
+        return;
+    }
+
+    listener->_gateways[link->uuid()].clients.erase(uuid);
+    listener->release(uuid);
+}
+
+void GatewayListener::frame(StringView client, StringView frame, Connection::Pointer link)
+{
+    boost::uuids::uuid uuid;
+    GatewayListener * listener = listenerOf(link);
+    if (!listener || !decode(client, uuid)) {
+        return;
+    }
+
+    auto iter = listener->_proxied.find(uuid);
+    if (iter != listener->_proxied.end()) {
+        std::shared_ptr<GatewayConnection> connection = iter->second; // Handling it may let it go
+        connection->handle(frame.data(), frame.length());
+    }
+}
+
+GatewayListener * GatewayListener::listenerOf(const Connection::Pointer & link)
+{
+    std::lock_guard<std::mutex> lock{_registryMutex};
+    auto iter = _registry.find(link.get());
+    return iter != _registry.end() ? iter->second : NULL;
+}
+
+void GatewayListener::handleLink(const boost::uuids::uuid & link, bool joins)
+{
+    if (joins) {
+        auto iter = _links.clients().find(link);
+        if (iter != _links.clients().end()) {
+            LOG_NOTICE("Gateway linked: ", link);
+            Connection::Pointer connection = iter->second.lock();
+            _gateways[link].key = connection.get();
+            std::lock_guard<std::mutex> lock{_registryMutex};
+            _registry[connection.get()] = this;
+        }
+        return;
+    }
+
+    auto iter = _gateways.find(link);
+    if (iter == _gateways.end()) {
+        return;
+    }
+
+    LOG_NOTICE("Gateway unlinked: ", link, " (", iter->second.clients.size(), " clients)");
+    {
+        std::lock_guard<std::mutex> lock{_registryMutex};
+        _registry.erase(iter->second.key);
+    }
+    for (const boost::uuids::uuid & client: iter->second.clients) {
+        release(client);
+    }
+    _gateways.erase(iter);
+}
+
+void GatewayListener::release(const boost::uuids::uuid & client)
+{
+    if (_proxied.erase(client)) {
+        _server.release(client);
+    }
+}
+
+}
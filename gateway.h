@@ -0,0 +1,239 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "real_server.h"
+#include "outgoing_connection.h"
+
+namespace SydNet {
+
+struct GatewayRPCs;
+
+/**
+ * Takes clients' connections in place of a server, passing their frames on to it over a few links.
+ *
+ * Clients connect to the gateway as they would to the server. The gateway answers their heartbeats, clock
+ * checks and session resumes itself, and passes every other frame on as it is, over one of its links to
+ * the server and tagged with the client's UUID. Frames the server sends a client come back the same way.
+ * The server (see GatewayListener) so only has a handful of sockets however many clients there are, and
+ * gateways can be added as they fill up.
+ *
+ * Each client is kept to one link so its frames stay in order. While a link is down its clients are moved
+ * to another; the server sees them leave and join again, so anything it was in the middle of for them is
+ * lost.
+ */
+class Gateway
+{
+    public:
+        /**
+         * Start a gateway, accepting clients and linking to the server.
+         *
+         * @param ioService IO service to use
+         * @param port      Port to accept clients on
+         * @param server    Address the server listens for gateways on
+         * @param links     Links to keep to the server
+         * @param listening How to listen for clients
+         */
+        Gateway(IOService & ioService, unsigned short port, const boost::asio::ip::tcp::endpoint & server,
+                size_t links = 4, const RealServer::Listening & listening = RealServer::Listening{});
+
+        /**
+         * Get the server clients connect to; set its timeouts, resumption and so on as for any other.
+         *
+         * @return  The gateway's own server
+         */
+        RealServer & clients()
+        {
+            return _clients;
+        }
+
+        /**
+         * Supervise the links to the server with heartbeats and timeouts.
+         *
+         * @param timeouts  Timeouts to use; any left at zero are turned off
+         */
+        void timeouts(const RealConnection::Timeouts & timeouts)
+        {
+            _timeouts = timeouts;
+        }
+
+        ~Gateway();
+
+        // Can't copy this class
+        Gateway & operator=(const Gateway &) = delete;
+        Gateway(const Gateway &) = delete;
+
+    private:
+        friend struct GatewayRPCs;
+        friend class GatewayListener;
+
+        // Link to the server
+        struct Link
+        {
+            Link(Gateway * gateway, size_t index)
+                : gateway{gateway}
+                , index{index}
+                , connection{}
+                , up{false}
+                , retry{}
+            {
+            }
+
+            Gateway * gateway;
+            size_t index;
+            Connection::Pointer connection;
+            bool up;
+            TimerWheel::Timer retry;
+
+            Link & operator=(const Link &) = delete;
+            Link(const Link &) = delete;
+        };
+
+        // RPCs from the server
+        static void deliver(StringView client, StringView frame, Connection::StreamID stream, Connection::Pointer link);
+        static void drop(StringView client, Connection::Pointer link);
+
+        static Gateway * gatewayOf(const Connection::Pointer & link);
+
+        void handleMembership(const boost::uuids::uuid & client, bool joins);
+
+        bool handleFrame(const Connection::WeakPointer & weakClient, const char * frame, size_t length);
+
+        void dial(const std::shared_ptr<Link> & link);
+
+        static void handleDial(const std::weak_ptr<Link> & weakLink, const boost::system::error_code & error);
+
+        static void handleLinkDisconnect(const std::weak_ptr<Link> & weakLink, const boost::system::error_code & error);
+
+        void redial(const std::shared_ptr<Link> & link);
+
+        Link * pick(const boost::uuids::uuid & client);
+
+        void attach(const boost::uuids::uuid & client, Link & link);
+
+        std::shared_ptr<RealConnection> client(const boost::uuids::uuid & client);
+
+        IOService & _ioService;
+        Connection::RPCInvoker _invoker; // Methods the gateway and the server call on each other
+        RealServer _clients;
+        TimerWheel::Pointer _timers;
+        RealConnection::Timeouts _timeouts;
+        boost::asio::ip::tcp::endpoint _server;
+        std::vector<std::shared_ptr<Link>> _links;
+        std::unordered_map<boost::uuids::uuid, size_t, boost::hash<boost::uuids::uuid>> _pinned; // Link each client's frames go over
+
+        static std::mutex _registryMutex;
+        static std::unordered_map<const Connection *, Gateway *> _registry; // Every gateway, by its links that are up
+};
+
+/**
+ * Lets clients reach a server through gateways (see Gateway), listening for links from them.
+ *
+ * Each client of a gateway joins the server as a connection standing in for it, so it's in clients() and
+ * peers() like any other. Its calls run on the network thread; offloading and request timeouts don't
+ * apply to them.
+ */
+class GatewayListener
+{
+    public:
+        /**
+         * Listen for links from gateways.
+         *
+         * @param server    Server the gateways' clients join
+         * @param ioService IO service to use for links (the server's own)
+         * @param port      Port to listen for gateways on
+         */
+        GatewayListener(RealServer & server, IOService & ioService, unsigned short port);
+
+        /**
+         * Supervise links from gateways with heartbeats and timeouts.
+         *
+         * @param timeouts  Timeouts to use; any left at zero are turned off
+         */
+        void timeouts(const RealConnection::Timeouts & timeouts)
+        {
+            _links.timeouts(timeouts);
+        }
+
+        ~GatewayListener();
+
+        // Can't copy this class
+        GatewayListener & operator=(const GatewayListener &) = delete;
+        GatewayListener(const GatewayListener &) = delete;
+
+    private:
+        friend struct GatewayRPCs;
+        friend class Gateway;
+        class GatewayConnection;
+
+        // Link from a gateway
+        struct Link
+        {
+            Link()
+                : key{NULL}
+                , clients{}
+            {
+            }
+
+            const Connection * key; // Where it's registered
+            std::unordered_set<boost::uuids::uuid, boost::hash<boost::uuids::uuid>> clients; // Clients it brought
+
+            Link & operator=(const Link &) = delete;
+            Link(const Link &) = delete;
+        };
+
+        // RPCs from gateways
+        static void attach(StringView client, Connection::Pointer link);
+        static void detach(StringView client, Connection::Pointer link);
+        static void frame(StringView client, StringView frame, Connection::Pointer link);
+
+        static GatewayListener * listenerOf(const Connection::Pointer & link);
+
+        void handleLink(const boost::uuids::uuid & link, bool joins);
+
+        void release(const boost::uuids::uuid & client);
+
+        RealServer & _server;
+        IOService & _ioService;
+        Connection::RPCInvoker _invoker; // Methods the gateway and the server call on each other
+        RealServer _links; // Links from gateways
+        std::unordered_map<boost::uuids::uuid, Link, boost::hash<boost::uuids::uuid>> _gateways; // Links, by their UUIDs
+        std::unordered_map<boost::uuids::uuid, std::shared_ptr<GatewayConnection>, boost::hash<boost::uuids::uuid>> _proxied; // Stand-ins for them
+
+        static std::mutex _registryMutex;
+        static std::unordered_map<const Connection *, GatewayListener *> _registry; // Every listener, by its links
+};
+
+}
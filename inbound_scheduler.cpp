@@ -0,0 +1,334 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "inbound_scheduler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace SydNet {
+
+/*****************
+ * Public methods
+ *****************/
+
+InboundScheduler::InboundScheduler(IOService & ioService, const Limits & limits)
+    : _ioService(ioService)
+    , _limits(validate(limits))
+    , _counters()
+    , _clients{}
+    , _runQueue{}
+    , _throttled{}
+    , _turnPending{false}
+    , _timer{ioService}
+    , _timerExpiry{Clock::time_point::max()}
+{
+}
+
+bool InboundScheduler::submit(const boost::uuids::uuid & uuid, const std::string & method, const Job & job, const Job & resume)
+{
+    Client & queued = client(uuid);
+    queued.queue.push_back(std::make_pair(method, job));
+
+    if (!queued.running && !queued.throttled) {
+        queued.running = true;
+        _runQueue.push_back(uuid);
+        schedule();
+    }
+
+    if (queued.queue.size() >= _limits.maxQueued) {
+        if (!queued.paused) {
+            LOG_INFO("Pausing reads from ", uuid, " until its calls catch up");
+            queued.paused = true;
+            queued.resume = resume;
+            ++queued.counters.paused;
+            ++_counters.paused;
+        }
+        return false;
+    }
+    return true;
+}
+
+void InboundScheduler::remove(const boost::uuids::uuid & uuid)
+{
+    auto iter = _clients.find(uuid);
+    if (iter == _clients.end()) {
+        return;
+    }
+
+    if (iter->second.active) {
+        // Can't erase it from under its own call; its turn cleans it up
+        iter->second.removed = true;
+        iter->second.queue.clear();
+        iter->second.resume = Job{};
+    } else {
+        _clients.erase(iter);
+    }
+}
+
+void InboundScheduler::limits(const Limits & limits)
+{
+    _limits = validate(limits);
+
+    for (auto & entry: _clients) {
+        Client & client = entry.second;
+        client.overall.rate = _limits.overall;
+        client.overall.tokens = std::min(client.overall.tokens, _limits.overall.burst);
+
+        for (auto iter = client.methods.begin(); iter != client.methods.end();) {
+            auto limit = _limits.methods.find(iter->first);
+            if (limit == _limits.methods.end()) {
+                iter = client.methods.erase(iter);
+            } else {
+                iter->second.rate = limit->second;
+                iter->second.tokens = std::min(iter->second.tokens, limit->second.burst);
+                ++iter;
+            }
+        }
+    }
+}
+
+InboundScheduler::Counters InboundScheduler::counters(const boost::uuids::uuid & uuid) const
+{
+    auto iter = _clients.find(uuid);
+    return iter != _clients.end() ? iter->second.counters : Counters();
+}
+
+
+/******************
+* Private methods
+******************/
+
+void InboundScheduler::TokenBucket::refill(Clock::time_point now)
+{
+    double seconds = std::chrono::duration<double>(now - last).count();
+    tokens = std::min(rate.burst, tokens + seconds * rate.perSecond);
+    last = now;
+}
+
+bool InboundScheduler::TokenBucket::available() const
+{
+    return rate.perSecond <= 0 || tokens >= 1;
+}
+
+void InboundScheduler::TokenBucket::take()
+{
+    if (rate.perSecond > 0) {
+        tokens -= 1;
+    }
+}
+
+InboundScheduler::Clock::duration InboundScheduler::TokenBucket::wait() const
+{
+    if (available()) {
+        return Clock::duration::zero();
+    }
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - tokens) / rate.perSecond));
+}
+
+const InboundScheduler::Limits & InboundScheduler::validate(const Limits & limits)
+{
+    // A bucket that can't hold a whole token never has one to spend
+    bool starved = limits.overall.perSecond > 0 && limits.overall.burst < 1;
+    for (auto & method: limits.methods) {
+        starved = starved || (method.second.perSecond > 0 && method.second.burst < 1);
+    }
+    if (starved) {
+        throw std::invalid_argument("A rate limit with a burst of less than one call was given");
+    }
+
+    // A turn that runs nothing only queues the next one, and a queue that holds nothing pauses every read
+    if (!limits.budget) {
+        throw std::invalid_argument("A budget of no calls per turn was given");
+    }
+    if (!limits.maxQueued) {
+        throw std::invalid_argument("A queue of no calls was given");
+    }
+    return limits;
+}
+
+InboundScheduler::Client & InboundScheduler::client(const boost::uuids::uuid & uuid)
+{
+    auto iter = _clients.find(uuid);
+    if (iter == _clients.end()) {
+        iter = _clients.emplace(uuid, Client{_limits.overall, Clock::now()}).first;
+    }
+    return iter->second;
+}
+
+bool InboundScheduler::run(const boost::uuids::uuid & uuid, Client & client)
+{
+    Clock::time_point now = Clock::now();
+    client.overall.refill(now);
+
+    client.active = true;
+    for (size_t done = 0; done < _limits.budget && !client.queue.empty() && !client.removed; ++done) {
+        const std::string & method = client.queue.front().first;
+
+        TokenBucket * methodBucket = NULL;
+        auto limit = _limits.methods.find(method);
+        if (limit != _limits.methods.end()) {
+            auto iter = client.methods.find(method);
+            if (iter == client.methods.end()) {
+                iter = client.methods.insert(std::make_pair(method, TokenBucket{limit->second, now})).first;
+            }
+            methodBucket = &iter->second;
+            methodBucket->refill(now);
+        }
+
+        if (!client.overall.available() || (methodBucket && !methodBucket->available())) {
+            // Out of tokens; sit out until the bucket that ran dry has refilled
+            Clock::duration wait = client.overall.wait();
+            if (methodBucket) {
+                wait = std::max(wait, methodBucket->wait());
+            }
+            client.throttled = true;
+            client.wake = now + wait;
+            _throttled.push_back(uuid);
+            wakeAt(client.wake);
+            ++client.counters.throttled;
+            ++_counters.throttled;
+            break;
+        }
+
+        client.overall.take();
+        if (methodBucket) {
+            methodBucket->take();
+        }
+
+        Job job = std::move(client.queue.front().second);
+        client.queue.pop_front();
+        ++client.counters.executed;
+        ++_counters.executed;
+        job();
+    }
+    client.active = false;
+
+    if (client.removed) {
+        return false;
+    }
+
+    if (client.paused && client.queue.size() <= _limits.maxQueued / 2) {
+        LOG_INFO("Resuming reads from ", uuid);
+        client.paused = false;
+        Job resume = std::move(client.resume);
+        client.resume = Job{};
+        resume();
+    }
+
+    if (!client.queue.empty() && !client.running && !client.throttled) {
+        client.running = true;
+        _runQueue.push_back(uuid);
+    }
+    return true;
+}
+
+void InboundScheduler::turn()
+{
+    _turnPending = false;
+
+    // Only the clients already waiting get a turn now, so reads get to run between turns
+    for (size_t count = _runQueue.size(); count && !_runQueue.empty(); --count) {
+        boost::uuids::uuid uuid = _runQueue.front();
+        _runQueue.pop_front();
+
+        auto iter = _clients.find(uuid);
+        if (iter == _clients.end()) {
+            continue;
+        }
+
+        iter->second.running = false;
+        if (!run(uuid, iter->second)) {
+            _clients.erase(uuid);
+        }
+    }
+
+    if (!_runQueue.empty()) {
+        schedule();
+    }
+}
+
+void InboundScheduler::schedule()
+{
+    if (!_turnPending) {
+        _turnPending = true;
+        _ioService.post(std::bind(&InboundScheduler::turn, this));
+    }
+}
+
+void InboundScheduler::wakeAt(Clock::time_point time)
+{
+    if (time >= _timerExpiry) {
+        return; // Already waking up sooner
+    }
+
+    _timerExpiry = time;
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(time - Clock::now());
+    _timer.expires_from_now(boost::posix_time::microseconds(std::max<int64_t>(wait.count(), 0)));
+    _timer.async_wait(std::bind(&InboundScheduler::handleTimer, this, std::placeholders::_1));
+}
+
+void InboundScheduler::handleTimer(const boost::system::error_code & error)
+{
+    if (error == boost::asio::error::operation_aborted) {
+        return; // Rearmed for an earlier time
+    }
+    _timerExpiry = Clock::time_point::max();
+
+    Clock::time_point now = Clock::now();
+    Clock::time_point next = Clock::time_point::max();
+    std::vector<boost::uuids::uuid> stillThrottled;
+
+    for (auto & uuid: _throttled) {
+        auto iter = _clients.find(uuid);
+        if (iter == _clients.end()) {
+            continue;
+        }
+
+        Client & client = iter->second;
+        if (client.wake > now) {
+            next = std::min(next, client.wake);
+            stillThrottled.push_back(uuid);
+        } else {
+            client.throttled = false;
+            if (!client.queue.empty() && !client.running) {
+                client.running = true;
+                _runQueue.push_back(uuid);
+            }
+        }
+    }
+    _throttled.swap(stillThrottled);
+
+    if (!_runQueue.empty()) {
+        schedule();
+    }
+    if (next != Clock::time_point::max()) {
+        wakeAt(next);
+    }
+}
+
+}
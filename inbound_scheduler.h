@@ -0,0 +1,217 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include "io_service.h"
+#include "connection.h"
+
+namespace SydNet {
+
+/**
+ * Runs received RPCs fairly across connections instead of inline as they arrive.
+ *
+ * Each connection has a token bucket for all its calls and one per limited method. Connections
+ * take turns in round-robin order, running at most a budget of calls per turn; a connection out
+ * of tokens waits until its bucket refills. Calls are only ever deferred, never dropped, but a
+ * connection with too many calls queued should stop being read from until it catches up.
+ */
+class InboundScheduler
+{
+    public:
+        typedef std::function<void()> Job;
+
+        struct Rate
+        {
+            double perSecond; // Tokens added per second; unlimited if not positive
+            double burst; // Most tokens that can be saved up; at least 1 if limited
+        };
+
+        struct Limits
+        {
+            // Unlimited rates, with a few calls a turn and a few turns' worth waiting
+            Limits()
+                : overall{}
+                , methods{}
+                , budget{8}
+                , maxQueued{64}
+            {
+            }
+
+            Rate overall; // Across all of a connection's calls
+            std::unordered_map<std::string, Rate> methods; // Per RPC method name
+            size_t budget; // Calls a connection can run per turn; at least 1
+            size_t maxQueued; // Calls a connection can have waiting before it should stop being read; at least 1
+        };
+
+        struct Counters
+        {
+            uint64_t executed; // Calls run
+            uint64_t throttled; // Times a call had to wait for tokens
+            uint64_t paused; // Times a connection's queue filled up
+        };
+
+        /**
+         * Create a scheduler.
+         *
+         * @param ioService IO service turns are run on
+         * @param limits    Limits applied to every connection
+         * @throw std::invalid_argument if a limited rate's burst is less than 1, so it could never run a call, or
+         *        the budget or most calls queued is 0
+         */
+        InboundScheduler(IOService & ioService, const Limits & limits);
+
+        /**
+         * Change the limits, for connections already known as well as new ones. Tokens they've saved up are kept,
+         * up to the new bursts.
+         *
+         * @param limits    Limits applied to every connection
+         * @throw std::invalid_argument if a limited rate's burst is less than 1, or the budget or most calls queued is 0
+         */
+        void limits(const Limits & limits);
+
+        /**
+         * Queue a received call.
+         *
+         * @param uuid      UUID of the connection the call came from
+         * @param method    Name of the RPC method
+         * @param job       Runs the call
+         * @param resume    Called once the connection may be read from again, if this returned false
+         * @return          False if the connection's queue is full and it shouldn't be read from for now
+         */
+        bool submit(const boost::uuids::uuid & uuid, const std::string & method, const Job & job, const Job & resume);
+
+        /**
+         * Forget a connection and any calls it still has queued (when it disconnects).
+         *
+         * @param uuid  UUID of the connection
+         */
+        void remove(const boost::uuids::uuid & uuid);
+
+        /**
+         * Get the counters summed over every connection.
+         *
+         * @return  Counters
+         */
+        const Counters & counters() const
+        {
+            return _counters;
+        }
+
+        /**
+         * Get the counters of a single connection.
+         *
+         * @param uuid  UUID of the connection
+         * @return      Counters
+         */
+        Counters counters(const boost::uuids::uuid & uuid) const;
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct TokenBucket
+        {
+            TokenBucket(const Rate & rate, Clock::time_point now)
+                : rate(rate)
+                , tokens{rate.burst}
+                , last{now}
+            {
+            }
+
+            Rate rate;
+            double tokens;
+            Clock::time_point last;
+
+            void refill(Clock::time_point now);
+            bool available() const;
+            void take();
+            Clock::duration wait() const; // Until a token is available
+        };
+
+        struct Client
+        {
+            Client(const Rate & overall, Clock::time_point now)
+                : queue{}
+                , overall{overall, now}
+                , methods{}
+                , counters()
+                , resume{}
+                , running{false}
+                , throttled{false}
+                , paused{false}
+                , active{false}
+                , removed{false}
+                , wake{}
+            {
+            }
+
+            std::deque<std::pair<std::string, Job>> queue;
+            TokenBucket overall;
+            std::unordered_map<std::string, TokenBucket> methods;
+            Counters counters;
+            Job resume;
+            bool running; // In the run queue
+            bool throttled; // Waiting for tokens
+            bool paused; // Reading was paused because the queue was full
+            bool active; // One of its calls is being run
+            bool removed; // Disconnected while one of its calls was being run
+            Clock::time_point wake; // When a throttled client has tokens again
+        };
+
+        static const Limits & validate(const Limits & limits);
+
+        Client & client(const boost::uuids::uuid & uuid);
+
+        // Returns false if the client disconnected during its turn
+        bool run(const boost::uuids::uuid & uuid, Client & client);
+
+        void turn();
+
+        void schedule();
+
+        void wakeAt(Clock::time_point time);
+
+        void handleTimer(const boost::system::error_code & error);
+
+        IOService & _ioService;
+        Limits _limits;
+        Counters _counters;
+        std::unordered_map<boost::uuids::uuid, Client, boost::hash<boost::uuids::uuid>> _clients;
+        std::deque<boost::uuids::uuid> _runQueue;
+        std::vector<boost::uuids::uuid> _throttled;
+        bool _turnPending;
+        boost::asio::deadline_timer _timer;
+        Clock::time_point _timerExpiry;
+};
+
+}
@@ -0,0 +1,194 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "interest_grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace SydNet {
+
+/*****************
+ * Public methods
+ *****************/
+
+InterestGrid::InterestGrid(float cellSize, float defaultRadius)
+    : _cellSize{cellSize}
+    , _defaultRadius{clampRadius(defaultRadius)}
+    , _entries{}
+    , _cells{}
+    , _radii{}
+{
+}
+
+void InterestGrid::position(const boost::uuids::uuid & uuid, float x, float y)
+{
+    if (!std::isfinite(x) || !std::isfinite(y)) {
+        throw std::invalid_argument("An attempt to place a client at a position that isn't finite was made");
+    }
+
+    auto iter = _entries.find(uuid);
+    if (iter == _entries.end()) {
+        Entry & entry = _entries[uuid];
+        entry.x = x;
+        entry.y = y;
+        entry.radius = _defaultRadius;
+        _radii.insert(entry.radius);
+        insert(uuid, entry);
+        return;
+    }
+
+    Entry & entry = iter->second;
+    entry.x = x;
+    entry.y = y;
+
+    // Most moves stay within the same cell
+    if (cellKey(coordinate(x), coordinate(y)) != entry.cell) {
+        erase(entry);
+        insert(uuid, entry);
+    }
+}
+
+bool InterestGrid::locate(const boost::uuids::uuid & uuid, float & x, float & y) const
+{
+    auto iter = _entries.find(uuid);
+    if (iter == _entries.end()) {
+        return false;
+    }
+    x = iter->second.x;
+    y = iter->second.y;
+    return true;
+}
+
+void InterestGrid::radius(const boost::uuids::uuid & uuid, float radius)
+{
+    auto iter = _entries.find(uuid);
+    if (iter == _entries.end()) {
+        throw std::logic_error("An attempt to set the interest radius of a client without a position was made");
+    }
+
+    radius = clampRadius(radius);
+    _radii.erase(_radii.find(iter->second.radius));
+    iter->second.radius = radius;
+    _radii.insert(radius);
+}
+
+void InterestGrid::remove(const boost::uuids::uuid & uuid)
+{
+    auto iter = _entries.find(uuid);
+    if (iter == _entries.end()) {
+        return;
+    }
+
+    erase(iter->second);
+    _radii.erase(_radii.find(iter->second.radius));
+    _entries.erase(iter);
+}
+
+std::vector<boost::uuids::uuid> InterestGrid::interested(float x, float y) const
+{
+    std::vector<boost::uuids::uuid> result;
+    if (_radii.empty()) {
+        return result;
+    }
+
+    // Anyone who can see the point is within the largest radius of it
+    float reach = *_radii.rbegin();
+    int64_t minX = coordinate(x - reach), maxX = coordinate(x + reach);
+    int64_t minY = coordinate(y - reach), maxY = coordinate(y + reach);
+
+    for (int64_t cellX = minX; cellX <= maxX; ++cellX) {
+        for (int64_t cellY = minY; cellY <= maxY; ++cellY) {
+            auto cell = _cells.find(cellKey(cellX, cellY));
+            if (cell == _cells.end()) {
+                continue;
+            }
+
+            for (auto & uuid: cell->second) {
+                const Entry & entry = _entries.find(uuid)->second;
+                float dx = entry.x - x, dy = entry.y - y;
+                if (dx * dx + dy * dy <= entry.radius * entry.radius) {
+                    result.push_back(uuid);
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/******************
+* Private methods
+******************/
+
+int32_t InterestGrid::coordinate(float value) const
+{
+    // Cells past the edge of the range are all the last one; out there, nobody is near anybody anyway
+    double cell = std::floor(static_cast<double>(value) / _cellSize);
+    if (!(cell > std::numeric_limits<int32_t>::min())) {
+        return std::numeric_limits<int32_t>::min();
+    }
+    return static_cast<int32_t>(std::min<double>(cell, std::numeric_limits<int32_t>::max()));
+}
+
+float InterestGrid::clampRadius(float radius) const
+{
+    if (!(radius > 0)) {
+        return 0; // Sees nothing; NaN included
+    }
+    return std::min(radius, _cellSize * MAX_REACH);
+}
+
+void InterestGrid::insert(const boost::uuids::uuid & uuid, Entry & entry)
+{
+    entry.cell = cellKey(coordinate(entry.x), coordinate(entry.y));
+    std::vector<boost::uuids::uuid> & cell = _cells[entry.cell];
+    entry.index = cell.size();
+    cell.push_back(uuid);
+}
+
+void InterestGrid::erase(const Entry & entry)
+{
+    auto iter = _cells.find(entry.cell);
+    std::vector<boost::uuids::uuid> & cell = iter->second;
+
+    // Swap the last client into the hole so removal doesn't shift the rest
+    if (entry.index + 1 != cell.size()) {
+        cell[entry.index] = cell.back();
+        _entries.find(cell[entry.index])->second.index = entry.index;
+    }
+    cell.pop_back();
+
+    if (cell.empty()) {
+        _cells.erase(iter);
+    }
+}
+
+}
@@ -0,0 +1,163 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+#include "connection.h"
+
+namespace SydNet {
+
+/**
+ * Uniform grid of client positions used to send events only to the clients that can see them.
+ *
+ * Each client has a position and an interest radius; a client is interested in an event when the
+ * event happens within its radius. Moving a client only touches the cells it leaves and enters.
+ */
+class InterestGrid
+{
+    public:
+        /**
+         * Create an empty grid.
+         *
+         * @param cellSize      Width and height of a cell; roughly the typical interest radius works well
+         * @param defaultRadius Interest radius of clients that haven't been given one
+         */
+        InterestGrid(float cellSize = 64.0f, float defaultRadius = 64.0f);
+
+        /**
+         * Place or move a client.
+         *
+         * @param uuid  UUID of the client's connection
+         * @param x     New X coordinate; must be finite
+         * @param y     New Y coordinate; must be finite
+         */
+        void position(const boost::uuids::uuid & uuid, float x, float y);
+
+        /**
+         * Get the position of a client.
+         *
+         * @param uuid  UUID of the client's connection
+         * @param x     Set to the X coordinate
+         * @param y     Set to the Y coordinate
+         * @return      False if the client has no position
+         */
+        bool locate(const boost::uuids::uuid & uuid, float & x, float & y) const;
+
+        /**
+         * Set how far a client can see.
+         *
+         * @param uuid      UUID of the client's connection
+         * @param radius    New interest radius, clamped to between 0 and MAX_REACH cells
+         */
+        void radius(const boost::uuids::uuid & uuid, float radius);
+
+        /**
+         * Forget a client (when it disconnects).
+         *
+         * @param uuid  UUID of the client's connection
+         */
+        void remove(const boost::uuids::uuid & uuid);
+
+        /**
+         * Get the clients interested in an event at a point.
+         *
+         * @param x     X coordinate of the event
+         * @param y     Y coordinate of the event
+         * @return      UUIDs of the clients that can see the point
+         */
+        std::vector<boost::uuids::uuid> interested(float x, float y) const;
+
+        /**
+         * Execute an RPC on every client that can see a point.
+         *
+         * @param connections   Map to look the interested clients' connections up in
+         * @param x             X coordinate of the event
+         * @param y             Y coordinate of the event
+         * @param name          Name of RPC method
+         * @param function      Function definition for type-safety checking
+         * @param args...       Arguments to pass to the RPC method
+         */
+        template<typename Function, typename... Args>
+        void broadcast(Connection::ConnectionMap & connections, float x, float y,
+                const std::string & name, Function function, const Args & ... args);
+
+        static const int32_t MAX_REACH = 64; // Most cells out a radius may reach, which bounds the cells a lookup checks
+
+    private:
+        typedef int64_t CellKey;
+
+        struct Entry
+        {
+            float x;
+            float y;
+            float radius;
+            CellKey cell;
+            size_t index; // Position within the cell's list
+        };
+
+        typedef std::unordered_map<boost::uuids::uuid, Entry, boost::hash<boost::uuids::uuid>> Entries;
+        typedef std::unordered_map<CellKey, std::vector<boost::uuids::uuid>> Cells;
+
+        int32_t coordinate(float value) const;
+
+        float clampRadius(float radius) const;
+
+        CellKey cellKey(int32_t cellX, int32_t cellY) const
+        {
+            return static_cast<CellKey>((static_cast<uint64_t>(static_cast<uint32_t>(cellX)) << 32) | static_cast<uint32_t>(cellY));
+        }
+
+        void insert(const boost::uuids::uuid & uuid, Entry & entry);
+
+        void erase(const Entry & entry);
+
+        float _cellSize;
+        float _defaultRadius;
+        Entries _entries;
+        Cells _cells;
+        std::multiset<float> _radii; // Largest radius bounds how far out a lookup has to search
+};
+
+template<typename Function, typename... Args>
+void InterestGrid::broadcast(Connection::ConnectionMap & connections, float x, float y,
+        const std::string & name, Function function, const Args & ... args)
+{
+    for (auto & uuid: interested(x, y)) {
+        auto iter = connections.find(uuid);
+        if (iter != connections.end()) {
+            if (Connection::Pointer connection = iter->second.lock()) {
+                connection->execute(std::string{name}, function, args...);
+            }
+        }
+    }
+}
+
+}
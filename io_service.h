@@ -27,6 +27,73 @@ or implied, of Christopher Allen Ogden.
 */
 #pragma once
 
+#include <boost/version.hpp>
+
+// Built with --io-uring: every socket operation on an IOService is submitted through one io_uring
+// instead of an epoll_wait plus a read or write system call each, with no change to the code using it.
+#if defined(BOOST_ASIO_HAS_IO_URING)
+#if BOOST_VERSION < 107800
+#error "The io_uring backend needs Boost 1.78 or newer"
+#endif
+#endif
+
 namespace SydNet {
     typedef boost::asio::io_service IOService;
+
+    /**
+     * Get the IO service a socket or acceptor runs on, whichever version of Asio this is.
+     *
+     * @param object    Socket, acceptor or other IO object
+     * @return          Its IO service
+     */
+    template<typename IOObject>
+    IOService & ioServiceOf(IOObject & object)
+    {
+#if BOOST_VERSION >= 107000
+        return static_cast<IOService &>(object.get_executor().context());
+#else
+        return object.get_io_service();
+#endif
+    }
+
+    // The IO service the calling thread has claimed, if any
+    inline IOService *& claimedIOService()
+    {
+        static thread_local IOService * claimed = NULL;
+        return claimed;
+    }
+
+    /**
+     * Claim an IO service for the calling thread, which runs or polls it and nothing else does. Calls the
+     * thread makes outside of the service's handlers, such as from its own loop around poll(), then count
+     * as being on the service's thread too.
+     *
+     * @param ioService IO service the calling thread runs
+     */
+    inline void claimThread(IOService & ioService)
+    {
+        claimedIOService() = &ioService;
+    }
+
+    /**
+     * Check whether the calling thread is the one running an IO service's handlers.
+     *
+     * Asio older than 1.66 can't tell, so there only a thread that claimed the service counts; calls made
+     * anywhere else, its handlers included, are then taken to be made from another thread and handed over
+     * to the service to be sent, which is slower but always safe.
+     *
+     * @param ioService IO service
+     * @return          True if called from the thread that claimed it, or from one of its handlers
+     */
+    inline bool onThreadOf(IOService & ioService)
+    {
+        if (claimedIOService() == &ioService) {
+            return true;
+        }
+#if BOOST_VERSION >= 106600
+        return ioService.get_executor().running_in_this_thread();
+#else
+        return false;
+#endif
+    }
 }
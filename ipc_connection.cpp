@@ -0,0 +1,402 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "ipc_connection.h"
+
+#include <array>
+#include <cstring>
+#include <boost/lexical_cast.hpp>
+
+namespace SydNet {
+
+/******************
+ * Factory methods
+ ******************/
+
+Connection::Pointer IPCConnection::create(const RPCInvoker & invoker, IOService & ioService, const std::string & path)
+{
+    IPCConnection * ipc{new IPCConnection{Outgoing, invoker, ioService}};
+    Connection::Pointer ptr{ipc};
+    ipc->connect(path);
+    return ptr;
+}
+
+Connection::Pointer IPCConnection::create(const RPCInvoker & invoker, IOService & ioService,
+        const boost::uuids::uuid & uuid, ConnectionMap * peers)
+{
+    return Pointer{new IPCConnection{Incoming, invoker, ioService, uuid, peers}};
+}
+
+
+/*****************
+ * Public methods
+ *****************/
+
+void IPCConnection::beginReading(const DisconnectHandler & disconnectHandler)
+{
+    using namespace boost::interprocess;
+
+    _disconnectHandler = disconnectHandler;
+    _connected = true;
+
+    // Create the segment and set both rings up
+    _segmentName = "/sydnet-" + boost::lexical_cast<std::string>(uuid());
+    shared_memory_object::remove(_segmentName.c_str());
+    shared_memory_object memory{create_only, _segmentName.c_str(), read_write, permissions{0600}}; // Only our own user may map it
+    memory.truncate(sizeof(IPCSegment));
+    _region.reset(new mapped_region{memory, read_write});
+
+    IPCSegment * segment = static_cast<IPCSegment *>(_region->get_address());
+    segment->toServer.reset();
+    segment->toClient.reset();
+    _in = &segment->toServer;
+    _out = &segment->toClient;
+
+    // Tell the client where to find it
+    uint16_t length = static_cast<uint16_t>(_segmentName.length());
+    std::array<boost::asio::const_buffer, 2> handshake{{
+        boost::asio::buffer(&length, sizeof(length)),
+        boost::asio::buffer(_segmentName)
+    }};
+    boost::asio::write(_socket, handshake, _lastErrorCode);
+    if (_lastErrorCode) {
+        disconnect();
+        return;
+    }
+
+    drain();
+}
+
+void IPCConnection::disconnect()
+{
+    if (!_connected) {
+        return;
+    }
+    _connected = false;
+
+    if (_disconnectHandler) {
+        LOG_DEBUG("Disconnect handler being called");
+        _disconnectHandler(_lastErrorCode);
+        _disconnectHandler = DisconnectHandler{};
+    }
+
+    if (!_segmentName.empty()) {
+        boost::interprocess::shared_memory_object::remove(_segmentName.c_str());
+    }
+
+    boost::system::error_code error;
+    _socket.shutdown(boost::asio::local::stream_protocol::socket::shutdown_both, error);
+    _socket.close(error);
+
+    if (_lastErrorCode && _lastErrorCode != boost::asio::error::eof) {
+        throw boost::system::system_error(_lastErrorCode);
+    }
+
+    LOG_DEBUG("Connection disconnected");
+}
+
+Connection::ConnectionMap & IPCConnection::peers()
+{
+    if (!_peers) {
+        throw std::logic_error("An attempt to walk connections when there are none was made");
+    }
+    return *_peers;
+}
+
+IPCConnection::~IPCConnection()
+{
+    if (!_segmentName.empty()) {
+        boost::interprocess::shared_memory_object::remove(_segmentName.c_str());
+    }
+}
+
+
+/******************
+* Private methods
+******************/
+
+IPCConnection::IPCConnection(Type type, const RPCInvoker & invoker, IOService & ioService,
+        const boost::uuids::uuid & uuid, ConnectionMap * peers)
+    : Connection{type, invoker, uuid}
+    , _socket{ioService}
+    , _segmentName{}
+    , _region{}
+    , _in{NULL}
+    , _out{NULL}
+    , _incoming{}
+    , _outgoing{}
+    , _wakeupBuffer()
+    , _connected{false}
+    , _lastErrorCode{}
+    , _peers{peers}
+    , _disconnectHandler{}
+    , _requestCallbacks{}
+    , _nextRequestID{1}
+{
+}
+
+void IPCConnection::connect(const std::string & path)
+{
+    using namespace boost::interprocess;
+
+    LOG_INFO("Connection attempt: ", path);
+    _socket.connect(boost::asio::local::stream_protocol::endpoint{path}, _lastErrorCode);
+
+    // Find out which segment the server set up for us
+    uint16_t length = 0;
+    if (!_lastErrorCode) {
+        boost::asio::read(_socket, boost::asio::buffer(&length, sizeof(length)), _lastErrorCode);
+    }
+    std::string segmentName(length, '\0');
+    if (!_lastErrorCode) {
+        boost::asio::read(_socket, boost::asio::buffer(&segmentName[0], length), _lastErrorCode);
+    }
+    if (_lastErrorCode) {
+        _connected = true;
+        disconnect();
+        return;
+    }
+
+    shared_memory_object memory{open_only, segmentName.c_str(), read_write};
+    _region.reset(new mapped_region{memory, read_write});
+    shared_memory_object::remove(segmentName.c_str()); // Both sides have it mapped; nobody else needs the name
+
+    IPCSegment * segment = static_cast<IPCSegment *>(_region->get_address());
+    _in = &segment->toClient;
+    _out = &segment->toServer;
+    _connected = true;
+
+    LOG_NOTICE("Connected: ", path);
+
+    flush(); // Anything executed before the connection was made
+    drain();
+}
+
+void IPCConnection::remoteExecute(const std::string & name, const std::string & params, RequestID requestID, StreamID stream)
+{
+    if (handedOver(ioServiceOf(_socket), name, params, nullptr, requestID, stream)) {
+        return; // Only the network thread may touch the rings
+    }
+
+    // Streams only matter to the socket transports
+    std::ostream outgoingStream{&_outgoing};
+    Frame::writeCall(outgoingStream, requestID, name, params);
+
+    if (_out) {
+        flush();
+    }
+}
+
+void IPCConnection::remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID stream)
+{
+    if (handedOver(ioServiceOf(_socket), name, params, callback, 0, stream)) {
+        return; // The callback will run on the network thread too
+    }
+
+    RequestID requestID = _nextRequestID++;
+
+    _requestCallbacks.push_back(RequestCallbackPair{requestID, callback});
+    remoteExecute(name, params, requestID, stream);
+
+    if (!_nextRequestID || _nextRequestID & REQUEST_ID_RECEIVED_BIT) {
+        _nextRequestID = 1;
+    }
+}
+
+void IPCConnection::wait()
+{
+    _socket.async_read_some(boost::asio::buffer(_wakeupBuffer),
+        std::bind(&IPCConnection::handleWakeup, getDerivedPointer(),
+            std::placeholders::_1,
+            std::placeholders::_2));
+}
+
+void IPCConnection::wakeup()
+{
+    static const char WAKEUP = 0;
+    boost::asio::async_write(_socket, boost::asio::buffer(&WAKEUP, sizeof(WAKEUP)),
+        std::bind(&IPCConnection::handleWakeupSent, getDerivedPointer(),
+            std::placeholders::_1,
+            std::placeholders::_2));
+}
+
+void IPCConnection::flush()
+{
+    while (_connected && _outgoing.size()) {
+        size_t count = _out->write(boost::asio::buffer_cast<const char *>(_outgoing.data()), _outgoing.size());
+        if (!count) {
+            // Full; ask the reader to wake us up once it has made room, then check it didn't already
+            _out->writerWaiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_out->size() == IPCRing::CAPACITY) {
+                break;
+            }
+            _out->writerWaiting.store(false);
+            continue;
+        }
+        _outgoing.consume(count);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_out->readerWaiting.exchange(false)) {
+            wakeup();
+        }
+    }
+}
+
+void IPCConnection::drain()
+{
+    flush(); // The reader may have made room for frames that didn't fit before
+
+    while (_connected) {
+        size_t available = _in->size();
+        if (!available) {
+            // Ask the writer to wake us up, then check nothing arrived in the meantime
+            _in->readerWaiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!_in->size()) {
+                break;
+            }
+            _in->readerWaiting.store(false);
+            continue;
+        }
+
+        size_t count = _in->read(boost::asio::buffer_cast<char *>(_incoming.prepare(available)), available);
+        _incoming.commit(count);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_in->writerWaiting.exchange(false)) {
+            wakeup();
+        }
+
+        // Process every complete frame
+        while (_connected && _incoming.size() >= sizeof(Frame::Size)) {
+            Frame::Size commandSize = Frame::readSize(boost::asio::buffer_cast<const char *>(_incoming.data()));
+            if (_incoming.size() < sizeof(commandSize) + commandSize) {
+                break;
+            }
+            _incoming.consume(sizeof(commandSize));
+
+            if (commandSize >= sizeof(RequestID)) {
+                handleCommand(boost::asio::buffer_cast<const char *>(_incoming.data()), commandSize);
+            }
+            _incoming.consume(commandSize);
+        }
+    }
+
+    if (_connected) {
+        wait();
+    }
+}
+
+void IPCConnection::handleCommand(const char * frame, size_t length)
+{
+    Frame::Parts parts;
+    if (!Frame::decode(frame, length, parts)) {
+        return;
+    }
+    RequestID requestID = parts.requestID;
+
+    if (parts.result) {
+        // Process result
+        for (auto iter = _requestCallbacks.begin(); iter != _requestCallbacks.end(); ++iter) {
+            if (iter->first == requestID) {
+                RemoteExecuteCallback callback = iter->second;
+                _requestCallbacks.erase(iter);
+                callback(parts.payload, parts.payloadLength);
+                break;
+            }
+        }
+    } else {
+        std::string name(parts.name, parts.nameLength);
+        const char * params = parts.payload;
+
+        std::stringstream result;
+        Deferred::Pointer deferred;
+        bool answered = false;
+        try {
+            answered = invoker().invoke(name, params, parts.payloadLength, result, shared_from_this(), &deferred) && requestID
+                && invoker().answers(name);
+        } catch (const std::exception & e) {
+            LOG_WARNING("Dropped call to ", name, " from ", uuid(), ": ", e.what());
+        }
+        if (answered) {
+            if (deferred) {
+                defer(requestID, deferred);
+            } else {
+                sendResult(requestID, result.str());
+            }
+        }
+    }
+}
+
+void IPCConnection::sendResult(RequestID requestID, const std::string & result)
+{
+    std::ostream outgoingStream{&_outgoing};
+    try {
+        Frame::writeResult(outgoingStream, requestID, result);
+    } catch (const std::length_error & e) {
+        LOG_ERROR("Dropped result for ", uuid(), ": ", e.what());
+        return;
+    }
+    flush();
+}
+
+void IPCConnection::defer(RequestID requestID, const Deferred::Pointer & deferred)
+{
+    std::weak_ptr<IPCConnection> weakSelf{getDerivedPointer()};
+    IOService * ioService = &ioServiceOf(_socket);
+    deferred->attach([weakSelf, ioService, requestID](const std::string & result) {
+        // Whichever thread it turned up on, send it from the one that owns the ring
+        ioService->post([weakSelf, requestID, result] {
+            std::shared_ptr<IPCConnection> self = weakSelf.lock();
+            if (self && self->_connected) {
+                self->sendResult(requestID, result);
+            }
+        });
+    });
+}
+
+void IPCConnection::handleWakeup(const boost::system::error_code & error, size_t)
+{
+    if (error) {
+        _lastErrorCode = error;
+        disconnect();
+        return;
+    }
+
+    drain();
+}
+
+void IPCConnection::handleWakeupSent(const boost::system::error_code & error, size_t)
+{
+    if (error && _connected) {
+        _lastErrorCode = error;
+        disconnect();
+    }
+}
+
+}
@@ -0,0 +1,151 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <deque>
+#include <boost/asio.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "io_service.h"
+#include "connection.h"
+#include "ipc_ring.h"
+
+namespace SydNet {
+
+/**
+ * Connection to a process on the same host.
+ *
+ * Frames travel through a pair of shared memory rings; the Unix domain socket is only used to
+ * hand over the name of the shared memory segment and to wake the other side up.
+ */
+class IPCConnection: public Connection
+{
+    public:
+        typedef std::function<void (boost::system::error_code)> DisconnectHandler;
+
+        /**
+         * Create a new connection to a local server
+         *
+         * @param invoker   RPC invoker to use with this connection
+         * @param ioService IOService to use
+         * @param path      Path of the server's Unix domain socket
+         * @return          A shared Pointer to a new connection object
+         */
+        static Pointer create(const RPCInvoker & invoker, IOService & ioService, const std::string & path);
+
+        /**
+         * Create a connection object to accept a local client onto
+         *
+         * @param invoker   RPC invoker to use with this connection
+         * @param ioService IOService to use
+         * @param uuid      UUID for the connection
+         * @param peers     A map of peer connections
+         * @return          A shared Pointer to a new connection object
+         */
+        static Pointer create(const RPCInvoker & invoker, IOService & ioService,
+                const boost::uuids::uuid & uuid, ConnectionMap * peers);
+
+        /**
+         * Get the socket used for setup and wakeups.
+         *
+         * @return  Socket used by this connection
+         */
+        boost::asio::local::stream_protocol::socket & socket()
+        {
+            return _socket;
+        }
+
+        /**
+         * Create the shared memory segment, hand it to the client and begin reading
+         *
+         * @param disconnectHandler Function to call when this connection disconnects
+         */
+        void beginReading(const DisconnectHandler & disconnectHandler);
+
+        virtual void disconnect();
+
+        virtual ConnectionMap & peers();
+
+        virtual ~IPCConnection();
+
+        IPCConnection & operator=(const IPCConnection &) = delete;
+        IPCConnection(const IPCConnection &) = delete;
+
+    private:
+        IPCConnection(Type type, const RPCInvoker & invoker, IOService & ioService,
+                const boost::uuids::uuid & uuid = boost::uuids::nil_uuid(), ConnectionMap * peers = NULL);
+
+        void connect(const std::string & path);
+
+        void remoteExecute(const std::string & name, const std::string & params, RequestID, StreamID);
+        void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID);
+
+        std::shared_ptr<IPCConnection> getDerivedPointer()
+        {
+            return std::static_pointer_cast<IPCConnection>(shared_from_this());
+        }
+
+        void wait();
+
+        void wakeup();
+
+        void flush();
+
+        void drain();
+
+        void handleCommand(const char * frame, size_t length);
+
+        void sendResult(RequestID requestID, const std::string & result);
+
+        void defer(RequestID requestID, const Deferred::Pointer & deferred);
+
+        void handleWakeup(const boost::system::error_code & error, size_t);
+
+        void handleWakeupSent(const boost::system::error_code & error, size_t);
+
+        boost::asio::local::stream_protocol::socket _socket;
+        std::string _segmentName;
+        std::unique_ptr<boost::interprocess::mapped_region> _region;
+        IPCRing * _in; // Ring the other side writes into
+        IPCRing * _out; // Ring this side writes into
+        boost::asio::streambuf _incoming; // Bytes taken from the ring that don't form a full frame yet
+        boost::asio::streambuf _outgoing; // Frames that didn't fit into the ring yet
+        char _wakeupBuffer[64];
+        bool _connected;
+        boost::system::error_code _lastErrorCode;
+        ConnectionMap * _peers; // Peer connections
+        DisconnectHandler _disconnectHandler;
+
+        typedef std::pair<RequestID, RemoteExecuteCallback> RequestCallbackPair;
+        typedef std::deque<RequestCallbackPair> RequestCallbacks;
+        RequestCallbacks _requestCallbacks;
+        RequestID _nextRequestID;
+};
+
+}
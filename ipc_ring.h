@@ -0,0 +1,131 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace SydNet {
+
+/**
+ * Single-producer, single-consumer byte ring that lives in shared memory.
+ *
+ * The producer only ever advances the head and the consumer only ever advances the tail, so
+ * neither side needs a lock. The waiting flags tell the other side that a wakeup is wanted.
+ */
+class IPCRing
+{
+    public:
+        static const size_t CAPACITY = 256 * 1024; // Must be a power of two
+
+        /**
+         * Prepare a freshly mapped ring for use (called once, by the creator of the segment).
+         */
+        void reset()
+        {
+            _head.store(0, std::memory_order_relaxed);
+            _tail.store(0, std::memory_order_relaxed);
+            readerWaiting.store(false, std::memory_order_relaxed);
+            writerWaiting.store(false, std::memory_order_relaxed);
+        }
+
+        /**
+         * Copy as much of the data as fits into the ring (producer only).
+         *
+         * @param data      Data to write
+         * @param length    Length of the data
+         * @return          Number of bytes actually written
+         */
+        size_t write(const char * data, size_t length)
+        {
+            uint64_t head = _head.load(std::memory_order_relaxed);
+            uint64_t tail = _tail.load(std::memory_order_acquire);
+            size_t count = std::min<size_t>(length, CAPACITY - (head - tail));
+
+            size_t offset = head & (CAPACITY - 1);
+            size_t first = std::min(count, CAPACITY - offset);
+            std::memcpy(_data + offset, data, first);
+            std::memcpy(_data, data + first, count - first);
+
+            _head.store(head + count, std::memory_order_release);
+            return count;
+        }
+
+        /**
+         * Copy as much of the available data as fits into the buffer (consumer only).
+         *
+         * @param data      Buffer to read into
+         * @param length    Size of the buffer
+         * @return          Number of bytes actually read
+         */
+        size_t read(char * data, size_t length)
+        {
+            uint64_t tail = _tail.load(std::memory_order_relaxed);
+            uint64_t head = _head.load(std::memory_order_acquire);
+            size_t count = std::min<size_t>(length, head - tail);
+
+            size_t offset = tail & (CAPACITY - 1);
+            size_t first = std::min(count, CAPACITY - offset);
+            std::memcpy(data, _data + offset, first);
+            std::memcpy(data + first, _data, count - first);
+
+            _tail.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+        /**
+         * Get the number of bytes waiting to be read.
+         *
+         * @return  Number of readable bytes
+         */
+        size_t size() const
+        {
+            return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+        }
+
+        std::atomic<bool> readerWaiting; // Consumer wants a wakeup when data arrives
+        std::atomic<bool> writerWaiting; // Producer wants a wakeup when space frees up
+
+    private:
+        alignas(64) std::atomic<uint64_t> _head; // Next byte to write
+        alignas(64) std::atomic<uint64_t> _tail; // Next byte to read
+        alignas(64) char _data[CAPACITY];
+};
+
+/**
+ * Layout of the shared memory segment between a client and a server.
+ */
+struct IPCSegment
+{
+    IPCRing toServer;
+    IPCRing toClient;
+};
+
+}
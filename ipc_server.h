@@ -0,0 +1,116 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include "server.h"
+
+#include <cstdio>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "ipc_connection.h"
+
+namespace SydNet {
+
+/**
+ * Server for clients running on the same host, listening on a Unix domain socket.
+ */
+class IPCServer: public Server
+{
+    public:
+        /**
+         * Create a server instance and start accepting connections.
+         *
+         * @param invoker   RPC method invoker to use with this server
+         * @param ioService IO service to use for this server
+         * @param path      path of the Unix domain socket to listen on; only its owner may connect
+         */
+        IPCServer(const Connection::RPCInvoker & invoker, IOService & ioService, const std::string & path)
+            : Server{invoker}
+            , _acceptor{ioService, (std::remove(path.c_str()), boost::asio::local::stream_protocol::endpoint{path})}
+            , _path{path}
+            , _uuidGen{}
+            , _connectionMap{}
+        {
+            ::chmod(path.c_str(), S_IRUSR | S_IWUSR);
+            startAccept(); // Start accepting connections immediately
+            LOG_NOTICE("Accepting local connections at ", path);
+        }
+
+        Connection::ConnectionMap & clients()
+        {
+            return _connectionMap;
+        }
+
+        virtual ~IPCServer()
+        {
+            std::remove(_path.c_str());
+        }
+
+    private:
+        void startAccept()
+        {
+            // Prepare a new connection to accept onto
+            Connection::Pointer newConnection = IPCConnection::create(invoker(), ioServiceOf(_acceptor), _uuidGen(), &_connectionMap);
+            newConnection->interest(&interest());
+
+            // Wait for one to accept (will call handleAccept)
+            _acceptor.async_accept(std::static_pointer_cast<IPCConnection>(newConnection)->socket(),
+                std::bind(&IPCServer::handleAccept, this, newConnection, std::placeholders::_1));
+        }
+
+        void handleAccept(Connection::Pointer newConnection, const boost::system::error_code & error)
+        {
+            if (error) {
+                throw boost::system::system_error{error};
+            }
+
+            LOG_NOTICE("Local client connected: ", newConnection->uuid());
+            _connectionMap[newConnection->uuid()] = newConnection;
+
+            // Hand over the shared memory and begin reading on the new connection
+            std::static_pointer_cast<IPCConnection>(newConnection)->beginReading(
+                    std::bind(&IPCServer::handleDisconnect, this, newConnection, std::placeholders::_1));
+
+            // Wait for the next connection
+            startAccept();
+        }
+
+        void handleDisconnect(Connection::Pointer connection, const boost::system::error_code & error)
+        {
+            LOG_NOTICE("Local client disconnected: ", connection->uuid());
+            _connectionMap.erase(connection->uuid());
+            interest().remove(connection->uuid());
+        }
+
+        boost::asio::local::stream_protocol::acceptor _acceptor;
+        std::string _path;
+        boost::uuids::random_generator _uuidGen;
+        Connection::ConnectionMap _connectionMap;
+};
+
+}
@@ -0,0 +1,115 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "linked_connection.h"
+
+namespace SydNet {
+
+/******************
+ * Factory methods
+ ******************/
+
+LinkedConnection::Pair LinkedConnection::create(const RPCInvoker & invoker, IOService & clientService,
+        IOService & serverService, const boost::uuids::uuid & uuid, ConnectionMap * peers)
+{
+    std::shared_ptr<LinkedConnection> client{new LinkedConnection{invoker, clientService}};
+    std::shared_ptr<LinkedConnection> server{new LinkedConnection{invoker, serverService, uuid, peers}};
+    client->_other = server;
+    client->_server = server;
+    server->_other = client;
+    return Pair{client, server};
+}
+
+
+/*****************
+ * Public methods
+ *****************/
+
+void LinkedConnection::disconnect()
+{
+    if (!_connected.exchange(false)) {
+        return; // Already down, or going down on the other end's thread
+    }
+
+    if (_disconnectHandler) {
+        LOG_DEBUG("Disconnect handler being called");
+        _disconnectHandler(boost::system::error_code{});
+        _disconnectHandler = DisconnectHandler{};
+    }
+
+    // Take the other end down with us
+    if (auto other = _other.lock()) {
+        other->disconnect();
+    } else if (_server) {
+        _server->disconnect();
+    }
+
+    LOG_DEBUG("Connection disconnected");
+}
+
+Connection::ConnectionMap & LinkedConnection::peers()
+{
+    if (!_peers) {
+        throw std::logic_error("An attempt to walk connections when there are none was made");
+    }
+    return *_peers;
+}
+
+LinkedConnection::~LinkedConnection()
+{
+    disconnect();
+}
+
+
+/******************
+* Private methods
+******************/
+
+void LinkedConnection::localExecute(LocalCall call)
+{
+    auto other = _other.lock();
+    if (!other || !_connected) {
+        LOG_WARNING("Call on a disconnected link dropped");
+        return;
+    }
+
+    other->_ioService.post(std::bind(&LinkedConnection::run, other, std::move(call)));
+}
+
+void LinkedConnection::localComplete(std::function<void()> done)
+{
+    _ioService.post(std::move(done));
+}
+
+void LinkedConnection::run(const LocalCall & call)
+{
+    if (_connected) {
+        call(shared_from_this());
+    }
+}
+
+}
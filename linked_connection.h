@@ -0,0 +1,110 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <atomic>
+
+#include <boost/asio.hpp>
+
+#include "io_service.h"
+#include "connection.h"
+
+namespace SydNet {
+
+/**
+ * One end of a pair of connections linked in memory, for clients hosted in the server's process.
+ *
+ * Calls are never serialized: they are bound into closures with their arguments moved in and
+ * posted to the other end's IOService, where they run with the other end as their connection.
+ */
+class LinkedConnection: public Connection
+{
+    public:
+        typedef std::function<void (boost::system::error_code)> DisconnectHandler;
+        typedef std::pair<Pointer, Pointer> Pair;
+
+        /**
+         * Create a client and server connection linked to each other
+         *
+         * @param invoker       RPC invoker to use with these connections
+         * @param clientService IOService calls to the client run on
+         * @param serverService IOService calls to the server run on
+         * @param uuid          UUID for the server end of the link
+         * @param peers         A map of the server end's peer connections
+         * @return              The client end and the server end, in that order
+         */
+        static Pair create(const RPCInvoker & invoker, IOService & clientService, IOService & serverService,
+                const boost::uuids::uuid & uuid, ConnectionMap * peers);
+
+        /**
+         * Set the function to call when the link is disconnected
+         *
+         * @param disconnectHandler Function to call when this connection disconnects
+         */
+        void onDisconnect(const DisconnectHandler & disconnectHandler)
+        {
+            _disconnectHandler = disconnectHandler;
+        }
+
+        virtual void disconnect();
+
+        virtual ConnectionMap & peers();
+
+        virtual ~LinkedConnection();
+
+        LinkedConnection & operator=(const LinkedConnection &) = delete;
+        LinkedConnection(const LinkedConnection &) = delete;
+
+    private:
+        LinkedConnection(const RPCInvoker & invoker, IOService & ioService,
+                const boost::uuids::uuid & uuid = boost::uuids::nil_uuid(), ConnectionMap * peers = NULL)
+            : Connection{Linked, invoker, uuid}
+            , _ioService(ioService)
+            , _other{}
+            , _server{}
+            , _connected{true}
+            , _peers{peers}
+            , _disconnectHandler{}
+        {
+        }
+
+        void localExecute(LocalCall call);
+
+        void localComplete(std::function<void()> done);
+
+        void run(const LocalCall & call);
+
+        IOService & _ioService; // Where calls to this end run
+        std::weak_ptr<LinkedConnection> _other; // The other end of the link; only set before either end is shared
+        std::shared_ptr<LinkedConnection> _server; // The client end keeps the server end alive
+        std::atomic<bool> _connected; // Read by callers on either end's thread
+        ConnectionMap * _peers; // Peer connections
+        DisconnectHandler _disconnectHandler;
+};
+
+}
@@ -0,0 +1,509 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "shared.h"
+#include "timer_wheel.h"
+#include "outgoing_connection.h"
+
+#ifdef USE_PANTHEIOS
+const PAN_CHAR_T PANTHEIOS_FE_PROCESS_IDENTITY[] = "loadgen";
+#endif
+
+/*
+ * Opens many connections to a server and has each make a mix of calls, reporting how the server keeps up.
+ *
+ * Usage: loadgen [host] [port] [connections] [threads] [calls/s per connection] [seconds] [mix] [connects/s] [order] [trace]
+ *
+ * The mix lists server methods with their weights, e.g. "gotMessage:4,updatePosition:4,sendMessage:1".
+ * With an order of "random" (the default) each call is picked by weight at exponentially distributed
+ * intervals; with "script" every connection steps through the mix in order, at a fixed pace.
+ *
+ * Latency is measured on the calls that come back: gotMessage makes the server call mul on us,
+ * and sendMessage is broadcast back to its sender as printMessage.
+ *
+ * With "trace" every connection also times its calls and checks the server's clock each second,
+ * and the breakdown is printed at the end.
+ */
+
+namespace LoadGen {
+
+typedef std::chrono::steady_clock Clock;
+
+typedef enum { GotMessage, UpdatePosition, SendMessage, SendNearbyMessage } Method;
+
+struct Settings
+{
+    boost::asio::ip::tcp::endpoint endpoint;
+    size_t connections;
+    size_t threads;
+    double rate; // Calls per second per connection
+    double seconds;
+    std::vector<Method> script; // Each method repeated by its weight
+    double connectRate; // Connections started per second, over all threads
+    bool random;
+    SydNet::Tracer * tracer; // Times every connection's calls, if set
+};
+
+struct Stats
+{
+    Stats()
+        : connected{0}
+        , connectFailures{0}
+        , calls{0}
+        , results{0}
+        , latencies{}
+    {
+    }
+
+    size_t connected;
+    size_t connectFailures;
+    size_t calls;
+    size_t results;
+    std::vector<double> latencies; // Milliseconds
+};
+
+struct Client
+{
+    Client()
+        : connection{}
+        , index{0}
+        , timer{}
+        , step{0}
+        , gotMessages{}
+    {
+    }
+
+    SydNet::Connection::Pointer connection;
+    size_t index;
+    SydNet::TimerWheel::Timer timer;
+    size_t step; // Position in the script
+    std::deque<Clock::time_point> gotMessages; // When each unanswered gotMessage was sent
+};
+
+class Thread
+{
+    public:
+        Thread(const Settings & settings, const SydNet::Connection::RPCInvoker & invoker, size_t first, size_t count)
+            : _settings(settings)
+            , _invoker(invoker)
+            , _ioService{}
+            , _timers{new SydNet::TimerWheel{_ioService}}
+            , _clients{}
+            , _byConnection{}
+            , _first{first}
+            , _next{first}
+            , _end{first + count}
+            , _connectTimer{}
+            , _connectStart{}
+            , _random{static_cast<unsigned>(first)}
+            , _mutex{}
+            , _stats()
+            , _thread{}
+        {
+        }
+
+        void start()
+        {
+            _thread = std::thread{&Thread::run, this};
+        }
+
+        void stop()
+        {
+            _ioService.stop();
+            _thread.join();
+        }
+
+        /**
+         * Take the statistics gathered since the last call.
+         */
+        Stats collect()
+        {
+            Stats stats{};
+            std::lock_guard<std::mutex> lock{_mutex};
+            std::swap(stats, _stats);
+            return stats;
+        }
+
+        /**
+         * Find the client a call came in on.
+         */
+        static Client * client(const SydNet::Connection::Pointer & connection)
+        {
+            auto iter = current->_byConnection.find(connection.get());
+            return iter == current->_byConnection.end() ? NULL : iter->second;
+        }
+
+        /**
+         * Record a call's round trip.
+         */
+        static void answered(Clock::time_point sent)
+        {
+            std::lock_guard<std::mutex> lock{current->_mutex};
+            ++current->_stats.results;
+            current->_stats.latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - sent).count());
+        }
+
+        Thread & operator=(const Thread &) = delete;
+        Thread(const Thread &) = delete;
+
+    private:
+        typedef std::list<Client> Clients;
+
+        static const std::chrono::milliseconds CONNECT_INTERVAL;
+
+        void run()
+        {
+            current = this;
+            _connectStart = Clock::now();
+            handleConnectTimer();
+
+            boost::asio::io_service::work work{_ioService};
+            while (true) {
+                try {
+                    _ioService.run();
+                    break; // Stopped
+                } catch (const std::exception & e) {
+                    LOG_WARNING("Connection failed: ", e.what());
+                }
+            }
+        }
+
+        void handleConnectTimer()
+        {
+            // Start this thread's share of the connections wanted by now
+            double elapsed = std::chrono::duration<double>(Clock::now() - _connectStart).count();
+            size_t wanted = _first + 1 + static_cast<size_t>(_settings.connectRate / _settings.threads * elapsed);
+
+            for (; _next < wanted && _next < _end; ++_next) {
+                _clients.emplace_back();
+                Clients::iterator client = std::prev(_clients.end());
+                client->index = _next;
+                client->connection = SydNet::OutgoingConnection::create(_invoker, _ioService, _settings.endpoint,
+                        std::bind(&Thread::handleConnect, this, client, std::placeholders::_1));
+                _byConnection[client->connection.get()] = &*client;
+            }
+
+            if (_next < _end) {
+                _timers->schedule(_connectTimer, CONNECT_INTERVAL, std::bind(&Thread::handleConnectTimer, this));
+            }
+        }
+
+        void handleConnect(Clients::iterator client, const boost::system::error_code & error)
+        {
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                if (error) {
+                    ++_stats.connectFailures;
+                } else {
+                    ++_stats.connected;
+                }
+            }
+
+            if (error) {
+                // It never makes a call, so it isn't one of the connections under load
+                _byConnection.erase(client->connection.get());
+                _clients.erase(client);
+                return;
+            }
+
+            if (_settings.tracer) {
+                std::shared_ptr<SydNet::RealConnection> connection = std::static_pointer_cast<SydNet::RealConnection>(client->connection);
+                connection->timeouts(_timers, SydNet::RealConnection::Timeouts{std::chrono::seconds(1), {}, {}, {}});
+                connection->tracing(_settings.tracer);
+            }
+            schedule(*client);
+        }
+
+        void schedule(Client & client)
+        {
+            double seconds = 1.0 / _settings.rate;
+            if (_settings.random) {
+                seconds = std::exponential_distribution<double>{_settings.rate}(_random);
+            }
+            _timers->schedule(client.timer, std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)),
+                    std::bind(&Thread::handleCallTimer, this, &client));
+        }
+
+        void handleCallTimer(Client * client)
+        {
+            Method method;
+            if (_settings.random) {
+                method = _settings.script[std::uniform_int_distribution<size_t>{0, _settings.script.size() - 1}(_random)];
+            } else {
+                method = _settings.script[client->step++ % _settings.script.size()];
+            }
+
+            switch (method) {
+                case GotMessage:
+                    client->gotMessages.push_back(Clock::now());
+                    client->connection->execute(SERVER_RPC(gotMessage));
+                    break;
+                case UpdatePosition:
+                    client->connection->execute(SERVER_RPC(updatePosition),
+                            std::uniform_real_distribution<float>{0, 1024}(_random),
+                            std::uniform_real_distribution<float>{0, 1024}(_random));
+                    break;
+                case SendMessage:
+                case SendNearbyMessage:
+                    {
+                        std::ostringstream message;
+                        message << "loadgen " << client->index << " " << Clock::now().time_since_epoch().count();
+                        if (method == SendMessage) {
+                            client->connection->execute(SERVER_RPC(sendMessage), message.str());
+                        } else {
+                            client->connection->execute(SERVER_RPC(sendNearbyMessage), message.str());
+                        }
+                    }
+                    break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                ++_stats.calls;
+            }
+            schedule(*client);
+        }
+
+        const Settings & _settings;
+        const SydNet::Connection::RPCInvoker & _invoker;
+        SydNet::IOService _ioService;
+        SydNet::TimerWheel::Pointer _timers;
+        Clients _clients; // A list so the clients never move, even as failed ones are dropped
+        std::unordered_map<const SydNet::Connection *, Client *> _byConnection;
+        size_t _first;
+        size_t _next; // Index of the next client to connect
+        size_t _end;
+        SydNet::TimerWheel::Timer _connectTimer;
+        Clock::time_point _connectStart;
+        std::mt19937 _random;
+
+        std::mutex _mutex; // Guards the statistics
+        Stats _stats;
+
+        std::thread _thread;
+
+        static thread_local Thread * current;
+};
+
+const std::chrono::milliseconds Thread::CONNECT_INTERVAL{10};
+thread_local Thread * Thread::current = NULL;
+
+/*
+ * The client methods the server calls, answering without printing anything.
+ */
+
+void printMessage(const std::string & message, SydNet::Connection::Pointer connection)
+{
+    Client * client = Thread::client(connection);
+    size_t index;
+    long long sent;
+    std::string::size_type start = message.find("loadgen ");
+    if (client && start != std::string::npos
+            && std::sscanf(message.c_str() + start, "loadgen %zu %lld", &index, &sent) == 2
+            && index == client->index) {
+        Thread::answered(Clock::time_point{Clock::duration{sent}});
+    }
+}
+
+int mul(int x, SydNet::Connection::Pointer connection)
+{
+    Client * client = Thread::client(connection);
+    if (client && !client->gotMessages.empty()) {
+        Thread::answered(client->gotMessages.front());
+        client->gotMessages.pop_front();
+    }
+    return x * 5;
+}
+
+// The game's methods, with the client ones swapped for the quiet ones above
+struct LoadGenRPCs
+{
+    static constexpr SydNet::RPCRegistry::Entry entries[] = {
+        CLIENT_RPC_ENTRY(printMessage),
+        SERVER_RPC_ENTRY(sendMessage),
+        SERVER_RPC_ENTRY(sendNearbyMessage),
+        SERVER_RPC_ENTRY(updatePosition),
+        SERVER_RPC_ENTRY(gotMessage),
+        CLIENT_RPC_ENTRY(mul),
+    };
+};
+
+constexpr SydNet::RPCRegistry::Entry LoadGenRPCs::entries[];
+
+SydNet::Connection::RPCInvoker RPCMethods()
+{
+    SydNet::Connection::RPCInvoker invoker;
+    invoker.registry<LoadGenRPCs>();
+    return invoker;
+}
+
+static bool parseMix(const std::string & mix, std::vector<Method> & script)
+{
+    std::istringstream stream{mix};
+    std::string entry;
+    while (std::getline(stream, entry, ',')) {
+        std::string::size_type colon = entry.find(':');
+        std::string name = entry.substr(0, colon);
+        size_t weight = colon == std::string::npos ? 1 : atoi(entry.c_str() + colon + 1);
+
+        Method method;
+        if (name == "gotMessage") {
+            method = GotMessage;
+        } else if (name == "updatePosition") {
+            method = UpdatePosition;
+        } else if (name == "sendMessage") {
+            method = SendMessage;
+        } else if (name == "sendNearbyMessage") {
+            method = SendNearbyMessage;
+        } else {
+            std::cerr << "Unknown method in mix: " << name << std::endl;
+            return false;
+        }
+        script.insert(script.end(), weight, method);
+    }
+    return !script.empty();
+}
+
+static double percentile(const std::vector<double> & sorted, double p)
+{
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+    using namespace LoadGen;
+
+    std::string host = argc > 1 ? argv[1] : "localhost";
+    std::string port = argc > 2 ? argv[2] : "2000";
+
+    Settings settings{};
+    settings.connections = argc > 3 ? atoi(argv[3]) : 1000;
+    settings.threads = std::max(1, argc > 4 ? atoi(argv[4]) : 4);
+    settings.rate = argc > 5 ? atof(argv[5]) : 1.0;
+    settings.seconds = argc > 6 ? atof(argv[6]) : 30.0;
+    std::string mix = argc > 7 ? argv[7] : "gotMessage:4,updatePosition:4,sendNearbyMessage:1";
+    settings.connectRate = argc > 8 ? atof(argv[8]) : 500.0;
+    settings.random = argc > 9 ? std::string{argv[9]} != "script" : true;
+    SydNet::Tracer tracer;
+    settings.tracer = argc > 10 && std::string{argv[10]} == "trace" ? &tracer : NULL;
+
+    if (!parseMix(mix, settings.script) || settings.rate <= 0 || settings.connectRate <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [host] [port] [connections] [threads] [calls/s per connection] [seconds] [mix] [connects/s] [random|script] [trace]" << std::endl;
+        return 1;
+    }
+
+    try {
+        SydNet::IOService ioService;
+        boost::asio::ip::tcp::resolver resolver{ioService};
+        settings.endpoint = *resolver.resolve(boost::asio::ip::tcp::resolver::query{host, port});
+
+        SydNet::Connection::RPCInvoker rpcInvoker{LoadGen::RPCMethods()};
+
+        std::vector<std::unique_ptr<Thread>> threads;
+        for (size_t i = 0; i < settings.threads; ++i) {
+            size_t first = settings.connections * i / settings.threads;
+            size_t last = settings.connections * (i + 1) / settings.threads;
+            threads.emplace_back(new Thread{settings, rpcInvoker, first, last - first});
+        }
+        for (auto & thread: threads) {
+            thread->start();
+        }
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point last = start;
+        Stats total{};
+        std::vector<double> allLatencies;
+
+        while (Clock::now() - start < std::chrono::duration<double>(settings.seconds)) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+
+            Stats interval{};
+            for (auto & thread: threads) {
+                Stats stats = thread->collect();
+                interval.connected += stats.connected;
+                interval.connectFailures += stats.connectFailures;
+                interval.calls += stats.calls;
+                interval.results += stats.results;
+                interval.latencies.insert(interval.latencies.end(), stats.latencies.begin(), stats.latencies.end());
+            }
+
+            Clock::time_point now = Clock::now();
+            double seconds = std::chrono::duration<double>(now - last).count();
+            last = now;
+
+            total.connected += interval.connected;
+            total.connectFailures += interval.connectFailures;
+            total.calls += interval.calls;
+            total.results += interval.results;
+            allLatencies.insert(allLatencies.end(), interval.latencies.begin(), interval.latencies.end());
+
+            std::sort(interval.latencies.begin(), interval.latencies.end());
+            std::printf("%6.1fs  connected %zu (%.0f/s, %zu failed)  calls %.0f/s  results %.0f/s  latency ms p50 %.2f p90 %.2f p99 %.2f\n",
+                    std::chrono::duration<double>(now - start).count(),
+                    total.connected, interval.connected / seconds, total.connectFailures,
+                    interval.calls / seconds, interval.results / seconds,
+                    percentile(interval.latencies, 0.5), percentile(interval.latencies, 0.9), percentile(interval.latencies, 0.99));
+            std::fflush(stdout);
+        }
+
+        for (auto & thread: threads) {
+            thread->stop();
+        }
+
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::sort(allLatencies.begin(), allLatencies.end());
+        std::printf("Total: %zu connected, %zu failed, %zu calls (%.0f/s), %zu results, latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+                total.connected, total.connectFailures, total.calls, total.calls / seconds, total.results,
+                percentile(allLatencies, 0.5), percentile(allLatencies, 0.9), percentile(allLatencies, 0.99),
+                allLatencies.empty() ? 0 : allLatencies.back());
+        if (settings.tracer) {
+            settings.tracer->report(std::cout);
+        }
+    } catch (const std::exception & e) {
+        std::cerr << "Load generator failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
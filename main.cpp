@@ -27,21 +27,46 @@ or implied, of Christopher Allen Ogden.
 */
 #include <iostream>
 #include <chrono>
+#include <cstdlib>
 
 #include "shared.h"
 #include "real_server.h"
+#include "ipc_server.h"
 #include "fake_server.h"
 #include "fake_connection.h"
 #include "outgoing_connection.h"
+#include "ipc_connection.h"
+#include "cluster.h"
+#include "gateway.h"
 
 #ifdef USE_PANTHEIOS
 const PAN_CHAR_T PANTHEIOS_FE_PROCESS_IDENTITY[] = "game";
 #endif
 
+/**
+ * Find where the local server's socket goes when no path is given: the user's runtime directory, which
+ * nobody else can get into, or failing that their temporary directory.
+ *
+ * @return  Path of the Unix domain socket
+ */
+static std::string localSocketPath()
+{
+    for (const char * variable: {"XDG_RUNTIME_DIR", "TMPDIR"}) {
+        const char * directory = std::getenv(variable);
+        if (directory && *directory) {
+            return std::string{directory} + "/game.sock";
+        }
+    }
+    return "/tmp/game.sock";
+}
+
 int main(int argc, char * argv[])
 {
     bool runServer = false;
     bool connectToServer = false;
+    bool local = false;
+    bool clustered = false;
+    bool gateway = false;
 
     LOG_DEBUG("Entering program");
 
@@ -59,24 +84,97 @@ int main(int argc, char * argv[])
             runServer = true;
             connectToServer = true;
             break;
+        case 3:
+            LOG_DEBUG("Dedicated local server mode chosen");
+            runServer = true;
+            local = true;
+            break;
+        case 4:
+            LOG_DEBUG("Local client mode chosen");
+            connectToServer = true;
+            local = true;
+            break;
+        case 5:
+            LOG_DEBUG("Cluster node mode chosen");
+            runServer = true;
+            clustered = true;
+            break;
+        case 6:
+            LOG_DEBUG("Gateway mode chosen");
+            gateway = true;
+            break;
         default:
             LOG_DEBUG("No connection mode chosen");
     }
 
     try {
         SydNet::IOService ioService;
+        SydNet::claimThread(ioService); // The tick loop below makes calls between polls
+        SydNet::TimerWheel::Pointer timers{new SydNet::TimerWheel{ioService}};
         SydNet::Connection::RPCInvoker rpcInvoker{RPCMethods()};
         std::shared_ptr<SydNet::Server> server;
+        std::unique_ptr<SydNet::Cluster> cluster;
+        std::unique_ptr<SydNet::GatewayListener> gateways;
+        std::unique_ptr<SydNet::Gateway> gatewayServer;
         SydNet::Connection::Pointer connection;
-
-        if (runServer) {
+        bool dropped = false; // Waiting to reconnect
+
+        if (runServer && local) {
+            // game 3 [socket path]
+            server = std::shared_ptr<SydNet::Server>{new SydNet::IPCServer(rpcInvoker, ioService, argc > 2 ? argv[2] : localSocketPath())};
+        } else if (runServer && clustered) {
+            // game 5 <port> <cluster port> [cluster ports of the nodes started before this one...]
+            if (argc < 4) {
+                std::cerr << "Usage: " << argv[0] << " 5 <port> <cluster port> [cluster ports of the nodes started before this one...]" << std::endl;
+                return 1;
+            }
+            server = std::shared_ptr<SydNet::Server>{new SydNet::RealServer(rpcInvoker, ioService, atoi(argv[2]))};
+            cluster.reset(new SydNet::Cluster(*std::static_pointer_cast<SydNet::RealServer>(server), ioService, atoi(argv[3])));
+            cluster->timeouts(SydNet::RealConnection::Timeouts{std::chrono::seconds(2), std::chrono::seconds(10), std::chrono::seconds(5)});
+            for (int i = 4; i < argc; ++i) {
+                cluster->join(boost::asio::ip::tcp::endpoint{boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(atoi(argv[i]))});
+            }
+        } else if (runServer) {
+            // game 0 [capture file, or - for none] [port to listen for gateways on]
             server = std::shared_ptr<SydNet::Server>{new SydNet::RealServer(rpcInvoker, ioService, 2000)};
+            std::static_pointer_cast<SydNet::RealServer>(server)->timeouts(
+                    SydNet::RealConnection::Timeouts{std::chrono::seconds(2), std::chrono::seconds(10), std::chrono::seconds(5), std::chrono::seconds(5)});
+            std::static_pointer_cast<SydNet::RealServer>(server)->resumable();
+            std::static_pointer_cast<SydNet::RealServer>(server)->rateControl(
+                    SydNet::RateController::Settings{std::chrono::milliseconds(500), std::chrono::seconds(8)});
+            if (argc > 2 && std::string{argv[2]} != "-") {
+                std::static_pointer_cast<SydNet::RealServer>(server)->capture(argv[2]);
+            }
+            if (argc > 3) {
+                gateways.reset(new SydNet::GatewayListener(*std::static_pointer_cast<SydNet::RealServer>(server), ioService, atoi(argv[3])));
+            }
+        } else if (gateway) {
+            // game 6 <port> [port the server listens for gateways on]
+            if (argc < 3) {
+                std::cerr << "Usage: " << argv[0] << " 6 <port> [port the server listens for gateways on]" << std::endl;
+                return 1;
+            }
+            gatewayServer.reset(new SydNet::Gateway(ioService, atoi(argv[2]),
+                        boost::asio::ip::tcp::endpoint{boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(argc > 3 ? atoi(argv[3]) : 2100)}));
+            gatewayServer->clients().timeouts(
+                    SydNet::RealConnection::Timeouts{std::chrono::seconds(2), std::chrono::seconds(10), std::chrono::seconds(5), std::chrono::seconds(5)});
+            gatewayServer->clients().resumable();
+            gatewayServer->clients().lowFootprint();
         } else if (!connectToServer) {
             server = std::shared_ptr<SydNet::Server>{new SydNet::FakeServer(rpcInvoker)};
         }
 
-        if (connectToServer) {
-            connection = SydNet::OutgoingConnection::create(rpcInvoker, ioService, "localhost", 2000);
+        if (connectToServer && runServer) {
+            connection = std::static_pointer_cast<SydNet::RealServer>(server)->connectLocal(ioService);
+        } else if (connectToServer && local) {
+            // game 4 [socket path]
+            connection = SydNet::IPCConnection::create(rpcInvoker, ioService, argc > 2 ? argv[2] : localSocketPath());
+        } else if (connectToServer) {
+            connection = SydNet::OutgoingConnection::create(rpcInvoker, ioService, "localhost", argc > 2 ? atoi(argv[2]) : 2000);
+            std::static_pointer_cast<SydNet::RealConnection>(connection)->timeouts(timers,
+                    SydNet::RealConnection::Timeouts{std::chrono::seconds(2), std::chrono::seconds(10), std::chrono::seconds(5)});
+            std::static_pointer_cast<SydNet::OutgoingConnection>(connection)->onDisconnect(
+                    [&dropped](const boost::system::error_code &) { dropped = true; });
         }
 
         auto time = std::chrono::monotonic_clock::now();
@@ -85,9 +183,23 @@ int main(int argc, char * argv[])
             if (std::chrono::monotonic_clock::now() - time > duration) {
                 time += duration;
 
+                if (dropped) {
+                    dropped = false; // Unless this attempt fails too
+                    std::static_pointer_cast<SydNet::OutgoingConnection>(connection)->reconnect(
+                            [&dropped](const boost::system::error_code & error) { dropped = static_cast<bool>(error); });
+                    ioService.reset(); // Polling stops it once it runs out of work, as it did while disconnected
+                }
+
                 if (server) {
                     for (auto & client: server->clients()) {
-                        SydNet::Connection::Pointer{client.second}->execute(CLIENT_RPC(printMessage), "Tick!");
+                        SydNet::Connection::Pointer connection{client.second};
+                        auto real = std::dynamic_pointer_cast<SydNet::RealConnection>(connection);
+                        if (real && !real->updateDue()) {
+                            continue; // Its link is still catching up
+                        }
+                        if (!connection->remote()) { // Its own node ticks it
+                            connection->execute(CLIENT_RPC(printMessage), "Tick!");
+                        }
                     }
                 }
             }
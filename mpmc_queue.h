@@ -0,0 +1,160 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+namespace SydNet {
+
+/**
+ * Bounded lock-free queue for any number of producers and consumers.
+ *
+ * Each cell carries a sequence number saying whose turn it is, so producers and consumers only
+ * contend on their own position counter and never on each other.
+ */
+template<typename T>
+class MPMCQueue
+{
+    public:
+        /**
+         * Create an empty queue.
+         *
+         * @param capacity  Most values the queue can hold; must be a power of two
+         * @throw std::invalid_argument if the capacity isn't a power of two, so positions couldn't be masked
+         */
+        explicit MPMCQueue(size_t capacity)
+            : _cells{}
+            , _mask{capacity - 1}
+            , _padding0()
+            , _enqueue{0}
+            , _padding1()
+            , _dequeue{0}
+        {
+            if (!capacity || (capacity & (capacity - 1))) {
+                throw std::invalid_argument("A queue capacity that isn't a power of two was given");
+            }
+
+            _cells.reset(new Cell[capacity]);
+            for (size_t i = 0; i < capacity; ++i) {
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Add a value.
+         *
+         * @param value Value to move into the queue; left alone if the queue is full
+         * @return      False if the queue is full
+         */
+        bool push(T & value)
+        {
+            size_t position = _enqueue.load(std::memory_order_relaxed);
+            while (true) {
+                Cell & cell = _cells[position & _mask];
+                size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+                if (difference == 0) {
+                    if (_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell.value = std::move(value);
+                        cell.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = _enqueue.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Take the oldest value.
+         *
+         * @param value Set to the value taken
+         * @return      False if the queue is empty
+         */
+        bool pop(T & value)
+        {
+            size_t position = _dequeue.load(std::memory_order_relaxed);
+            while (true) {
+                Cell & cell = _cells[position & _mask];
+                size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+                if (difference == 0) {
+                    if (_dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        value = std::move(cell.value);
+                        cell.sequence.store(position + _mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = _dequeue.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Check whether anything has been pushed that hasn't been taken.
+         *
+         * @return  True if the queue looks empty (only a hint while other threads are using it)
+         */
+        bool empty() const
+        {
+            return _enqueue.load(std::memory_order_acquire) == _dequeue.load(std::memory_order_acquire);
+        }
+
+        MPMCQueue & operator=(const MPMCQueue &) = delete;
+        MPMCQueue(const MPMCQueue &) = delete;
+
+    private:
+        struct Cell
+        {
+            Cell()
+                : sequence{0}
+                , value{}
+            {
+            }
+
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask;
+        char _padding0[64]; // Keep producers and consumers off each other's cache lines
+        std::atomic<size_t> _enqueue;
+        char _padding1[64];
+        std::atomic<size_t> _dequeue;
+};
+
+}
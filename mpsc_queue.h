@@ -0,0 +1,127 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace SydNet {
+
+/**
+ * Unbounded lock-free queue for any number of producers and a single consumer, which takes everything
+ * queued in one go.
+ *
+ * Producers push onto a stack with a compare-and-swap and the consumer swaps the whole stack out and
+ * reverses it, so the only thing they ever contend on is one pointer, and an empty queue costs no more.
+ */
+template<typename T>
+class MPSCQueue
+{
+    public:
+        MPSCQueue()
+            : _head{nullptr}
+        {
+        }
+
+        /**
+         * Add a value; any thread can.
+         *
+         * @param value Value to move into the queue
+         * @return      True if the queue was empty, so the consumer needs waking to take it
+         */
+        bool push(T && value)
+        {
+            // The node is the consumer's once it's in, so only what it replaced is looked at afterwards
+            Node * node = new Node{std::move(value), nullptr};
+            Node * head = _head.load(std::memory_order_relaxed);
+            do {
+                node->next = head;
+            } while (!_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+            return !head;
+        }
+
+        /**
+         * Take everything queued, oldest first; only the consumer can.
+         *
+         * @param consume   Called with each value taken
+         * @return          Number of values taken
+         */
+        template<typename Consume>
+        size_t drain(Consume consume)
+        {
+            // Newest first as pushed, so turn it around
+            Node * node = _head.exchange(nullptr, std::memory_order_acquire);
+            Node * oldest = nullptr;
+            while (node) {
+                Node * next = node->next;
+                node->next = oldest;
+                oldest = node;
+                node = next;
+            }
+
+            size_t count = 0;
+            while (oldest) {
+                Node * next = oldest->next;
+                consume(oldest->value);
+                delete oldest;
+                oldest = next;
+                ++count;
+            }
+            return count;
+        }
+
+        /**
+         * Check whether anything has been pushed that hasn't been taken.
+         *
+         * @return  True if the queue looks empty (only a hint while other threads are using it)
+         */
+        bool empty() const
+        {
+            return !_head.load(std::memory_order_acquire);
+        }
+
+        ~MPSCQueue()
+        {
+            drain([](T &) {});
+        }
+
+        MPSCQueue & operator=(const MPSCQueue &) = delete;
+        MPSCQueue(const MPSCQueue &) = delete;
+
+    private:
+        struct Node
+        {
+            T value;
+            Node * next;
+        };
+
+        std::atomic<Node *> _head; // Newest first
+};
+
+}
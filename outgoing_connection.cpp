@@ -42,6 +42,54 @@ Connection::Pointer OutgoingConnection::create(const RPCInvoker & invoker, IOSer
     return ptr;
 }
 
+Connection::Pointer OutgoingConnection::create(const RPCInvoker & invoker, IOService & ioService,
+        const boost::asio::ip::tcp::endpoint & endpoint, const ConnectHandler & handler)
+{
+    OutgoingConnection * real{new OutgoingConnection{invoker, ioService}};
+    Connection::Pointer ptr{real};
+    LOG_INFO("Connection attempt: ", endpoint);
+    real->socket().async_connect(endpoint,
+        std::bind(&OutgoingConnection::handleConnect, std::static_pointer_cast<OutgoingConnection>(ptr),
+            std::placeholders::_1,
+            handler));
+    return ptr;
+}
+
+
+/*****************
+ * Public methods
+ *****************/
+
+void OutgoingConnection::disconnect()
+{
+    if (!_disconnectHandler) {
+        RealConnection::disconnect();
+        return;
+    }
+
+    bool wasConnected = connected();
+    try {
+        RealConnection::disconnect();
+    } catch (const boost::system::system_error & e) {
+        LOG_NOTICE("Connection dropped: ", e.what());
+    }
+    if (wasConnected) {
+        _disconnectHandler(lastErrorCode());
+    }
+}
+
+void OutgoingConnection::reconnect(const ConnectHandler & handler)
+{
+    boost::system::error_code error;
+    socket().close(error);
+
+    LOG_INFO("Reconnection attempt: ", _endpoint);
+    socket().async_connect(_endpoint,
+        std::bind(&OutgoingConnection::handleReconnect, std::static_pointer_cast<OutgoingConnection>(shared_from_this()),
+            std::placeholders::_1,
+            handler));
+}
+
 
 /******************
 * Private methods
@@ -51,7 +99,7 @@ void OutgoingConnection::connect(const std::string & hostname, unsigned short po
 {
     using boost::asio::ip::tcp;
 
-    tcp::resolver resolver{socket().io_service()};
+    tcp::resolver resolver{ioServiceOf(socket())};
     tcp::resolver::query query{hostname, "0"}; // The port is set later, directly
     tcp::resolver::iterator end;
     tcp::endpoint endPoint;
@@ -73,7 +121,39 @@ void OutgoingConnection::connect(const std::string & hostname, unsigned short po
 
     LOG_NOTICE("Connected: ", endPoint);
 
+    _endpoint = endPoint;
     read();
 }
 
+void OutgoingConnection::handleConnect(const boost::system::error_code & error, const ConnectHandler & handler)
+{
+    if (error) {
+        lastErrorCode(error);
+        boost::system::error_code closeError;
+        socket().close(closeError);
+    } else {
+        _endpoint = socket().remote_endpoint();
+        LOG_NOTICE("Connected: ", _endpoint);
+        read();
+    }
+
+    handler(error);
+}
+
+void OutgoingConnection::handleReconnect(const boost::system::error_code & error, const ConnectHandler & handler)
+{
+    if (error) {
+        LOG_INFO("Reconnection failed: ", error.message());
+        boost::system::error_code closeError;
+        socket().close(closeError);
+    } else {
+        LOG_NOTICE("Reconnected: ", _endpoint);
+        reopen();
+        requestResume();
+        read();
+    }
+
+    handler(error);
+}
+
 }
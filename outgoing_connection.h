@@ -47,11 +47,56 @@ class OutgoingConnection: public RealConnection
         static Connection::Pointer create(const RPCInvoker & invoker, IOService & ioService,
                 const std::string & hostname, unsigned short port);
 
+        typedef std::function<void(const boost::system::error_code & error)> ConnectHandler;
+
+        /**
+         * Create a new connection to a remote server without waiting for it to connect.
+         *
+         * @param invoker   RPC invoker to use with this connection
+         * @param ioService IOService to use
+         * @param endpoint  Address to connect to
+         * @param handler   Called once connected, or with the error if it couldn't
+         * @return          A shared Pointer to a new connection object
+         */
+        static Connection::Pointer create(const RPCInvoker & invoker, IOService & ioService,
+                const boost::asio::ip::tcp::endpoint & endpoint, const ConnectHandler & handler);
+
+        typedef std::function<void(const boost::system::error_code & error)> DisconnectHandler;
+
+        /**
+         * Be told when the connection drops, instead of having the error thrown.
+         *
+         * @param handler   Called with the error (or end of file) the connection dropped with
+         */
+        void onDisconnect(const DisconnectHandler & handler)
+        {
+            _disconnectHandler = handler;
+        }
+
+        virtual void disconnect();
+
+        /**
+         * Connect to the same server again and ask to resume the session where it left off, without waiting
+         * for it to connect.
+         *
+         * @param handler   Called once reconnected, or with the error if it couldn't
+         */
+        void reconnect(const ConnectHandler & handler);
+
     private:
         OutgoingConnection(const RPCInvoker & invoker, IOService & ioService)
-            : RealConnection{Outgoing, invoker, ioService} {}
+            : RealConnection{Outgoing, invoker, ioService}
+            , _endpoint{}
+            , _disconnectHandler{} {}
 
         void connect(const std::string & hostname, unsigned short port);
+
+        void handleConnect(const boost::system::error_code & error, const ConnectHandler & handler);
+
+        void handleReconnect(const boost::system::error_code & error, const ConnectHandler & handler);
+
+        boost::asio::ip::tcp::endpoint _endpoint; // Where it connected to
+        DisconnectHandler _disconnectHandler;
 };
 
 }
@@ -0,0 +1,388 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "packing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SYDNET_PACKING_X86
+#endif
+
+namespace SydNet {
+
+namespace Packing {
+
+namespace {
+    const uint32_t SIGN = 0x80000000u; // Offsets signed values to sort as unsigned ones
+    const float LIMIT = 2147483520.0f; // Largest float below 2^31
+
+    /*
+     * Plain loops, which also finish the few values left over by the vector loops.
+     */
+
+    void rangeScalar(const uint32_t * values, size_t count, uint32_t & lowest, uint32_t & highest)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            lowest = std::min(lowest, values[i]);
+            highest = std::max(highest, values[i]);
+        }
+    }
+
+    void offsetScalar(uint32_t * values, size_t count, uint32_t amount)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            values[i] += amount;
+        }
+    }
+
+    void quantizeScalar(const float * values, size_t count, float steps, uint32_t * quantized)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            // Compared the way the vector min and max instructions compare, so NaNs come out the same
+            float scaled = values[i] * steps;
+            scaled = scaled > -LIMIT ? scaled : -LIMIT;
+            scaled = scaled < LIMIT ? scaled : LIMIT;
+            quantized[i] = static_cast<uint32_t>(static_cast<int32_t>(std::nearbyint(scaled))) ^ SIGN;
+        }
+    }
+
+    void dequantizeScalar(const uint32_t * quantized, size_t count, float step, float * values)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = static_cast<float>(static_cast<int32_t>(quantized[i] ^ SIGN)) * step;
+        }
+    }
+
+#ifdef SYDNET_PACKING_X86
+    bool hasAVX2()
+    {
+        static const bool has = __builtin_cpu_supports("avx2");
+        return has;
+    }
+
+    /*
+     * AVX2, eight values at a time; only called once hasAVX2() says the processor has it.
+     */
+
+    __attribute__((target("avx2")))
+    void rangeAVX2(const uint32_t * values, size_t count, uint32_t & lowest, uint32_t & highest)
+    {
+        __m256i low = _mm256_set1_epi32(-1);
+        __m256i high = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+            low = _mm256_min_epu32(low, value);
+            high = _mm256_max_epu32(high, value);
+        }
+
+        uint32_t lows[8];
+        uint32_t highs[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lows), low);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(highs), high);
+        rangeScalar(lows, 8, lowest, highest);
+        rangeScalar(highs, 8, lowest, highest);
+        rangeScalar(values + i, count - i, lowest, highest);
+    }
+
+    __attribute__((target("avx2")))
+    void offsetAVX2(uint32_t * values, size_t count, uint32_t amount)
+    {
+        const __m256i add = _mm256_set1_epi32(static_cast<int32_t>(amount));
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i * at = reinterpret_cast<__m256i *>(values + i);
+            _mm256_storeu_si256(at, _mm256_add_epi32(_mm256_loadu_si256(at), add));
+        }
+        offsetScalar(values + i, count - i, amount);
+    }
+
+    __attribute__((target("avx2")))
+    void quantizeAVX2(const float * values, size_t count, float steps, uint32_t * quantized)
+    {
+        const __m256 scale = _mm256_set1_ps(steps);
+        const __m256 low = _mm256_set1_ps(-LIMIT);
+        const __m256 high = _mm256_set1_ps(LIMIT);
+        const __m256i sign = _mm256_set1_epi32(static_cast<int32_t>(SIGN));
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256 scaled = _mm256_mul_ps(_mm256_loadu_ps(values + i), scale);
+            scaled = _mm256_min_ps(_mm256_max_ps(scaled, low), high);
+            __m256i fixed = _mm256_xor_si256(_mm256_cvtps_epi32(scaled), sign);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(quantized + i), fixed);
+        }
+        quantizeScalar(values + i, count - i, steps, quantized + i);
+    }
+
+    __attribute__((target("avx2")))
+    void dequantizeAVX2(const uint32_t * quantized, size_t count, float step, float * values)
+    {
+        const __m256 scale = _mm256_set1_ps(step);
+        const __m256i sign = _mm256_set1_epi32(static_cast<int32_t>(SIGN));
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i fixed = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(quantized + i)), sign);
+            _mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_cvtepi32_ps(fixed), scale));
+        }
+        dequantizeScalar(quantized + i, count - i, step, values + i);
+    }
+
+    /**
+     * Unpack values up to 25 bits wide by gathering the 32 bits each starts in, which is all of it.
+     *
+     * @return  How many were unpacked; the rest would gather past the end
+     */
+    __attribute__((target("avx2")))
+    size_t unpackAVX2(const char * input, size_t count, unsigned bits, uint32_t * values)
+    {
+        const size_t length = packedLength(count, bits);
+        const __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bits));
+        const __m256i mask = _mm256_set1_epi32(static_cast<int32_t>((uint64_t{1} << bits) - 1));
+        const __m256i withinByte = _mm256_set1_epi32(7);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            size_t bit = i * bits;
+            if ((bit + 7 * bits) / 8 + sizeof(uint32_t) > length) {
+                break;
+            }
+
+            // Bit positions relative to the byte the first value starts in, so they can't overflow
+            __m256i positions = _mm256_add_epi32(lanes, _mm256_set1_epi32(static_cast<int32_t>(bit % 8)));
+            __m256i words = _mm256_i32gather_epi32(reinterpret_cast<const int *>(input + bit / 8), _mm256_srli_epi32(positions, 3), 1);
+            __m256i value = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(positions, withinByte)), mask);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(values + i), value);
+        }
+        return i;
+    }
+#endif
+
+#ifdef __SSE2__
+    /*
+     * SSE2, four values at a time; every x86-64 processor has it.
+     */
+
+    void rangeSSE2(const uint32_t * values, size_t count, uint32_t & lowest, uint32_t & highest)
+    {
+        // SSE2 only compares signed values, so compare them offset by the sign bit
+        const __m128i sign = _mm_set1_epi32(static_cast<int32_t>(SIGN));
+        __m128i low = _mm_set1_epi32(0x7fffffff);
+        __m128i high = sign;
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i value = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i)), sign);
+            __m128i below = _mm_cmplt_epi32(value, low);
+            low = _mm_or_si128(_mm_and_si128(below, value), _mm_andnot_si128(below, low));
+            __m128i above = _mm_cmpgt_epi32(value, high);
+            high = _mm_or_si128(_mm_and_si128(above, value), _mm_andnot_si128(above, high));
+        }
+
+        uint32_t lows[4];
+        uint32_t highs[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lows), _mm_xor_si128(low, sign));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(highs), _mm_xor_si128(high, sign));
+        rangeScalar(lows, 4, lowest, highest);
+        rangeScalar(highs, 4, lowest, highest);
+        rangeScalar(values + i, count - i, lowest, highest);
+    }
+
+    void offsetSSE2(uint32_t * values, size_t count, uint32_t amount)
+    {
+        const __m128i add = _mm_set1_epi32(static_cast<int32_t>(amount));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i * at = reinterpret_cast<__m128i *>(values + i);
+            _mm_storeu_si128(at, _mm_add_epi32(_mm_loadu_si128(at), add));
+        }
+        offsetScalar(values + i, count - i, amount);
+    }
+
+    void quantizeSSE2(const float * values, size_t count, float steps, uint32_t * quantized)
+    {
+        const __m128 scale = _mm_set1_ps(steps);
+        const __m128 low = _mm_set1_ps(-LIMIT);
+        const __m128 high = _mm_set1_ps(LIMIT);
+        const __m128i sign = _mm_set1_epi32(static_cast<int32_t>(SIGN));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128 scaled = _mm_mul_ps(_mm_loadu_ps(values + i), scale);
+            scaled = _mm_min_ps(_mm_max_ps(scaled, low), high);
+            __m128i fixed = _mm_xor_si128(_mm_cvtps_epi32(scaled), sign);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(quantized + i), fixed);
+        }
+        quantizeScalar(values + i, count - i, steps, quantized + i);
+    }
+
+    void dequantizeSSE2(const uint32_t * quantized, size_t count, float step, float * values)
+    {
+        const __m128 scale = _mm_set1_ps(step);
+        const __m128i sign = _mm_set1_epi32(static_cast<int32_t>(SIGN));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i fixed = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(quantized + i)), sign);
+            _mm_storeu_ps(values + i, _mm_mul_ps(_mm_cvtepi32_ps(fixed), scale));
+        }
+        dequantizeScalar(quantized + i, count - i, step, values + i);
+    }
+#endif
+}
+
+/*
+ * Picks the widest kernel the processor has.
+ */
+#ifdef SYDNET_PACKING_X86
+#define SYDNET_PACKING_AVX2(kernel, ...) if (hasAVX2()) { kernel##AVX2(__VA_ARGS__); return; }
+#else
+#define SYDNET_PACKING_AVX2(kernel, ...)
+#endif
+
+#ifdef __SSE2__
+#define SYDNET_PACKING_DISPATCH(kernel, ...) SYDNET_PACKING_AVX2(kernel, __VA_ARGS__) kernel##SSE2(__VA_ARGS__)
+#else
+#define SYDNET_PACKING_DISPATCH(kernel, ...) SYDNET_PACKING_AVX2(kernel, __VA_ARGS__) kernel##Scalar(__VA_ARGS__)
+#endif
+
+void range(const uint32_t * values, size_t count, uint32_t & lowest, uint32_t & highest)
+{
+    lowest = UINT32_MAX;
+    highest = 0;
+    SYDNET_PACKING_DISPATCH(range, values, count, lowest, highest);
+}
+
+void offset(uint32_t * values, size_t count, uint32_t amount)
+{
+    SYDNET_PACKING_DISPATCH(offset, values, count, amount);
+}
+
+void quantize(const float * values, size_t count, float steps, uint32_t * quantized)
+{
+    SYDNET_PACKING_DISPATCH(quantize, values, count, steps, quantized);
+}
+
+void dequantize(const uint32_t * quantized, size_t count, float step, float * values)
+{
+    SYDNET_PACKING_DISPATCH(dequantize, quantized, count, step, values);
+}
+
+#undef SYDNET_PACKING_DISPATCH
+#undef SYDNET_PACKING_AVX2
+
+void pack(const uint32_t * values, size_t count, unsigned bits, char * output)
+{
+    // Values go into the bottom of an accumulator, which is written out a 32-bit word at a time
+    uint64_t pending = 0;
+    unsigned filled = 0;
+    auto put = [&pending, &filled, &output](uint64_t value, unsigned width) {
+        pending |= value << filled;
+        filled += width;
+        if (filled >= 32) {
+            uint32_t word = static_cast<uint32_t>(pending);
+            std::memcpy(output, &word, sizeof(word));
+            output += sizeof(word);
+            pending >>= 32;
+            filled -= 32;
+        }
+    };
+
+    // Narrow values go in two at a time, halving the steps through the accumulator
+    size_t i = 0;
+    if (bits <= 16) {
+        for (; i + 2 <= count; i += 2) {
+            put(values[i] | static_cast<uint64_t>(values[i + 1]) << bits, 2 * bits);
+        }
+    }
+    for (; i < count; ++i) {
+        put(values[i], bits);
+    }
+
+    for (; filled > 0; filled = filled > 8 ? filled - 8 : 0) {
+        *output++ = static_cast<char>(pending);
+        pending >>= 8;
+    }
+}
+
+void unpack(const char * input, size_t count, unsigned bits, uint32_t * values)
+{
+    const uint64_t mask = (uint64_t{1} << bits) - 1;
+    const size_t length = packedLength(count, bits);
+
+    size_t i = 0;
+#ifdef SYDNET_PACKING_X86
+    if (bits <= 25 && hasAVX2()) {
+        i = unpackAVX2(input, count, bits, values);
+    }
+#endif
+
+    // Every value is within the 64 bits starting at the byte its first bit is in, so each takes one load
+    for (; i < count; ++i) {
+        size_t bit = i * bits;
+        if (bit / 8 + sizeof(uint64_t) > length) {
+            break;
+        }
+        uint64_t word;
+        std::memcpy(&word, input + bit / 8, sizeof(word));
+        values[i] = static_cast<uint32_t>((word >> (bit % 8)) & mask);
+    }
+
+    // The last few would load past the end, so take them from a padded copy
+    char tail[2 * sizeof(uint64_t)] = {};
+    const size_t start = i * bits / 8;
+    std::memcpy(tail, input + start, length - start);
+    for (; i < count; ++i) {
+        size_t bit = i * bits - start * 8;
+        uint64_t word;
+        std::memcpy(&word, tail + bit / 8, sizeof(word));
+        values[i] = static_cast<uint32_t>((word >> (bit % 8)) & mask);
+    }
+}
+
+void delta(uint32_t * values, size_t count)
+{
+    for (size_t i = count; i-- > 1;) {
+        uint32_t difference = values[i] - values[i - 1];
+        values[i] = (difference << 1) ^ (0u - (difference >> 31));
+    }
+    if (count) {
+        values[0] = 0;
+    }
+}
+
+void undelta(uint32_t * values, size_t count, uint32_t first)
+{
+    uint32_t value = first;
+    for (size_t i = 0; i < count; ++i) {
+        value += (values[i] >> 1) ^ (0u - (values[i] & 1));
+        values[i] = value;
+    }
+}
+
+}
+
+}
@@ -0,0 +1,145 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace SydNet {
+
+/**
+ * Kernels for packing arrays of 32-bit values into as few bits as they need.
+ *
+ * Values are packed least significant bit first into a little-endian bit stream. The passes over whole
+ * arrays use AVX2 where the processor has it, SSE2 where the build targets it, and plain loops otherwise;
+ * every path gives the same results.
+ */
+namespace Packing {
+    /**
+     * Get how many bits a value needs.
+     *
+     * @param value Largest value to be packed
+     * @return      Bits from 0 to 32
+     */
+    inline unsigned width(uint32_t value)
+    {
+        return value ? 32 - __builtin_clz(value) : 0;
+    }
+
+    /**
+     * Get how many bytes values take once packed.
+     *
+     * @param count Number of values
+     * @param bits  Bits each takes
+     * @return      Bytes
+     */
+    inline size_t packedLength(size_t count, unsigned bits)
+    {
+        return (count * bits + 7) / 8;
+    }
+
+    /**
+     * Find the smallest and the largest of some values.
+     *
+     * @param values    Values; at least one
+     * @param count     Number of values
+     * @param lowest    Set to the smallest
+     * @param highest   Set to the largest
+     */
+    void range(const uint32_t * values, size_t count, uint32_t & lowest, uint32_t & highest);
+
+    /**
+     * Add the same amount to every value, wrapping around.
+     *
+     * @param values    Values to change
+     * @param count     Number of values
+     * @param amount    Amount to add; the negation of an amount takes it off again
+     */
+    void offset(uint32_t * values, size_t count, uint32_t amount);
+
+    /**
+     * Pack values into a bit stream.
+     *
+     * @param values    Values, each fitting in the given bits
+     * @param count     Number of values
+     * @param bits      Bits each takes, up to 32
+     * @param output    Where to put the packedLength() bytes they take
+     */
+    void pack(const uint32_t * values, size_t count, unsigned bits, char * output);
+
+    /**
+     * Unpack values from a bit stream.
+     *
+     * @param input     The packedLength() bytes they take
+     * @param count     Number of values
+     * @param bits      Bits each takes, up to 32
+     * @param values    Where to put them
+     */
+    void unpack(const char * input, size_t count, unsigned bits, uint32_t * values);
+
+    /**
+     * Replace each value but the first with the difference from the one before it, zigzag encoded so small
+     * differences either way are small. The first becomes zero.
+     *
+     * @param values    Values to change
+     * @param count     Number of values
+     */
+    void delta(uint32_t * values, size_t count);
+
+    /**
+     * Undo delta().
+     *
+     * @param values    Differences to change back into values
+     * @param count     Number of values
+     * @param first     The first value
+     */
+    void undelta(uint32_t * values, size_t count, uint32_t first);
+
+    /**
+     * Turn floats into fixed point, rounding to the nearest step. Values too large to represent are clamped,
+     * and NaNs become the lowest value.
+     *
+     * @param values    Floats
+     * @param count     Number of values
+     * @param steps     Steps per unit
+     * @param quantized Where to put them, as signed 32-bit values offset to sort as unsigned ones
+     */
+    void quantize(const float * values, size_t count, float steps, uint32_t * quantized);
+
+    /**
+     * Undo quantize().
+     *
+     * @param quantized Fixed point values
+     * @param count     Number of values
+     * @param step      Size of a step; the inverse of the steps per unit
+     * @param values    Where to put the floats
+     */
+    void dequantize(const uint32_t * quantized, size_t count, float step, float * values);
+}
+
+}
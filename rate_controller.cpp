@@ -0,0 +1,142 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "rate_controller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace SydNet {
+
+namespace {
+    // A write that took at least this long had to wait for the socket, so it says how fast the link drains
+    const RateController::Clock::duration BLOCKED_WRITE = std::chrono::milliseconds(1);
+}
+
+/*****************
+ * Public methods
+ *****************/
+
+RateController::RateController(const Settings & settings)
+    : _settings(validate(settings))
+    , _interval{settings.fastest}
+    , _budget{settings.budget}
+    , _rate{0}
+    , _measured{0}
+    , _sent{false}
+    , _rtt{Clock::duration::zero()}
+    , _writeStarted{}
+    , _next{}
+    , _backlog{0}
+{
+}
+
+void RateController::writeStarted(Clock::time_point now)
+{
+    _writeStarted = now;
+}
+
+void RateController::writeFinished(size_t bytes, Clock::time_point now)
+{
+    Clock::duration took = now - _writeStarted;
+    if (took < BLOCKED_WRITE) {
+        return; // The socket took it straight away; all that says is the link is faster than we've been sending
+    }
+
+    _measured = bytes / std::chrono::duration<double>(took).count();
+    _rate = _rate ? _rate + (_measured - _rate) / 4 : _measured;
+}
+
+bool RateController::due(Clock::time_point now, size_t backlog)
+{
+    if (now < _next) {
+        return false;
+    }
+    bool sent = _sent;
+    _sent = false;
+
+    // Queueing tolerated: a round trip, or an update interval if that's longer
+    Clock::duration tolerated = std::max(_settings.fastest, _rtt);
+    bool queued = backlog > _settings.minimumBudget;
+    bool growing = queued && backlog > _backlog;
+    bool delayed = queued && _rate && backlog / _rate > std::chrono::duration<double>(tolerated).count();
+    _backlog = backlog;
+
+    if (growing || delayed) {
+        _interval = std::min(_settings.slowest, _interval + _interval / 2);
+        limit();
+        if (backlog > _budget) {
+            // More than a whole update is still waiting; adding another would only build the queue
+            _next = now + _interval;
+            return false;
+        }
+    } else if (!queued) {
+        _interval = std::max(_settings.fastest, _interval - _interval / 8);
+        if (_rate && sent) {
+            // The last update got through, so probe for the link having got better; a write held up again will say if not.
+            // No further than sending the whole budget at the fastest pace, or twice what was last measured, as writes
+            // the socket takes straight away never bring it back down
+            double ceiling = std::min(_settings.budget / std::chrono::duration<double>(_settings.fastest).count(), 2 * _measured);
+            _rate = std::min(_rate + _rate / 8, ceiling);
+        }
+        limit();
+    }
+
+    _next = now + _interval;
+    _sent = true;
+    return true;
+}
+
+const RateController::Settings & RateController::validate(const Settings & settings)
+{
+    // The budget is worked out per second of the fastest interval, and the interval only grows towards the slowest
+    if (settings.fastest <= Clock::duration::zero()) {
+        throw std::invalid_argument("A fastest update interval that isn't positive was given");
+    }
+    if (settings.slowest < settings.fastest) {
+        throw std::invalid_argument("A slowest update interval shorter than the fastest was given");
+    }
+    if (settings.minimumBudget > settings.budget) {
+        throw std::invalid_argument("A minimum update budget larger than the budget was given");
+    }
+    return settings;
+}
+
+/******************
+* Private methods
+******************/
+
+void RateController::limit()
+{
+    // What the link drains in one interval, or everything until it's been seen to hold a write up
+    double drained = _rate * std::chrono::duration<double>(_interval).count();
+    _budget = _rate > 0 && std::isfinite(drained) ? static_cast<size_t>(std::min<double>(drained, _settings.budget)) : _settings.budget;
+    _budget = std::max(_budget, _settings.minimumBudget);
+}
+
+}
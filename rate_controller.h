@@ -0,0 +1,166 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace SydNet {
+
+/**
+ * Decides how often a client is sent state updates and how big they may be, from how fast its link drains.
+ *
+ * The link's delivery rate is measured from writes that had to wait for the socket, and the queueing delay is
+ * what's waiting to be sent over that rate. When the delay grows past a round trip (or an update interval, if
+ * that's longer), or what's waiting keeps growing, the time between updates grows by half; while nothing is
+ * waiting it shrinks back an eighth at a time. Each update's budget is what the link drains in one interval, so a poor
+ * link gets fewer, smaller updates instead of a queue that puts it seconds behind.
+ *
+ * Only ever used from the network thread.
+ */
+class RateController
+{
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Settings
+        {
+            Settings(Clock::duration fastest = std::chrono::milliseconds(50), Clock::duration slowest = std::chrono::seconds(2),
+                    size_t budget = 16 * 1024, size_t minimumBudget = 512)
+                : fastest{fastest}
+                , slowest{slowest}
+                , budget{budget}
+                , minimumBudget{minimumBudget}
+            {
+            }
+
+            Clock::duration fastest; // Shortest time between updates, for a link that keeps up
+            Clock::duration slowest; // Longest, for the worst of links
+            size_t budget; // Most bytes an update may take
+            size_t minimumBudget; // Fewest an update is cut down to; less than this waiting doesn't count as a queue
+        };
+
+        /**
+         * Create a controller for one client.
+         *
+         * @param settings  Fastest and slowest updates and their budgets
+         * @throw std::invalid_argument if the fastest interval isn't positive, the slowest is faster than it, or the
+         *        minimum budget is more than the budget
+         */
+        explicit RateController(const Settings & settings);
+
+        /**
+         * Check settings before they're handed to controllers made later.
+         *
+         * @param settings  Fastest and slowest updates and their budgets
+         * @return          The settings
+         * @throw std::invalid_argument if they would make a controller throw
+         */
+        static const Settings & validate(const Settings & settings);
+
+        /**
+         * Note that a write to the socket has started.
+         *
+         * @param now   Current time
+         */
+        void writeStarted(Clock::time_point now);
+
+        /**
+         * Note that a write to the socket has finished, to measure the delivery rate by.
+         *
+         * @param bytes Bytes written
+         * @param now   Current time
+         */
+        void writeFinished(size_t bytes, Clock::time_point now);
+
+        /**
+         * Note the latest estimate of the round trip time.
+         *
+         * @param rtt   Round trip time
+         */
+        void rtt(Clock::duration rtt)
+        {
+            _rtt = rtt;
+        }
+
+        /**
+         * Check whether the client is due an update, adapting to how its link is coping.
+         * Once this says yes, the update is taken as sent.
+         *
+         * @param now       Current time
+         * @param backlog   Bytes waiting to be sent to the client
+         * @return          True if an update should be sent now
+         */
+        bool due(Clock::time_point now, size_t backlog);
+
+        /**
+         * Get the time between updates.
+         *
+         * @return  Time between updates, from the fastest to the slowest
+         */
+        Clock::duration interval() const
+        {
+            return _interval;
+        }
+
+        /**
+         * Get how many bytes the next update should fit in.
+         *
+         * @return  Budget in bytes
+         */
+        size_t budget() const
+        {
+            return _budget;
+        }
+
+        /**
+         * Get the link's delivery rate, as measured.
+         *
+         * @return  Bytes per second, or 0 if the link has never held a write up
+         */
+        double rate() const
+        {
+            return _rate;
+        }
+
+    private:
+        void limit();
+
+        Settings _settings;
+        Clock::duration _interval; // Between updates, from fastest to slowest
+        size_t _budget;
+        double _rate; // Bytes per second the link drains, smoothed
+        double _measured; // The last rate actually measured, which probing stays within reach of
+        bool _sent; // Whether the last check sent an update
+        Clock::duration _rtt; // Zero until measured
+        Clock::time_point _writeStarted;
+        Clock::time_point _next; // When the next update is due
+        size_t _backlog; // Waiting to be sent at the last update
+};
+
+}
@@ -27,8 +27,74 @@ or implied, of Christopher Allen Ogden.
 */
 #include "real_connection.h"
 
+#include <algorithm>
+#include <cstring>
+#include <random>
+
 namespace SydNet {
 
+namespace {
+    std::string sessionBytes(const boost::uuids::uuid & session)
+    {
+        return std::string(session.begin(), session.end());
+    }
+
+    boost::uuids::uuid readSession(const char * bytes)
+    {
+        boost::uuids::uuid session;
+        std::memcpy(session.data, bytes, session.size());
+        return session;
+    }
+
+    Frame::Time wallClock()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    std::string timeBytes(Frame::Time time)
+    {
+        return std::string(reinterpret_cast<const char *>(&time), sizeof(time));
+    }
+
+    Frame::Time readTime(const char * bytes)
+    {
+        Frame::Time time;
+        std::memcpy(&time, bytes, sizeof(time));
+        return time;
+    }
+
+    // Buffers idle connections gave back, for whichever connection on the same thread needs one next
+    typedef std::unique_ptr<boost::asio::streambuf> Buffer;
+    const size_t MAX_POOLED_BUFFERS = 64;
+
+    std::vector<Buffer> & bufferPool()
+    {
+        static thread_local std::vector<Buffer> pool;
+        return pool;
+    }
+
+    Buffer takeBuffer()
+    {
+        std::vector<Buffer> & pool = bufferPool();
+        if (pool.empty()) {
+            return Buffer{new boost::asio::streambuf};
+        }
+        Buffer buffer = std::move(pool.back());
+        pool.pop_back();
+        return buffer;
+    }
+
+    void giveBuffer(Buffer & buffer)
+    {
+        std::vector<Buffer> & pool = bufferPool();
+        if (buffer && pool.size() < MAX_POOLED_BUFFERS) {
+            buffer->consume(buffer->size());
+            pool.push_back(std::move(buffer));
+        }
+        buffer.reset();
+    }
+}
+
 /*****************
  * Public methods
  *****************/
@@ -36,6 +102,23 @@ namespace SydNet {
 void RealConnection::disconnect()
 {
     _connected = false;
+    _heartbeatTimer.cancel();
+    _idleTimer.cancel();
+    _requestTimer.cancel();
+    _responseTimer.cancel();
+    if (_cold) {
+        for (PendingResponse & response: _cold->responses) {
+            response.deferred->abandon();
+        }
+        _cold->responses.clear();
+    }
+    if (_tracer) {
+        _tracer->forget(uuid());
+    }
+    if (_scheduler) {
+        _scheduler->remove(uuid());
+    }
+
     if (!_lastErrorCode) {
         LOG_DEBUG("Shutting down socket");
         _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, _lastErrorCode);
@@ -61,6 +144,153 @@ Connection::ConnectionMap & RealConnection::peers()
     return *_peers;
 }
 
+void RealConnection::timeouts(const TimerWheel::Pointer & timers, const Timeouts & timeouts)
+{
+    _timers = timers;
+    _timeouts = timeouts;
+
+    if (_timeouts.heartbeat.count()) {
+        _timers->schedule(_heartbeatTimer, _timeouts.heartbeat, std::bind(&RealConnection::handleHeartbeatTimer, this));
+    }
+    if (_timeouts.idle.count()) {
+        _timers->schedule(_idleTimer, _timeouts.idle, std::bind(&RealConnection::handleIdleTimer, this));
+    }
+
+    // Requests already waiting get the new timeout too, and none may outlast the ones made from now on
+    if (!_requestCallbacks.empty()) {
+        TimerWheel::Clock::time_point now = TimerWheel::Clock::now();
+        if (_timeouts.request.count()) {
+            for (RequestCallback & request: _requestCallbacks) {
+                request.deadline = std::min(request.deadline, now + _timeouts.request);
+            }
+        }
+        scheduleRequestTimer(now);
+    }
+}
+
+void RealConnection::stream(StreamID stream, unsigned priority, unsigned weight)
+{
+    if (_streams.size() <= stream) {
+        _streams.resize(stream + 1, Stream{0, 1, _pass, {}, 0, {}});
+    }
+    _streams[stream].priority = priority;
+    _streams[stream].weight = std::max(weight, 1u);
+}
+
+void RealConnection::tracing(Tracer * tracer)
+{
+    _tracer = tracer;
+    if (_tracer && _connected) {
+        sendClock();
+    }
+}
+
+void RealConnection::rateControl(const RateController::Settings & settings)
+{
+    cold().rate.reset(new RateController{settings});
+    if (_connected) {
+        sendClock();
+    }
+}
+
+bool RealConnection::updateDue()
+{
+    if (!_cold || !_cold->rate) {
+        return true;
+    }
+    return _cold->rate->due(RateController::Clock::now(), backlog());
+}
+
+void RealConnection::sendFrame(const char * frame, size_t length, StreamID stream)
+{
+    send(stream, !Frame::isControl(frame, length), [frame, length](std::ostream & outgoingStream) {
+        CommandSize size = length;
+        outgoingStream.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        outgoingStream.write(frame, length);
+    });
+}
+
+void RealConnection::announceSession()
+{
+    // Unguessable, unlike the UUID, which other clients get to see
+    std::random_device random;
+    _secret.clear();
+    while (_secret.size() < Frame::SECRET_BYTES) {
+        unsigned int bits = random();
+        _secret.append(reinterpret_cast<const char *>(&bits), std::min(sizeof(bits), Frame::SECRET_BYTES - _secret.size()));
+    }
+    sendControl(Frame::SESSION, sessionBytes(uuid()) + _secret);
+}
+
+bool RealConnection::secretMatches(const char * secret) const
+{
+    if (_secret.size() != Frame::SECRET_BYTES) {
+        return false;
+    }
+
+    // Look at every byte, so how long it takes doesn't give away how much of it was right
+    unsigned char difference = 0;
+    for (size_t i = 0; i < Frame::SECRET_BYTES; ++i) {
+        difference |= static_cast<unsigned char>(_secret[i] ^ secret[i]);
+    }
+    return !difference;
+}
+
+bool RealConnection::resume(RealConnection & from, Sequence received)
+{
+    // Counts wrap, so go by how many it missed rather than comparing them
+    Sequence missed = from._sentSequence - received;
+    if (missed > (from._cold ? from._cold->replay.size() : 0)) {
+        return false;
+    }
+
+    uuid(from.uuid());
+    _secret = from._secret; // The client keeps the one it has
+    _sentSequence = from._sentSequence;
+    if (missed || from._cold) {
+        cold().replay = std::move(from.cold().replay);
+        cold().replayBytes = from.cold().replayBytes;
+        from.cold().replay.clear();
+        from.cold().replayBytes = 0;
+    }
+
+    // Results still being worked out on the old connection are sent from here
+    SessionLink link = from.sessionLink();
+    *link = getDerivedPointer();
+    cold().session = link;
+
+    // Results the client sends for requests made before it dropped off come back here now
+    _requestCallbacks = std::move(from._requestCallbacks);
+    _nextRequestID = from._nextRequestID;
+    from._requestCallbacks.clear();
+    if (_timers) {
+        scheduleRequestTimer(TimerWheel::Clock::now());
+    }
+
+    sendControl(Frame::RESUMED, sessionBytes(uuid()));
+
+    // Already counted and kept; send them as they are, ahead of anything new
+    if (missed) {
+        _urgent.insert(_urgent.end(), _cold->replay.end() - missed, _cold->replay.end());
+    }
+
+    // Then whatever was still waiting to go out on the old connection
+    for (size_t stream = 0; stream < from._streams.size(); ++stream) {
+        Stream & queue = from._streams[stream];
+        for (; !queue.empty(); ++queue.next) {
+            enqueue(stream, std::move(queue.frames[queue.next]));
+        }
+        queue.frames.clear();
+        queue.next = 0;
+        queue.latest.clear();
+    }
+    from._queued = 0;
+    write();
+
+    LOG_INFO("Resumed session ", uuid(), " with ", missed, " frames replayed");
+    return true;
+}
+
 
 /********************
  * Protected methods
@@ -74,13 +304,43 @@ RealConnection::RealConnection(Type type,
     : Connection{type, invoker, uuid}
     , _incoming{}
     , _outgoing{}
-    , _writing{false}
     , _socket{ioService}
+    , _writing{false}
     , _connected{false}
+    , _lowFootprint{false}
+    , _sent{false}
+    , _received{false}
+    , _readPaused{false}
+    , _offloadRunning{false}
+    , _resuming{false}
+    , _readDepth{0}
+    , _pausedSize{0}
+    , _streams{}
+    , _queued{0}
+    , _pass{0}
+    , _urgent{}
+    , _replayLimit{0}
+    , _sentSequence{0}
+    , _receivedSequence{0}
+    , _pendingReceived{0}
+    , _secret{}
     , _lastErrorCode{}
     , _peers{peers}
     , _requestCallbacks{}
     , _nextRequestID{1}
+    , _scheduler{NULL}
+    , _workers{NULL}
+    , _capture{NULL}
+    , _tracer{NULL}
+    , _timers{}
+    , _timeouts()
+    , _heartbeatTimer{}
+    , _idleTimer{}
+    , _requestTimer{}
+    , _responseTimer{}
+    , _cold{}
+    , _rtt{}
+    , _clockOffset{}
 {
 }
 
@@ -90,37 +350,92 @@ void RealConnection::read(size_t size)
 
     if (size >= sizeof(CommandSize)) {
         handleReadCommandHeader(boost::system::error_code{}, size);
+    } else if (!size && _lowFootprint) {
+        // Nothing part read; wait for the next frame without holding on to a buffer meanwhile
+        giveBuffer(_incoming);
+        _socket.async_read_some(boost::asio::null_buffers(),
+            std::bind(&RealConnection::handleReadable, getDerivedPointer(),
+                std::placeholders::_1));
     } else {
-        boost::asio::async_read(_socket, _incoming, boost::asio::transfer_at_least(sizeof(CommandSize) - size),
-            std::bind(&RealConnection::handleReadCommandHeader, getDerivedPointer(),
-                std::placeholders::_1,
-                std::placeholders::_2));
+        readHeader(size);
     }
 }
 
+void RealConnection::readHeader(size_t size)
+{
+    boost::asio::async_read(_socket, incoming(), boost::asio::transfer_at_least(sizeof(CommandSize) - size),
+        std::bind(&RealConnection::handleReadCommandHeader, getDerivedPointer(),
+            std::placeholders::_1,
+            std::placeholders::_2));
+}
+
+
+void RealConnection::reopen()
+{
+    // Whatever was part way through being read or written went with the old socket
+    if (_incoming) {
+        _incoming->consume(_incoming->size());
+    }
+    if (_outgoing) {
+        _outgoing->consume(_outgoing->size());
+    }
+    _writing = false;
+    _readPaused = false;
+    _pausedSize = 0;
+    _lastErrorCode = boost::system::error_code{};
+
+    if (_timers) {
+        timeouts(_timers, _timeouts);
+    }
+}
+
+void RealConnection::requestResume()
+{
+    _resuming = true;
+    _pendingReceived = 0;
+
+    std::string payload{sessionBytes(uuid()) + _secret};
+    payload.append(reinterpret_cast<const char *>(&_receivedSequence), sizeof(_receivedSequence));
+    sendControl(Frame::RESUME, payload);
+}
+
 
 /******************
 * Private methods
 ******************/
 
-void RealConnection::remoteExecute(const std::string & name, const std::string & params, RequestID requestID)
+void RealConnection::remoteExecute(const std::string & name, const std::string & params, RequestID requestID, StreamID stream)
 {
-    std::ostream outgoingStream{&_outgoing};
-    CommandSize size{name.length() + params.length() + sizeof(PACKET_END) + sizeof(RequestID)};
-    outgoingStream.write(reinterpret_cast<char *>(&size), sizeof(size));
-    outgoingStream.write(reinterpret_cast<char *>(&requestID), sizeof(requestID));
-    outgoingStream << name << PACKET_END;
-    outgoingStream << params;
+    if (handedOver(ioServiceOf(_socket), name, params, nullptr, requestID, stream)) {
+        return; // Only the network thread may touch the buffers
+    }
 
-    write();
+    sendCall(requestID, name, params, stream == METHOD_STREAM ? invoker().stream(name) : stream);
 }
 
-void RealConnection::remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback)
+void RealConnection::remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID stream)
 {
+    if (handedOver(ioServiceOf(_socket), name, params, callback, 0, stream)) {
+        return; // The callback will run on the network thread too
+    }
+
     RequestID requestID = _nextRequestID++;
-    
-    _requestCallbacks.push_back(RequestCallbackPair{requestID, callback});
-    remoteExecute(name, params, requestID);
+
+    TimerWheel::Clock::time_point deadline = TimerWheel::Clock::time_point::max();
+    if (_timers && _timeouts.request.count()) {
+        deadline = TimerWheel::Clock::now() + _timeouts.request;
+        if (!_requestTimer.pending()) {
+            _timers->schedule(_requestTimer, _timeouts.request, std::bind(&RealConnection::handleRequestTimer, this));
+        }
+    }
+
+    if (_tracer) {
+        TimerWheel::Clock::time_point now = TimerWheel::Clock::now();
+        _requestCallbacks.push_back(RequestCallback{requestID, callback, deadline, name, now, now, Tracer::Duration::zero()});
+    } else {
+        _requestCallbacks.push_back(RequestCallback{requestID, callback, deadline, std::string{}, {}, {}, Tracer::Duration::zero()});
+    }
+    remoteExecute(name, params, requestID, stream);
 
     if (!_nextRequestID || _nextRequestID & REQUEST_ID_RECEIVED_BIT) {
         _nextRequestID = 1;
@@ -129,34 +444,304 @@ void RealConnection::remoteExecute(const std::string & name, const std::string &
 
 void RealConnection::write()
 {
+    if (!_connected && _replayLimit) {
+        // Nothing to send it down until the session is resumed; take it all in order, so it's kept for then
+        while (_queued || !_urgent.empty()) {
+            fill();
+            outgoing().consume(outgoing().size());
+        }
+        return;
+    }
+
+    _sent = true;
     if (!_writing) {
+        fill();
+        if (!outgoingSize()) {
+            return;
+        }
         _writing = true;
+        if (_cold && _cold->rate) {
+            _cold->rate->writeStarted(RateController::Clock::now());
+        }
 
-        boost::asio::async_write(_socket, _outgoing,
+        boost::asio::async_write(_socket, *_outgoing,
             std::bind(&RealConnection::handleWrite, getDerivedPointer(),
                 std::placeholders::_1,
                 std::placeholders::_2));
     }
 }
 
+template<typename Writer>
+void RealConnection::send(StreamID stream, bool numbered, const Writer & writer, const std::string & key)
+{
+    if (idle()) {
+        // Nothing to wait behind; straight into the buffer
+        size_t start = outgoing().size();
+        std::ostream outgoingStream{&outgoing()};
+        writer(outgoingStream);
+        recordSent(start, numbered);
+    } else {
+        // The buffer mustn't change while it's being written; wait for the next write
+        std::ostringstream frame;
+        writer(frame);
+        if (numbered) {
+            enqueue(stream, frame.str(), key);
+        } else {
+            _urgent.push_back(frame.str());
+        }
+    }
+    write();
+}
+
+boost::asio::streambuf & RealConnection::incoming()
+{
+    if (!_incoming) {
+        _incoming = takeBuffer();
+    }
+    return *_incoming;
+}
+
+boost::asio::streambuf & RealConnection::outgoing()
+{
+    if (!_outgoing) {
+        _outgoing = takeBuffer();
+    }
+    return *_outgoing;
+}
+
+size_t RealConnection::backlog() const
+{
+    size_t bytes = outgoingSize();
+    for (const std::string & frame: _urgent) {
+        bytes += frame.size();
+    }
+    if (_queued) {
+        for (const Stream & stream: _streams) {
+            for (size_t i = stream.next; i < stream.frames.size(); ++i) {
+                bytes += stream.frames[i].size();
+            }
+        }
+    }
+    return bytes;
+}
+
+RealConnection::Cold & RealConnection::cold()
+{
+    if (!_cold) {
+        _cold.reset(new Cold);
+    }
+    return *_cold;
+}
+
+void RealConnection::enqueue(StreamID stream, std::string && frame, const std::string & key)
+{
+    if (_streams.size() <= stream) {
+        _streams.resize(stream + 1, Stream{0, 1, _pass, {}, 0, {}});
+    }
+
+    Stream & queue = _streams[stream];
+    if (queue.empty()) {
+        queue.pass = std::max(queue.pass, _pass);
+    }
+
+    if (!key.empty()) {
+        auto found = queue.latest.find(key);
+        if (found != queue.latest.end() && found->second >= queue.next) {
+            // The last one is still waiting; send this in its place
+            queue.frames[found->second] = std::move(frame);
+            return;
+        }
+        if (found != queue.latest.end()) {
+            found->second = queue.frames.size();
+        } else {
+            queue.latest.emplace(key, queue.frames.size());
+        }
+    }
+    queue.frames.push_back(std::move(frame));
+    ++_queued;
+}
+
+void RealConnection::fill()
+{
+    for (const std::string & frame: _urgent) {
+        append(frame, false);
+    }
+    _urgent.clear();
+
+    while (_queued && outgoingSize() < BATCH_BYTES) {
+        // Highest priority first, then whichever has had least of its share
+        Stream * next = NULL;
+        for (Stream & stream: _streams) {
+            if (!stream.empty() && (!next || stream.priority > next->priority ||
+                    (stream.priority == next->priority && stream.pass < next->pass))) {
+                next = &stream;
+            }
+        }
+
+        _pass = next->pass;
+        std::string & frame = next->frames[next->next];
+        next->pass += (static_cast<uint64_t>(frame.size()) << 16) / next->weight;
+        append(frame, true);
+        std::string{}.swap(frame); // Sent; only its slot is left until the stream drains or is compacted
+        if (++next->next == next->frames.size()) {
+            next->frames.clear();
+            next->next = 0;
+            next->latest.clear();
+        } else {
+            next->compact();
+        }
+        --_queued;
+    }
+}
+
+void RealConnection::append(const std::string & frame, bool numbered)
+{
+    size_t start = outgoing().size();
+    std::ostream outgoingStream{&outgoing()};
+    outgoingStream.write(frame.data(), frame.size());
+    recordSent(start, numbered);
+}
+
+void RealConnection::sendCall(RequestID requestID, const std::string & name, const std::string & params, StreamID stream)
+{
+    // Only calls that will have to wait can be replaced, and only if nothing waits on their results
+    std::string key;
+    const RPCInvoker::Options * options = requestID || idle() ? NULL : invoker().options(name);
+    if (options && options->coalesce) {
+        key = name + Frame::PACKET_END + params.substr(0, options->keyBytes);
+    }
+
+    send(stream, true, [requestID, &name, &params](std::ostream & outgoingStream) {
+        Frame::writeCall(outgoingStream, requestID, name, params);
+    }, key);
+}
+
+void RealConnection::sendResult(RequestID requestID, const std::string & result, StreamID stream)
+{
+    try {
+        send(stream, true, [requestID, &result](std::ostream & outgoingStream) {
+            Frame::writeResult(outgoingStream, requestID, result);
+        });
+    } catch (const std::length_error & e) {
+        // Nobody up the stack could do anything about it; the caller's request times out instead
+        LOG_ERROR("Dropped result for ", uuid(), ": ", e.what());
+    }
+}
+
+void RealConnection::sendControl(Frame::Control control, const std::string & payload)
+{
+    send(0, false, [control, &payload](std::ostream & outgoingStream) {
+        Frame::writeControl(outgoingStream, control, payload);
+    });
+}
+
+void RealConnection::sendClock()
+{
+    sendControl(Frame::CLOCK, timeBytes(wallClock()));
+}
+
+void RealConnection::traced(RequestID requestID, const std::string & name, TimerWheel::Clock::time_point received,
+        TimerWheel::Clock::time_point started)
+{
+    TimerWheel::Clock::time_point now = TimerWheel::Clock::now();
+    _tracer->record(name, Tracer::Waiting, started - received);
+    _tracer->record(name, Tracer::Handling, now - started);
+
+    if (requestID) {
+        // Ahead of the result, so the caller can take our part out of its round trip
+        int64_t spent = std::chrono::duration_cast<std::chrono::nanoseconds>(now - received).count();
+        std::string payload(reinterpret_cast<const char *>(&requestID), sizeof(requestID));
+        payload.append(reinterpret_cast<const char *>(&spent), sizeof(spent));
+        sendControl(Frame::TRACE, payload);
+    }
+}
+
+void RealConnection::recordSent(size_t start, bool numbered)
+{
+    // The frame was just appended to the buffer
+    const char * frame = boost::asio::buffer_cast<const char *>(_outgoing->data()) + start;
+    size_t length = _outgoing->size() - start;
+
+    if (_capture) {
+        // Skip over its size prefix
+        _capture->record(Capture::Outbound, uuid(), frame + sizeof(CommandSize), length - sizeof(CommandSize));
+    }
+
+    if (!numbered) {
+        return;
+    }
+    ++_sentSequence;
+
+    if (_tracer) {
+        // Calls that want a result are still the latest few made
+        RequestID requestID;
+        std::memcpy(&requestID, frame + sizeof(CommandSize), sizeof(requestID));
+        for (auto iter = _requestCallbacks.rbegin(); requestID && !(requestID & REQUEST_ID_RECEIVED_BIT) &&
+                iter != _requestCallbacks.rend(); ++iter) {
+            if (iter->requestID == requestID) {
+                iter->sent = TimerWheel::Clock::now();
+                break;
+            }
+        }
+    }
+
+    if (_replayLimit) {
+        Cold & kept = cold();
+        kept.replay.emplace_back(frame, length);
+        kept.replayBytes += length;
+        while (kept.replayBytes > _replayLimit) {
+            kept.replayBytes -= kept.replay.front().size();
+            kept.replay.pop_front();
+        }
+    }
+}
+
+void RealConnection::countReceived()
+{
+    // Until we know whether the session was resumed, we don't know which count these belong to
+    if (_resuming) {
+        ++_pendingReceived;
+    } else {
+        ++_receivedSequence;
+    }
+}
+
+void RealConnection::handleReadable(const boost::system::error_code & error)
+{
+    if (error && (!_connected || error == boost::asio::error::operation_aborted)) {
+        return; // We hung up ourselves
+    }
+    if (error) {
+        _lastErrorCode = error;
+        disconnect();
+        return;
+    }
+
+    readHeader(0);
+}
+
 void RealConnection::handleReadCommandHeader(const boost::system::error_code & error, size_t size)
 {
+    if (error && (!_connected || error == boost::asio::error::operation_aborted)) {
+        return; // We hung up ourselves
+    }
     if (error) {
         _lastErrorCode = error;
         disconnect();
         return;
     }
 
-    std::istream inputStream(&_incoming);
+    // What was already buffered before the read isn't in the count it gives
+    size = _incoming->size();
 
-    CommandSize commandSize;
-    inputStream.read(reinterpret_cast<char *>(&commandSize), sizeof(commandSize));
+    CommandSize commandSize = Frame::readSize(boost::asio::buffer_cast<const char *>(_incoming->data()));
+    _incoming->consume(sizeof(commandSize));
     size -= sizeof(commandSize);
 
     if (size >= commandSize) {
         handleReadCommand(error, size, commandSize);
     } else {
-        boost::asio::async_read(_socket, _incoming, boost::asio::transfer_at_least(commandSize - size),
+        boost::asio::async_read(_socket, *_incoming, boost::asio::transfer_at_least(commandSize - size),
             std::bind(&RealConnection::handleReadCommand, getDerivedPointer(),
                 std::placeholders::_1,
                 std::placeholders::_2,
@@ -166,53 +751,125 @@ void RealConnection::handleReadCommandHeader(const boost::system::error_code & e
 
 void RealConnection::handleReadCommand(const boost::system::error_code & error, size_t size, CommandSize commandSize)
 {
+    if (error && (!_connected || error == boost::asio::error::operation_aborted)) {
+        return; // We hung up ourselves
+    }
     if (error) {
         _lastErrorCode = error;
         disconnect();
         return;
     }
 
-    std::istream inputStream(&_incoming);
+    _received = true;
+    size = _incoming->size();
 
-    RequestID requestID;
-    inputStream.read(reinterpret_cast<char *>(&requestID), sizeof(requestID));
+    // The whole frame is in the buffer; read it where it is, and let handlers do the same
+    const char * frame = boost::asio::buffer_cast<const char *>(_incoming->data());
 
-    if (requestID & REQUEST_ID_RECEIVED_BIT) {
+    if (_capture) {
+        _capture->record(Capture::Inbound, uuid(), frame, commandSize);
+    }
+
+    if (_cold && _cold->frameHandler && _cold->frameHandler(frame, commandSize)) {
+        // Dealt with elsewhere
+    } else {
+        handleFrame(frame, commandSize);
+    }
+
+    _incoming->consume(commandSize);
+    readNext(size - commandSize);
+}
+
+void RealConnection::handleFrame(const char * frame, size_t length)
+{
+    if (length < sizeof(RequestID)) {
+        LOG_WARNING("Frame too short from ", uuid());
+        return;
+    }
+    TimerWheel::Clock::time_point received = _tracer ? TimerWheel::Clock::now() : TimerWheel::Clock::time_point{};
+
+    if (!Frame::isControl(frame, length)) {
+        countReceived();
+    }
+
+    Frame::Parts parts;
+    if (!Frame::decode(frame, length, parts)) {
+        LOG_WARNING("Call without a method name from ", uuid());
+        return;
+    }
+
+    RequestID requestID = parts.requestID;
+    if (parts.result) {
         // Process result
-        requestID &= ~REQUEST_ID_RECEIVED_BIT;
-        auto iter = _requestCallbacks.begin();
-        while (iter != _requestCallbacks.end()) {
-            if (iter->first == requestID) {
-                iter->second(inputStream);
+        for (auto iter = _requestCallbacks.begin(); iter != _requestCallbacks.end(); ++iter) {
+            if (iter->requestID == requestID) {
+                if (_tracer && !iter->name.empty()) {
+                    _tracer->record(iter->name, Tracer::Sending, iter->sent - iter->called);
+                    _tracer->record(iter->name, Tracer::RoundTrip, received - iter->called);
+                    if (iter->remote.count()) {
+                        _tracer->record(iter->name, Tracer::Network, received - iter->sent - iter->remote);
+                    }
+                }
+                RemoteExecuteCallback callback = iter->callback;
                 _requestCallbacks.erase(iter);
+                callback(parts.payload, parts.payloadLength);
                 break;
             }
         }
     } else {
-        std::string name;
-        std::getline(inputStream, name, PACKET_END);
+        std::string name(parts.name, parts.nameLength);
+        const char * params = parts.payload;
+        size_t paramsLength = parts.payloadLength;
 
-        std::stringstream result;
-        if (invoker().invoke(name, inputStream, result, shared_from_this()) && requestID) {
-            // Send result
-            std::ostream outgoingStream{&_outgoing};
-            CommandSize outgoingSize{sizeof(RequestID) + result.str().length()};
-            outgoingStream.write(reinterpret_cast<char *>(&outgoingSize), sizeof(outgoingSize));
-            requestID |= REQUEST_ID_RECEIVED_BIT;
-            outgoingStream.write(reinterpret_cast<char *>(&requestID), sizeof(requestID));
-            outgoingStream << result.str();
-            write();
+        if (name.empty()) {
+            handleControl(params, paramsLength);
+        } else if (_scheduler || offloaded(name)) {
+            // Take the parameters out of the buffer so the call can run later
+            std::string queued(params, paramsLength);
+
+            if (!_scheduler) {
+                dispatchQueued(requestID, name, queued, received);
+            } else if (!_scheduler->submit(uuid(), name,
+                    std::bind(&RealConnection::dispatchQueued, getDerivedPointer(), requestID, name, queued, received),
+                    std::bind(&RealConnection::resumeReading, getDerivedPointer()))) {
+                _readPaused = true;
+            }
+        } else {
+            dispatch(requestID, name, params, paramsLength, received);
         }
     }
+}
+
+void RealConnection::readNext(size_t size)
+{
+    if (!_connected) {
+        return;
+    }
 
+    if (_readPaused) {
+        _pausedSize = size;
+    } else if (_readDepth < MAX_READ_DEPTH) {
+        ++_readDepth;
+        read(size);
+        --_readDepth;
+    } else {
+        // Frames already buffered are handled by recursing; don't let a long backlog overflow the stack
+        ioServiceOf(_socket).post(std::bind(&RealConnection::continueReading, getDerivedPointer(), size));
+    }
+}
+
+void RealConnection::continueReading(size_t size)
+{
     if (_connected) {
-        size -= commandSize;
         read(size);
     }
 }
 
-void RealConnection::handleWrite(const boost::system::error_code & error, size_t)
+void RealConnection::handleWrite(const boost::system::error_code & error, size_t written)
 {
+    if (error && (!_connected || error == boost::asio::error::operation_aborted)) {
+        return; // We hung up ourselves
+    }
     if (error) {
         _lastErrorCode = error;
         disconnect();
@@ -220,8 +877,414 @@ void RealConnection::handleWrite(const boost::system::error_code & error, size_t
     }
     
     _writing = false;
-    if (_outgoing.size()) {
+    if (_cold && _cold->rate) {
+        _cold->rate->writeFinished(written, RateController::Clock::now());
+    }
+    if (outgoingSize() || _queued || !_urgent.empty()) {
         write();
+    } else if (_lowFootprint) {
+        giveBuffer(_outgoing);
+    }
+}
+
+void RealConnection::dispatch(RequestID requestID, const std::string & name, const char * params, size_t length,
+        TimerWheel::Clock::time_point received)
+{
+    TimerWheel::Clock::time_point started = _tracer ? TimerWheel::Clock::now() : TimerWheel::Clock::time_point{};
+    std::stringstream result;
+    Deferred::Pointer deferred;
+    try {
+        if (!invoker().invoke(name, params, length, result, shared_from_this(), &deferred)) {
+            return;
+        }
+    } catch (const std::exception & e) {
+        // Arguments that don't decode are the client's problem, not every other client's
+        LOG_WARNING("Dropped call to ", name, " from ", uuid(), ": ", e.what());
+        return;
+    }
+
+    if (requestID && deferred) {
+        defer(requestID, name, deferred, received, started);
+        return;
+    }
+    if (_tracer) {
+        traced(requestID, name, received, started);
+    }
+    if (requestID && invoker().answers(name)) {
+        sendResult(requestID, result.str(), invoker().stream(name));
+    }
+}
+
+void RealConnection::dispatchQueued(RequestID requestID, const std::string & name, const std::string & params,
+        TimerWheel::Clock::time_point received)
+{
+    if (offloaded(name)) {
+        offload(requestID, name, params, invoker().options(name)->ordered, received);
+        return;
+    }
+
+    dispatch(requestID, name, params.data(), params.length(), received);
+}
+
+void RealConnection::defer(RequestID requestID, const std::string & name, const Deferred::Pointer & deferred,
+        TimerWheel::Clock::time_point received, TimerWheel::Clock::time_point started)
+{
+    SessionLink link = sessionLink();
+    IOService * ioService = &ioServiceOf(_socket);
+    StreamID stream = invoker().stream(name);
+    std::string traceName{_tracer ? name : std::string{}};
+    deferred->attach([link, ioService, requestID, stream, traceName, received, started](const std::string & result) {
+        // Whichever thread it turned up on, send it from the network thread, on whichever connection the session is on
+        ioService->post([link, requestID, stream, traceName, received, started, result] {
+            std::shared_ptr<RealConnection> self = link->lock();
+            if (self && self->_connected) {
+                if (self->_tracer && !traceName.empty()) {
+                    self->traced(requestID, traceName, received, started);
+                }
+                self->sendResult(requestID, result, stream);
+            }
+        });
+    });
+
+    if (_timers && _timeouts.response.count() && deferred->pending()) {
+        cold().responses.push_back(PendingResponse{deferred, TimerWheel::Clock::now() + _timeouts.response});
+        if (!_responseTimer.pending()) {
+            _timers->schedule(_responseTimer, _timeouts.response, std::bind(&RealConnection::handleResponseTimer, this));
+        }
+    }
+}
+
+void RealConnection::resumeReading()
+{
+    if (_readPaused && _connected && (!_cold || _cold->parked.empty())) {
+        _readPaused = false;
+        read(_pausedSize);
+    }
+}
+
+bool RealConnection::offloaded(const std::string & name) const
+{
+    if (!_workers) {
+        return false;
+    }
+
+    const RPCInvoker::Options * options = invoker().options(name);
+    return options && options->offload;
+}
+
+void RealConnection::offload(RequestID requestID, const std::string & name, const std::string & params, bool ordered,
+        TimerWheel::Clock::time_point received)
+{
+    WorkerPool::Job job = std::bind(&RealConnection::runOffloaded, getDerivedPointer(), requestID, name, params, ordered, received);
+
+    if (!ordered) {
+        submitOffloaded(job);
+    } else if (_offloadRunning) {
+        cold().offloaded.push_back(job);
+    } else {
+        _offloadRunning = true;
+        submitOffloaded(job);
+    }
+}
+
+void RealConnection::submitOffloaded(const WorkerPool::Job & job)
+{
+    WorkerPool::Job submitted{job};
+    if ((_cold && !_cold->parked.empty()) || !trySubmit(submitted)) {
+        // The workers are behind; stop reading from the client until they catch up rather than block the network thread
+        cold().parked.push_back(submitted);
+        _readPaused = true;
+    }
+}
+
+bool RealConnection::trySubmit(WorkerPool::Job & job)
+{
+    std::shared_ptr<RealConnection> self = getDerivedPointer();
+    return _workers->submit(job, [self] {
+        ioServiceOf(self->_socket).post(std::bind(&RealConnection::resumeOffloading, self));
+    });
+}
+
+void RealConnection::resumeOffloading()
+{
+    std::deque<WorkerPool::Job> & parked = cold().parked;
+    if (parked.empty()) {
+        return; // Room we didn't need after all; reading may be paused by the scheduler instead
+    }
+
+    while (!parked.empty()) {
+        if (!trySubmit(parked.front())) {
+            return;
+        }
+        parked.pop_front();
+    }
+
+    resumeReading();
+}
+
+void RealConnection::runOffloaded(RequestID requestID, const std::string & name, const std::string & params, bool ordered,
+        TimerWheel::Clock::time_point received)
+{
+    // On a worker thread
+    TimerWheel::Clock::time_point started = TimerWheel::Clock::now();
+    std::stringstream result;
+    Deferred::Pointer deferred;
+    bool answered = false;
+    try {
+        answered = invoker().invoke(name, params.data(), params.length(), result, shared_from_this(), &deferred) && requestID
+            && invoker().answers(name);
+    } catch (const std::exception & e) {
+        LOG_ERROR("Exception in offloaded call ", name, ": ", e.what());
+    }
+
+    ioServiceOf(_socket).post(std::bind(&RealConnection::completeOffloaded, getDerivedPointer(),
+        requestID, name, answered ? result.str() : std::string{}, answered, ordered, deferred, received, started));
+}
+
+void RealConnection::completeOffloaded(RequestID requestID, const std::string & name, const std::string & result, bool answered, bool ordered,
+        const Deferred::Pointer & deferred, TimerWheel::Clock::time_point received, TimerWheel::Clock::time_point started)
+{
+    // Back on the network thread
+    if (ordered) {
+        if (!_cold || _cold->offloaded.empty()) {
+            _offloadRunning = false;
+        } else {
+            submitOffloaded(_cold->offloaded.front());
+            _cold->offloaded.pop_front();
+        }
+    }
+
+    std::shared_ptr<RealConnection> session = answered ? sessionConnection() : nullptr;
+    if (answered && deferred) {
+        defer(requestID, name, deferred, received, started);
+    } else if (answered && session->_connected) {
+        if (session->_tracer) {
+            session->traced(requestID, name, received, started);
+        }
+        session->sendResult(requestID, result, invoker().stream(name));
+    }
+}
+
+RealConnection::SessionLink RealConnection::sessionLink()
+{
+    Cold & kept = cold();
+    if (!kept.session) {
+        kept.session = std::make_shared<std::weak_ptr<RealConnection>>(getDerivedPointer());
+    }
+    return kept.session;
+}
+
+std::shared_ptr<RealConnection> RealConnection::sessionConnection()
+{
+    std::shared_ptr<RealConnection> current;
+    if (_cold && _cold->session) {
+        current = _cold->session->lock();
+    }
+    return current ? current : getDerivedPointer();
+}
+
+void RealConnection::handleControl(const char * payload, size_t length)
+{
+    if (!length) {
+        LOG_WARNING("Empty control frame");
+        return;
+    }
+    Frame::Control control = static_cast<Frame::Control>(payload[0]);
+
+    // Sessions are the server's to hand out; the rest only go one way or the other too
+    bool fromServer = control == Frame::SESSION || control == Frame::RESUMED || control == Frame::RESUME_FAILED;
+    if ((fromServer && type() != Outgoing) || (control == Frame::RESUME && type() != Incoming)) {
+        LOG_WARNING("Control frame ", static_cast<int>(control), " sent the wrong way");
+        return;
+    }
+
+    switch (control) {
+        case Frame::HEARTBEAT:
+            break; // Only there to be received
+        case Frame::SESSION:
+            if (length < 1 + sizeof(boost::uuids::uuid) + Frame::SECRET_BYTES) {
+                LOG_WARNING("Session frame too short");
+            } else if (!_resuming) {
+                uuid(readSession(payload + 1));
+                _secret.assign(payload + 1 + sizeof(boost::uuids::uuid), Frame::SECRET_BYTES);
+            }
+            break;
+        case Frame::RESUME:
+            if (length < 1 + sizeof(boost::uuids::uuid) + Frame::SECRET_BYTES + sizeof(Sequence)) {
+                LOG_WARNING("Resume frame too short from ", uuid());
+            } else {
+                const char * secret = payload + 1 + sizeof(boost::uuids::uuid);
+                Sequence received;
+                std::memcpy(&received, secret + Frame::SECRET_BYTES, sizeof(received));
+                if (!_cold || !_cold->resumeHandler || !_cold->resumeHandler(readSession(payload + 1), secret, received)) {
+                    // Carry on with this as a new session
+                    sendControl(Frame::RESUME_FAILED, sessionBytes(uuid()) + _secret);
+                }
+            }
+            break;
+        case Frame::RESUMED:
+            // The frames missed follow, and carry on the count from before
+            _resuming = false;
+            _pendingReceived = 0;
+            if (_cold && _cold->sessionHandler) {
+                _cold->sessionHandler(true);
+            }
+            break;
+        case Frame::RESUME_FAILED:
+            if (length < 1 + sizeof(boost::uuids::uuid) + Frame::SECRET_BYTES) {
+                LOG_WARNING("Resume failed frame too short");
+                break;
+            }
+            // Start over, counting from what the server has sent on the new connection
+            _resuming = false;
+            uuid(readSession(payload + 1));
+            _secret.assign(payload + 1 + sizeof(boost::uuids::uuid), Frame::SECRET_BYTES);
+            _receivedSequence = _pendingReceived;
+            _pendingReceived = 0;
+            if (_cold && _cold->sessionHandler) {
+                _cold->sessionHandler(false);
+            }
+            break;
+        case Frame::CLOCK:
+            if (length < 1 + sizeof(Frame::Time)) {
+                LOG_WARNING("Clock frame too short from ", uuid());
+            } else {
+                // Answered whether or not we trace, so a peer that does can keep track of us
+                Frame::Time arrived = wallClock();
+                sendControl(Frame::CLOCK_REPLY, std::string(payload + 1, sizeof(Frame::Time)) + timeBytes(arrived) + timeBytes(wallClock()));
+            }
+            break;
+        case Frame::CLOCK_REPLY:
+            handleClockReply(payload + 1, length - 1);
+            break;
+        case Frame::TRACE:
+            if (length < 1 + sizeof(RequestID) + sizeof(int64_t)) {
+                LOG_WARNING("Trace frame too short from ", uuid());
+            } else if (_tracer) {
+                RequestID requestID;
+                int64_t spent;
+                std::memcpy(&requestID, payload + 1, sizeof(requestID));
+                std::memcpy(&spent, payload + 1 + sizeof(requestID), sizeof(spent));
+                for (RequestCallback & request: _requestCallbacks) {
+                    if (request.requestID == requestID) {
+                        request.remote = std::chrono::duration_cast<Tracer::Duration>(std::chrono::nanoseconds(spent));
+                        break;
+                    }
+                }
+            }
+            break;
+        default:
+            LOG_WARNING("Unknown control frame ", static_cast<int>(control));
+    }
+}
+
+void RealConnection::handleClockReply(const char * payload, size_t length)
+{
+    if (length < 3 * sizeof(Frame::Time)) {
+        LOG_WARNING("Clock reply too short from ", uuid());
+        return;
+    }
+    if (!_tracer && !(_cold && _cold->rate)) {
+        return;
+    }
+
+    // Our clock when we asked, theirs when it arrived and when they replied, and ours now
+    Frame::Time asked = readTime(payload);
+    Frame::Time arrived = readTime(payload + sizeof(Frame::Time));
+    Frame::Time replied = readTime(payload + 2 * sizeof(Frame::Time));
+    Frame::Time now = wallClock();
+
+    Tracer::Duration rtt = std::chrono::duration_cast<Tracer::Duration>(std::chrono::nanoseconds((now - asked) - (replied - arrived)));
+    Tracer::Duration offset = std::chrono::duration_cast<Tracer::Duration>(std::chrono::nanoseconds(((arrived - asked) + (replied - now)) / 2));
+
+    if (_rtt == Tracer::Duration::zero()) {
+        _rtt = rtt;
+        _clockOffset = offset;
+    } else {
+        // Smooth out the jitter, a little of each new estimate at a time
+        _rtt += (rtt - _rtt) / 8;
+        _clockOffset += (offset - _clockOffset) / 8;
+    }
+
+    if (_tracer) {
+        _tracer->clock(uuid(), _rtt, _clockOffset);
+    }
+    if (_cold && _cold->rate) {
+        _cold->rate->rtt(_rtt);
+    }
+}
+
+void RealConnection::handleHeartbeatTimer()
+{
+    if (_tracer || (_cold && _cold->rate)) {
+        sendClock(); // Does for a heartbeat too
+    } else if (!_sent) {
+        sendControl(Frame::HEARTBEAT);
+    }
+    _sent = false;
+
+    _timers->schedule(_heartbeatTimer, _timeouts.heartbeat, std::bind(&RealConnection::handleHeartbeatTimer, this));
+}
+
+void RealConnection::handleIdleTimer()
+{
+    if (!_received) {
+        LOG_NOTICE("Nothing heard from ", uuid(), "; disconnecting");
+        disconnect();
+        return;
+    }
+    _received = false;
+
+    _timers->schedule(_idleTimer, _timeouts.idle, std::bind(&RealConnection::handleIdleTimer, this));
+}
+
+void RealConnection::handleRequestTimer()
+{
+    TimerWheel::Clock::time_point now = TimerWheel::Clock::now();
+
+    // Deadlines needn't be in order (requests can be carried over from a resumed session), so check them all
+    auto expired = std::remove_if(_requestCallbacks.begin(), _requestCallbacks.end(), [now](const RequestCallback & request) {
+        if (request.deadline > now) {
+            return false;
+        }
+        LOG_WARNING("Request ", request.requestID, " timed out");
+        return true;
+    });
+    _requestCallbacks.erase(expired, _requestCallbacks.end());
+
+    scheduleRequestTimer(now);
+}
+
+void RealConnection::scheduleRequestTimer(TimerWheel::Clock::time_point now)
+{
+    TimerWheel::Clock::time_point earliest = TimerWheel::Clock::time_point::max();
+    for (const RequestCallback & request: _requestCallbacks) {
+        earliest = std::min(earliest, request.deadline);
+    }
+
+    if (earliest != TimerWheel::Clock::time_point::max()) {
+        _timers->schedule(_requestTimer, earliest - now, std::bind(&RealConnection::handleRequestTimer, this));
+    } else {
+        _requestTimer.cancel();
+    }
+}
+
+void RealConnection::handleResponseTimer()
+{
+    TimerWheel::Clock::time_point now = TimerWheel::Clock::now();
+
+    // Deadlines are in the order the calls came in; answered ones are dropped as they reach the front
+    std::deque<PendingResponse> & responses = cold().responses;
+    while (!responses.empty() && (!responses.front().deferred->pending() || responses.front().deadline <= now)) {
+        if (responses.front().deferred->pending()) {
+            LOG_WARNING("Gave up on a deferred result for ", uuid());
+            responses.front().deferred->abandon();
+        }
+        responses.pop_front();
+    }
+
+    if (!responses.empty()) {
+        _timers->schedule(_responseTimer, responses.front().deadline - now, std::bind(&RealConnection::handleResponseTimer, this));
     }
 }
 
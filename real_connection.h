@@ -28,16 +28,33 @@ or implied, of Christopher Allen Ogden.
 #pragma once
 
 #include <deque>
+#include <limits>
+#include <unordered_map>
+#include <vector>
 #include <boost/asio.hpp>
 
 #include "io_service.h"
 #include "connection.h"
+#include "inbound_scheduler.h"
+#include "worker_pool.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "tracer.h"
+#include "rate_controller.h"
 
 namespace SydNet {
 
 class RealConnection: public Connection
 {
     public:
+        struct Timeouts
+        {
+            TimerWheel::Clock::duration heartbeat; // Send a heartbeat after sending nothing for this long
+            TimerWheel::Clock::duration idle; // Disconnect after hearing nothing for between one and two of these
+            TimerWheel::Clock::duration request; // Give up waiting for a result after this long
+            TimerWheel::Clock::duration response; // Give up on a result a method answers later after this long
+        };
+
         /**
          * Get the socket used by this connection.
          *
@@ -52,6 +69,214 @@ class RealConnection: public Connection
 
         virtual ConnectionMap & peers();
 
+        /**
+         * Set the scheduler received calls are queued on instead of being run as they arrive.
+         *
+         * @param scheduler Scheduler to use, or NULL to run calls immediately
+         */
+        void scheduler(InboundScheduler * scheduler)
+        {
+            _scheduler = scheduler;
+        }
+
+        /**
+         * Set the worker pool offloadable calls run on.
+         *
+         * @param workers   Worker pool to use, or NULL to run every call on the network thread
+         */
+        void workers(WorkerPool * workers)
+        {
+            _workers = workers;
+        }
+
+        /**
+         * Supervise the connection with heartbeats and timeouts.
+         *
+         * @param timers    Timer wheel to drive the timeouts from, kept for as long as the connection
+         * @param timeouts  Timeouts to use; any left at zero are turned off
+         */
+        void timeouts(const TimerWheel::Pointer & timers, const Timeouts & timeouts);
+
+        /**
+         * Give the buffers back whenever the connection is idle, so an idle connection costs as little as can be.
+         *
+         * An idle connection then holds no buffers or queues, taking about 900 bytes of heap on top of what its
+         * socket takes (most of it the connection object), against about 1.4 KB otherwise; bench measures it.
+         * Each frame received after a lull costs an extra wait for the socket to be readable.
+         *
+         * @param lowFootprint  True to give the buffers back when idle
+         */
+        void lowFootprint(bool lowFootprint)
+        {
+            _lowFootprint = lowFootprint;
+        }
+
+        /**
+         * Record every frame sent or received.
+         *
+         * @param capture   Capture to record to, or NULL to stop recording
+         */
+        void capture(Capture * capture)
+        {
+            _capture = capture;
+        }
+
+        /**
+         * Time the calls going through the connection, and keep estimating the round trip time and the peer's clock.
+         * The clock is checked once straight away and then at each heartbeat, if the timeouts have one.
+         *
+         * @param tracer    Tracer to record to, or NULL to stop tracing
+         */
+        void tracing(Tracer * tracer);
+
+        /**
+         * Get the round trip time, as last estimated while tracing.
+         *
+         * @return  Round trip time, less the time the peer took to answer
+         */
+        Tracer::Duration rtt() const
+        {
+            return _rtt;
+        }
+
+        /**
+         * Adapt how often the client is sent state updates, and how big they are, to how well its link copes
+         * (see RateController). Its round trip time is checked at each heartbeat, if the timeouts have one.
+         *
+         * @param settings  Fastest and slowest updates and their budgets
+         * @throw std::invalid_argument if the settings don't make sense (see RateController::RateController)
+         */
+        void rateControl(const RateController::Settings & settings);
+
+        /**
+         * Check whether the client is due a state update; once this says yes, the update is taken as sent.
+         * Always due without rate control.
+         *
+         * @return  True if an update should be sent now
+         */
+        bool updateDue();
+
+        /**
+         * Get how many bytes the next state update should fit in.
+         *
+         * @return  Budget in bytes; unlimited without rate control
+         */
+        size_t updateBudget() const
+        {
+            return _cold && _cold->rate ? _cold->rate->budget() : std::numeric_limits<size_t>::max();
+        }
+
+        /**
+         * Get how far the peer's clock is ahead of ours, as last estimated while tracing.
+         *
+         * @return  Clock offset
+         */
+        Tracer::Duration clockOffset() const
+        {
+            return _clockOffset;
+        }
+
+        /**
+         * Send an already encoded frame as it is.
+         *
+         * @param frame     The frame, without its size prefix
+         * @param length    Length of the frame
+         * @param stream    Stream to send it on
+         */
+        void sendFrame(const char * frame, size_t length, StreamID stream = 0);
+
+        typedef std::function<bool(const char * frame, size_t length)> FrameHandler;
+
+        /**
+         * Look at each frame before it's handled.
+         *
+         * @param handler   Called with each frame received (without its size prefix);
+         *                  returns true if it dealt with the frame and it should go no further
+         */
+        void frameHandler(const FrameHandler & handler)
+        {
+            cold().frameHandler = handler;
+        }
+
+        /**
+         * Set how a stream's frames are sent against the others'.
+         * Streams nobody has set up have priority 0 and weight 1.
+         *
+         * @param stream    Stream to set up
+         * @param priority  Frames on streams with a higher priority always go first
+         * @param weight    Share of what's sent, against other streams with the same priority
+         */
+        void stream(StreamID stream, unsigned priority, unsigned weight = 1);
+
+        typedef Frame::Sequence Sequence;
+
+        /**
+         * Keep recently sent frames so a client that drops off can resume the session and be sent what it missed.
+         *
+         * @param bytes     Most bytes of frames to keep
+         */
+        void resumable(size_t bytes)
+        {
+            _replayLimit = bytes;
+        }
+
+        /**
+         * Tell the client which session it can resume if it drops off, along with a new secret it'll need to.
+         */
+        void announceSession();
+
+        typedef std::function<bool(const boost::uuids::uuid & session, const char * secret, Sequence received)> ResumeHandler;
+
+        /**
+         * Set what happens when the client asks to resume a session.
+         *
+         * @param handler   Called with the session, the secret the client gave for it (Frame::SECRET_BYTES long)
+         *                  and how many frames the client got; returns false if the session couldn't be resumed
+         */
+        void resumeHandler(const ResumeHandler & handler)
+        {
+            cold().resumeHandler = handler;
+        }
+
+        /**
+         * Check a secret against the one this connection's session was announced with, taking as long whatever it is.
+         *
+         * @param secret    Secret to check (Frame::SECRET_BYTES long)
+         * @return          True if the session was announced and the secret is its own
+         */
+        bool secretMatches(const char * secret) const;
+
+        /**
+         * Take over a session from the connection it was on, sending the client whatever it missed.
+         *
+         * @param from      Connection the session was on
+         * @param received  Frames the client got on it
+         * @return          False if some of what it missed is no longer kept
+         */
+        bool resume(RealConnection & from, Sequence received);
+
+        typedef std::function<void(bool resumed)> SessionHandler;
+
+        /**
+         * Be told how asking to resume the session went.
+         *
+         * @param handler   Called with true if the session was resumed, or false if it's a new one
+         */
+        void sessionHandler(const SessionHandler & handler)
+        {
+            cold().sessionHandler = handler;
+        }
+
+        /**
+         * Check whether the connection is up.
+         *
+         * @return  True if connected
+         */
+        bool connected() const
+        {
+            return _connected;
+        }
+
         virtual ~RealConnection() {}
 
         RealConnection & operator=(const RealConnection &) = delete;
@@ -66,6 +291,12 @@ class RealConnection: public Connection
 
         void read(size_t size=0);
 
+        void readHeader(size_t size);
+
+        void reopen();
+
+        void requestResume();
+
         boost::system::error_code lastErrorCode() const
         {
             return _lastErrorCode;
@@ -77,38 +308,264 @@ class RealConnection: public Connection
         }
 
     private:
-        typedef uint16_t CommandSize;
+        typedef Frame::Size CommandSize;
 
-        void remoteExecute(const std::string & name, const std::string & params, RequestID=0);
-        void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback);
+        void remoteExecute(const std::string & name, const std::string & params, RequestID, StreamID);
+        void remoteExecute(const std::string & name, const std::string & params, RemoteExecuteCallback callback, StreamID);
 
         std::shared_ptr<RealConnection> getDerivedPointer()
         {
             return std::static_pointer_cast<RealConnection>(shared_from_this());
         }
 
+        // Where a session is now; shared by whatever has results still to send it, and moved along when it's resumed
+        typedef std::shared_ptr<std::weak_ptr<RealConnection>> SessionLink;
+
+        SessionLink sessionLink();
+
+        /**
+         * Find the connection the session is on now, so results worked out for it after it moved still get there.
+         *
+         * @return  This connection, or the one the session was resumed on
+         */
+        std::shared_ptr<RealConnection> sessionConnection();
+
         void write();
 
+        boost::asio::streambuf & incoming();
+
+        boost::asio::streambuf & outgoing();
+
+        size_t outgoingSize() const
+        {
+            return _outgoing ? _outgoing->size() : 0;
+        }
+
+        struct Cold;
+
+        Cold & cold();
+
+        bool idle() const
+        {
+            return !_writing && !_queued && _urgent.empty();
+        }
+
+        size_t backlog() const;
+
+        template<typename Writer>
+        void send(StreamID stream, bool numbered, const Writer & writer, const std::string & key = std::string{});
+
+        void enqueue(StreamID stream, std::string && frame, const std::string & key = std::string{});
+
+        void fill();
+
+        void append(const std::string & frame, bool numbered);
+
+        void sendCall(RequestID requestID, const std::string & name, const std::string & params, StreamID stream);
+
+        void sendResult(RequestID requestID, const std::string & result, StreamID stream);
+
+        void sendControl(Frame::Control control, const std::string & payload = "");
+
+        void sendClock();
+
+        void traced(RequestID requestID, const std::string & name, TimerWheel::Clock::time_point received,
+                TimerWheel::Clock::time_point started);
+
+        void recordSent(size_t start, bool numbered);
+
+        void countReceived();
+
+        void handleReadable(const boost::system::error_code & error);
+
         void handleReadCommandHeader(const boost::system::error_code & error, size_t size);
 
         void handleReadCommand(const boost::system::error_code & error, size_t size, CommandSize commandSize);
 
-        void handleWrite(const boost::system::error_code & error, size_t);
+        void handleWrite(const boost::system::error_code & error, size_t written);
 
-        boost::asio::streambuf _incoming; // For incoming data; must stay valid while reading
-        boost::asio::streambuf _outgoing; // For outgoing data; must stay valid while writing
-        bool _writing; // True if it's already sending data
+        void handleFrame(const char * frame, size_t length);
+
+        void dispatch(RequestID requestID, const std::string & name, const char * params, size_t length,
+                TimerWheel::Clock::time_point received);
+
+        void dispatchQueued(RequestID requestID, const std::string & name, const std::string & params,
+                TimerWheel::Clock::time_point received);
+
+        void defer(RequestID requestID, const std::string & name, const Deferred::Pointer & deferred,
+                TimerWheel::Clock::time_point received, TimerWheel::Clock::time_point started);
+
+        void resumeReading();
+
+        void readNext(size_t size);
+
+        void continueReading(size_t size);
+
+        bool offloaded(const std::string & name) const;
+
+        void offload(RequestID requestID, const std::string & name, const std::string & params, bool ordered,
+                TimerWheel::Clock::time_point received);
+
+        void submitOffloaded(const WorkerPool::Job & job);
+
+        bool trySubmit(WorkerPool::Job & job);
+
+        void resumeOffloading();
+
+        void runOffloaded(RequestID requestID, const std::string & name, const std::string & params, bool ordered,
+                TimerWheel::Clock::time_point received);
+
+        void completeOffloaded(RequestID requestID, const std::string & name, const std::string & result, bool answered, bool ordered,
+                const Deferred::Pointer & deferred, TimerWheel::Clock::time_point received, TimerWheel::Clock::time_point started);
+
+        void handleControl(const char * payload, size_t length);
+
+        void handleClockReply(const char * payload, size_t length);
+
+        void handleHeartbeatTimer();
+
+        void handleIdleTimer();
+
+        void handleRequestTimer();
+
+        void scheduleRequestTimer(TimerWheel::Clock::time_point now);
+
+        void handleResponseTimer();
+
+        // What every frame touches comes first
+
+        std::unique_ptr<boost::asio::streambuf> _incoming; // For incoming data, taken from a pool; must stay valid while reading
+        std::unique_ptr<boost::asio::streambuf> _outgoing; // For outgoing data, taken from a pool; must stay valid while writing
         boost::asio::ip::tcp::socket _socket;
+        bool _writing; // True if it's already sending data
         bool _connected;
+        bool _lowFootprint; // Give the buffers back whenever idle
+        bool _sent; // Sent anything since the last heartbeat check
+        bool _received; // Received anything since the last idle check
+        bool _readPaused; // True while the scheduler or the workers have too many of our calls queued
+        bool _offloadRunning; // True while an ordered call is on a worker
+        bool _resuming;
+        unsigned _readDepth; // Buffered frames being handled further up the stack
+        static const unsigned MAX_READ_DEPTH = 32;
+        size_t _pausedSize; // Bytes already read when reading was paused
+
+        // Frames wait on their streams while a write is under way, and the next write takes them in priority order
+        struct Stream
+        {
+            unsigned priority;
+            unsigned weight;
+            uint64_t pass; // Grows with what's sent, more slowly the higher the weight; the lowest goes next
+            std::vector<std::string> frames; // With their size prefixes; a vector, as an empty one costs nothing
+            size_t next; // Index of the next frame to send
+            std::unordered_map<std::string, size_t> latest; // Where the last call with each coalescing key went, if not yet forgotten
+
+            bool empty() const
+            {
+                return next == frames.size();
+            }
+
+            // Drop the frames already sent once they're most of the vector, so a stream that never quite drains
+            // doesn't keep them all; moving what's left is paid for by what was sent
+            void compact()
+            {
+                if (next < COMPACT_FRAMES || next < frames.size() - next) {
+                    return;
+                }
+                frames.erase(frames.begin(), frames.begin() + next);
+
+                // Keys whose last call has been sent are forgotten, so there are never more than frames waiting
+                for (auto iter = latest.begin(); iter != latest.end();) {
+                    if (iter->second < next) {
+                        iter = latest.erase(iter);
+                    } else {
+                        iter->second -= next;
+                        ++iter;
+                    }
+                }
+                next = 0;
+            }
+        };
+        static const size_t COMPACT_FRAMES = 64; // Fewest sent frames worth moving the rest of a stream for
+        std::vector<Stream> _streams;
+        size_t _queued; // Frames waiting on all the streams
+        uint64_t _pass; // Pass of the last frame taken, so a stream that was idle doesn't catch up in a burst
+        std::vector<std::string> _urgent; // Control frames and frames being replayed, which go ahead of the streams
+        static const size_t BATCH_BYTES = 16 * 1024; // Most taken into one write, so what comes next doesn't wait long
+        size_t _replayLimit; // Most bytes of sent frames kept for a resumed session; 0 keeps none
+        Sequence _sentSequence; // Frames sent in this session
+        Sequence _receivedSequence; // Frames received in this session
+        Sequence _pendingReceived; // Frames received while waiting to hear whether the session was resumed
+        std::string _secret; // Proves a client resuming the session is the one it was announced to; never sent to peers
         boost::system::error_code _lastErrorCode;
         ConnectionMap * _peers; // Peer connections
 
-        typedef std::pair<RequestID, RemoteExecuteCallback> RequestCallbackPair;
-        typedef std::deque<RequestCallbackPair> RequestCallbacks;
+        struct RequestCallback
+        {
+            RequestID requestID;
+            RemoteExecuteCallback callback;
+            TimerWheel::Clock::time_point deadline;
+
+            // Only kept while tracing
+            std::string name;
+            TimerWheel::Clock::time_point called;
+            TimerWheel::Clock::time_point sent; // When it was written out
+            Tracer::Duration remote; // Time the peer says it spent on it; zero if it didn't say
+        };
+        typedef std::vector<RequestCallback> RequestCallbacks; // Oldest first; a vector, as an empty one costs nothing
         RequestCallbacks _requestCallbacks;
         RequestID _nextRequestID;
 
-        static const char PACKET_END = '\0';
+        InboundScheduler * _scheduler; // Runs received calls, if set
+        WorkerPool * _workers; // Runs offloadable calls, if set
+        Capture * _capture; // Records the frames, if set
+        Tracer * _tracer; // Times the calls, if set
+
+        TimerWheel::Pointer _timers; // Drives the timeouts, if set
+        Timeouts _timeouts;
+        TimerWheel::Timer _heartbeatTimer;
+        TimerWheel::Timer _idleTimer;
+        TimerWheel::Timer _requestTimer; // Set for the earliest request deadline
+        TimerWheel::Timer _responseTimer; // Set for the oldest deferred result's deadline
+
+        // What only some connections ever use, kept apart so the rest don't pay for it
+
+        struct PendingResponse
+        {
+            Deferred::Pointer deferred;
+            TimerWheel::Clock::time_point deadline;
+        };
+
+        struct Cold
+        {
+            Cold()
+                : offloaded{}
+                , parked{}
+                , responses{}
+                , replay{}
+                , replayBytes{0}
+                , frameHandler{}
+                , resumeHandler{}
+                , sessionHandler{}
+                , rate{}
+                , session{}
+            {
+            }
+
+            std::deque<WorkerPool::Job> offloaded; // Ordered calls waiting for the one on a worker to finish
+            std::deque<WorkerPool::Job> parked; // Calls waiting for room on the workers, oldest first
+            std::deque<PendingResponse> responses; // Deferred results with a deadline, oldest first
+            std::deque<std::string> replay; // Most recently sent frames, with their size prefixes
+            size_t replayBytes;
+            FrameHandler frameHandler;
+            ResumeHandler resumeHandler;
+            SessionHandler sessionHandler;
+            std::unique_ptr<RateController> rate; // Paces state updates, if set
+            SessionLink session; // Where the session is now, once something needs to find it
+        };
+        std::unique_ptr<Cold> _cold; // Made the first time any of it is needed
+
+        Tracer::Duration _rtt; // Smoothed, from the clock checks
+        Tracer::Duration _clockOffset;
 };
 
 }
@@ -30,40 +30,336 @@ or implied, of Christopher Allen Ogden.
 #include "server.h"
 
 #include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
 #include "incoming_connection.h"
+#include "linked_connection.h"
 
 namespace SydNet {
 
 class RealServer: public Server
 {
     public:
+        struct Listening
+        {
+            Listening(size_t accepts = 4, int backlog = boost::asio::socket_base::max_connections, bool dualStack = true)
+                : accepts{accepts}
+                , backlog{backlog}
+                , dualStack{dualStack}
+            {
+            }
+
+            size_t accepts; // Accepts kept waiting at once, so a burst of connections isn't taken one at a time
+            int backlog; // Connections the kernel queues up before they're accepted
+            bool dualStack; // Listen for IPv6 and IPv4 on one socket, where there's IPv6
+        };
+
+        struct Resumption
+        {
+            Resumption(size_t replayBytes = 64 * 1024, TimerWheel::Clock::duration grace = std::chrono::seconds(30))
+                : replayBytes{replayBytes}
+                , grace{grace}
+            {
+            }
+
+            size_t replayBytes; // Most bytes of recently sent frames kept for each client to catch up on
+            TimerWheel::Clock::duration grace; // How long a dropped client's session waits for it to come back
+        };
+
         /**
          * Create a server instance and start accepting connections.
          *
          * @param invoker   RPC method invoker to use with this server
          * @param ioService IO service to use for this server
          * @param port      port to listen on
+         * @param listening How to listen for connections
          */
-        RealServer(const Connection::RPCInvoker & invoker, IOService & ioService, unsigned short port)
+        RealServer(const Connection::RPCInvoker & invoker, IOService & ioService, unsigned short port,
+                const Listening & listening = Listening{})
             : Server{invoker}
-            , _acceptor{ioService, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), port}}
+            , _acceptor{ioService}
             , _uuidGen{}
             , _connectionMap{}
+            , _scheduler{}
+            , _workers{}
+            , _timers{new TimerWheel{ioService}}
+            , _timeouts()
+            , _capture{}
+            , _tracer{}
+            , _lowFootprint{false}
+            , _rateControl{}
+            , _resumption{}
+            , _detached{}
+            , _streams{}
+            , _membershipHandler{}
+            , _spare{-1}
+            , _acceptRetry{}
+            , _acceptsWaiting{0}
+            , _backoff{}
         {
-            startAccept(); // Start accepting connections immediately
+            listen(port, listening);
+            reserveSpare();
+
+            // Start accepting connections immediately
+            for (size_t i = 0; i < std::max<size_t>(1, listening.accepts); ++i) {
+                startAccept();
+            }
             LOG_NOTICE("Accepting connections at ", _acceptor.local_endpoint());
         }
 
+        virtual ~RealServer()
+        {
+            if (_spare >= 0) {
+                ::close(_spare);
+            }
+        }
+
         Connection::ConnectionMap & clients()
         {
             return _connectionMap;
         }
 
+        /**
+         * Queue the calls clients make on a fair, rate-limited scheduler instead of running them as they arrive.
+         * Applies to the clients already connected as well; calling it again changes every client's limits.
+         *
+         * @param limits    Limits applied to each client
+         * @throw std::invalid_argument if a limited rate's burst is less than 1
+         */
+        void throttle(const InboundScheduler::Limits & limits)
+        {
+            if (_scheduler) {
+                _scheduler->limits(limits); // The clients hold on to it, so change it where it is
+                return;
+            }
+
+            _scheduler.reset(new InboundScheduler{ioServiceOf(_acceptor), limits});
+            for (auto & client: _connectionMap) {
+                if (auto connection = std::dynamic_pointer_cast<RealConnection>(client.second.lock())) {
+                    connection->scheduler(_scheduler.get());
+                }
+            }
+        }
+
+        /**
+         * Get the scheduler calls are queued on
+         *
+         * @return  Scheduler, or NULL if calls run as they arrive
+         */
+        const InboundScheduler * scheduler() const
+        {
+            return _scheduler.get();
+        }
+
+        /**
+         * Start a pool of worker threads for the methods registered as offloadable to run on, for the clients
+         * already connected as well. Does nothing if the pool is already running.
+         *
+         * @param threads   Number of worker threads
+         */
+        void startWorkers(size_t threads)
+        {
+            if (_workers) {
+                return; // The clients hold on to it
+            }
+
+            _workers.reset(new WorkerPool{threads});
+            for (auto & client: _connectionMap) {
+                if (auto connection = std::dynamic_pointer_cast<RealConnection>(client.second.lock())) {
+                    connection->workers(_workers.get());
+                }
+            }
+        }
+
+        /**
+         * Supervise newly connected clients with heartbeats and timeouts.
+         *
+         * @param timeouts  Timeouts to use; any left at zero are turned off
+         */
+        void timeouts(const RealConnection::Timeouts & timeouts)
+        {
+            _timeouts = timeouts;
+        }
+
+        /**
+         * Record every frame newly connected clients send or receive. Does nothing if already capturing, as the
+         * clients connected since hold on to the capture.
+         *
+         * @param path  Path of the capture file to write
+         */
+        void capture(const std::string & path)
+        {
+            if (_capture) {
+                LOG_WARNING("Already capturing; not capturing to ", path);
+                return;
+            }
+            _capture.reset(new Capture{path});
+        }
+
+        /**
+         * Time the calls newly connected clients make and answer, and keep track of their round trip times.
+         * Does nothing if already tracing, as the clients connected since hold on to the tracer.
+         */
+        void trace()
+        {
+            if (!_tracer) {
+                _tracer.reset(new Tracer{});
+            }
+        }
+
+        /**
+         * Get the tracer the clients' calls are timed with.
+         *
+         * @return  Tracer, or NULL if not tracing
+         */
+        const Tracer * tracer() const
+        {
+            return _tracer.get();
+        }
+
+        /**
+         * Have newly connected clients give their buffers back whenever they're idle (see RealConnection::lowFootprint).
+         */
+        void lowFootprint()
+        {
+            _lowFootprint = true;
+        }
+
+        /**
+         * Pace state updates to newly connected clients by how well each one's link copes (see RealConnection::rateControl).
+         *
+         * @param settings  Fastest and slowest updates and their budgets
+         * @throw std::invalid_argument if the settings don't make sense (see RateController::RateController)
+         */
+        void rateControl(const RateController::Settings & settings = RateController::Settings{})
+        {
+            _rateControl.reset(new RateController::Settings{RateController::validate(settings)});
+        }
+
+        /**
+         * Let newly connected clients that drop off reconnect and resume their sessions,
+         * being sent whatever they missed meanwhile.
+         *
+         * @param resumption    How much to keep for them, and for how long
+         */
+        void resumable(const Resumption & resumption = Resumption{})
+        {
+            _resumption.reset(new Resumption{resumption});
+        }
+
+        /**
+         * Set how a stream's frames are sent to newly connected clients (see RealConnection::stream).
+         *
+         * @param stream    Stream to set up
+         * @param priority  Frames on streams with a higher priority always go first
+         * @param weight    Share of what's sent, against other streams with the same priority
+         */
+        void stream(Connection::StreamID stream, unsigned priority, unsigned weight = 1)
+        {
+            _streams.push_back(StreamSetting{stream, priority, weight});
+        }
+
+        typedef std::function<void(const boost::uuids::uuid & client, bool joined)> MembershipHandler;
+
+        /**
+         * Be told whenever a client joins the server or leaves it for good (a dropped client
+         * waiting to resume its session hasn't left yet).
+         *
+         * @param handler   Called with the client's UUID, and whether it joined or left
+         */
+        void onMembership(const MembershipHandler & handler)
+        {
+            _membershipHandler = handler;
+        }
+
+        /**
+         * Take on a client that reached the server some other way (e.g. through a gateway), as if it had connected.
+         *
+         * @param client    The client's connection
+         */
+        void adopt(const Connection::Pointer & client)
+        {
+            client->interest(&interest());
+            _connectionMap[client->uuid()] = client;
+            membership(client->uuid(), true);
+        }
+
+        /**
+         * Let go of a client taken on with adopt(), as if it had disconnected.
+         *
+         * @param client    UUID of the client
+         */
+        void release(const boost::uuids::uuid & client)
+        {
+            if (_connectionMap.erase(client)) {
+                interest().remove(client);
+                membership(client, false);
+            }
+        }
+
+        /**
+         * Connect a client hosted in this process, bypassing the network entirely.
+         *
+         * @param ioService IO service calls to the client run on
+         * @return          The client end of the connection
+         */
+        Connection::Pointer connectLocal(IOService & ioService)
+        {
+            LinkedConnection::Pair link = LinkedConnection::create(invoker(), ioService, ioServiceOf(_acceptor), _uuidGen(), &_connectionMap);
+            link.second->interest(&interest());
+
+            LOG_NOTICE("Local client connected: ", link.second->uuid());
+            _connectionMap[link.second->uuid()] = link.second;
+
+            std::static_pointer_cast<LinkedConnection>(link.second)->onDisconnect(
+                    std::bind(&RealServer::handleLocalDisconnect, this, link.second, std::placeholders::_1));
+
+            membership(link.second->uuid(), true);
+            return link.first;
+        }
+
     private:
+        void listen(unsigned short port, const Listening & listening)
+        {
+            using boost::asio::ip::tcp;
+
+            // Fall back to IPv4 alone if there's no IPv6 to listen on
+            tcp protocol = tcp::v4();
+            if (listening.dualStack) {
+                boost::system::error_code error;
+                _acceptor.open(tcp::v6(), error);
+                if (!error) {
+                    _acceptor.set_option(boost::asio::ip::v6_only{false}, error);
+                }
+                if (error) {
+                    LOG_INFO("No dual-stack listening: ", error.message());
+                    _acceptor.close(error);
+                } else {
+                    protocol = tcp::v6();
+                }
+            }
+
+            if (!_acceptor.is_open()) {
+                _acceptor.open(protocol);
+            }
+            _acceptor.set_option(tcp::acceptor::reuse_address{true});
+            _acceptor.bind(tcp::endpoint{protocol, port});
+            _acceptor.listen(listening.backlog);
+        }
+
+        void reserveSpare()
+        {
+            // Held so there's always a descriptor to turn a connection away with when we run out
+            if (_spare < 0) {
+                _spare = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+        }
+
         void startAccept()
         {
             // Prepare a new connection to accept onto
-            Connection::Pointer newConnection = IncomingConnection::create(invoker(), _acceptor.io_service(), _uuidGen(), &_connectionMap);
+            Connection::Pointer newConnection = IncomingConnection::create(invoker(), ioServiceOf(_acceptor), _uuidGen(), &_connectionMap);
+            newConnection->interest(&interest());
 
             // Wait for one to accept (will call handleAccept)
             _acceptor.async_accept(std::static_pointer_cast<IncomingConnection>(newConnection)->socket(),
@@ -72,30 +368,229 @@ class RealServer: public Server
 
         void handleAccept(Connection::Pointer newConnection, const boost::system::error_code & error)
         {
+            if (error == boost::asio::error::operation_aborted) {
+                return; // Shutting down
+            }
             if (error) {
-                throw boost::system::system_error{error};
+                handleAcceptError(error);
+                return;
             }
+            _backoff = TimerWheel::Clock::duration::zero();
 
-            LOG_NOTICE("Client connected: ", std::static_pointer_cast<IncomingConnection>(newConnection)->socket().remote_endpoint(), " ", newConnection->uuid());
+            boost::system::error_code endpointError;
+            LOG_NOTICE("Client connected: ", std::static_pointer_cast<IncomingConnection>(newConnection)->socket().remote_endpoint(endpointError), " ", newConnection->uuid());
             _connectionMap[newConnection->uuid()] = newConnection;
+            std::static_pointer_cast<IncomingConnection>(newConnection)->scheduler(_scheduler.get());
+            std::static_pointer_cast<IncomingConnection>(newConnection)->workers(_workers.get());
+            std::static_pointer_cast<IncomingConnection>(newConnection)->timeouts(_timers, _timeouts);
+            std::static_pointer_cast<IncomingConnection>(newConnection)->capture(_capture.get());
+            std::static_pointer_cast<IncomingConnection>(newConnection)->tracing(_tracer.get());
+            std::static_pointer_cast<IncomingConnection>(newConnection)->lowFootprint(_lowFootprint);
+            if (_rateControl) {
+                std::static_pointer_cast<IncomingConnection>(newConnection)->rateControl(*_rateControl);
+            }
+            for (const StreamSetting & setting: _streams) {
+                std::static_pointer_cast<IncomingConnection>(newConnection)->stream(setting.stream, setting.priority, setting.weight);
+            }
+            if (_resumption) {
+                std::static_pointer_cast<IncomingConnection>(newConnection)->resumable(_resumption->replayBytes);
+                std::static_pointer_cast<IncomingConnection>(newConnection)->resumeHandler(
+                        std::bind(&RealServer::handleResume, this, Connection::WeakPointer{newConnection},
+                            std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+            }
 
             // Begin reading on the new connection
             std::static_pointer_cast<IncomingConnection>(newConnection)->beginReading(
                     std::bind(&RealServer::handleDisconnect, this, newConnection, std::placeholders::_1));
+            if (_resumption) {
+                std::static_pointer_cast<IncomingConnection>(newConnection)->announceSession();
+            }
+            membership(newConnection->uuid(), true);
 
             // Wait for the next connection
             startAccept();
         }
 
+        void handleAcceptError(const boost::system::error_code & error)
+        {
+            if (error == boost::asio::error::no_descriptors || error == boost::system::errc::too_many_files_open_in_system) {
+                LOG_WARNING("Out of descriptors; turning a connection away");
+                turnAway();
+            } else {
+                LOG_WARNING("Accept failed: ", error.message());
+            }
+
+            // Whatever it was is likely to happen again straight away; give it a moment
+            const TimerWheel::Clock::duration minimum = std::chrono::milliseconds(10);
+            const TimerWheel::Clock::duration maximum = std::chrono::seconds(1);
+            _backoff = _backoff < minimum ? minimum : std::min<TimerWheel::Clock::duration>(_backoff * 2, maximum);
+
+            ++_acceptsWaiting;
+            if (!_acceptRetry.pending()) {
+                _timers->schedule(_acceptRetry, _backoff, std::bind(&RealServer::handleAcceptRetry, this));
+            }
+        }
+
+        void handleAcceptRetry()
+        {
+            for (; _acceptsWaiting; --_acceptsWaiting) {
+                startAccept();
+            }
+        }
+
+        void turnAway()
+        {
+            // Free the spare descriptor, take the oldest waiting connection with it and close it straight away,
+            // so the client hears about it instead of waiting in the backlog
+            if (_spare >= 0) {
+                ::close(_spare);
+                _spare = -1;
+            }
+
+            boost::system::error_code error;
+            boost::asio::ip::tcp::socket socket{ioServiceOf(_acceptor)};
+            _acceptor.non_blocking(true, error);
+            _acceptor.accept(socket, error);
+            _acceptor.non_blocking(false, error);
+            socket.close(error);
+
+            reserveSpare();
+        }
+
         void handleDisconnect(Connection::Pointer connection, const boost::system::error_code & error)
         {
-            LOG_NOTICE("Client disconnected: ", std::static_pointer_cast<IncomingConnection>(connection)->socket().remote_endpoint(), " ", connection->uuid());
+            auto iter = _connectionMap.find(connection->uuid());
+            if (iter == _connectionMap.end() || iter->second.lock() != connection) {
+                return; // Its session was taken over by the client reconnecting
+            }
+
+            boost::system::error_code endpointError;
+            LOG_NOTICE("Client disconnected: ", std::static_pointer_cast<IncomingConnection>(connection)->socket().remote_endpoint(endpointError), " ", connection->uuid());
+
+            if (_resumption && _resumption->grace.count()) {
+                // Keep the session, and what's sent to it meanwhile, for the client to come back to
+                std::unique_ptr<Detached> & detached = _detached[connection->uuid()];
+                detached.reset(new Detached{connection});
+                _timers->schedule(detached->grace, _resumption->grace,
+                        std::bind(&RealServer::handleGraceOver, this, connection->uuid()));
+                return;
+            }
+
             _connectionMap.erase(connection->uuid());
+            interest().remove(connection->uuid());
+            membership(connection->uuid(), false);
+        }
+
+        void handleGraceOver(boost::uuids::uuid session)
+        {
+            LOG_NOTICE("Session expired: ", session);
+            _detached.erase(session);
+            _connectionMap.erase(session);
+            interest().remove(session);
+            membership(session, false);
+        }
+
+        bool handleResume(Connection::WeakPointer weakConnection, const boost::uuids::uuid & session, const char * secret,
+                RealConnection::Sequence received)
+        {
+            Connection::Pointer connection = weakConnection.lock();
+            auto iter = _connectionMap.find(session);
+            std::shared_ptr<IncomingConnection> previous;
+            if (iter != _connectionMap.end()) {
+                previous = std::dynamic_pointer_cast<IncomingConnection>(iter->second.lock());
+            }
+
+            if (!connection || !previous || previous == connection) {
+                LOG_NOTICE("No session ", session, " to resume");
+                return false;
+            }
+            if (!previous->secretMatches(secret)) {
+                // Anyone can know the UUID; only its own client knows the secret
+                LOG_WARNING("Wrong secret for session ", session, " from ", connection->uuid());
+                return false;
+            }
+
+            boost::uuids::uuid fresh = connection->uuid();
+            if (!std::static_pointer_cast<IncomingConnection>(connection)->resume(*previous, received)) {
+                LOG_NOTICE("Session ", session, " no longer has everything the client missed");
+                return false;
+            }
+
+            // The connection carries on as the session's, in place of the one it was given
+            _connectionMap.erase(fresh);
+            interest().remove(fresh);
+            if (_scheduler) {
+                _scheduler->remove(fresh);
+            }
+            membership(fresh, false);
+            _connectionMap[session] = connection;
+            _detached.erase(session);
+            LOG_NOTICE("Session resumed: ", session);
+
+            // The client has moved on from the old connection even if we haven't heard it drop
+            if (previous->connected()) {
+                try {
+                    previous->disconnect();
+                } catch (const boost::system::system_error & e) {
+                    LOG_INFO("Error dropping the old connection: ", e.what());
+                }
+            }
+            return true;
+        }
+
+        void handleLocalDisconnect(Connection::Pointer connection, const boost::system::error_code & error)
+        {
+            LOG_NOTICE("Local client disconnected: ", connection->uuid());
+            _connectionMap.erase(connection->uuid());
+            interest().remove(connection->uuid());
+            membership(connection->uuid(), false);
+        }
+
+        void membership(const boost::uuids::uuid & client, bool joined)
+        {
+            if (_membershipHandler) {
+                _membershipHandler(client, joined);
+            }
         }
 
         boost::asio::ip::tcp::acceptor _acceptor;
         boost::uuids::random_generator _uuidGen;
         Connection::ConnectionMap _connectionMap;
+        std::unique_ptr<InboundScheduler> _scheduler;
+        std::unique_ptr<WorkerPool> _workers;
+        TimerWheel::Pointer _timers; // Supervises every client
+        RealConnection::Timeouts _timeouts;
+        std::unique_ptr<Capture> _capture; // Records client traffic, if set
+        std::unique_ptr<Tracer> _tracer; // Times client calls, if set
+        bool _lowFootprint; // Clients give their buffers back when idle
+        std::unique_ptr<RateController::Settings> _rateControl; // Paces updates to clients, if set
+        std::unique_ptr<Resumption> _resumption; // Lets clients resume their sessions, if set
+
+        struct Detached
+        {
+            explicit Detached(const Connection::Pointer & connection)
+                : connection{connection}
+                , grace{}
+            {
+            }
+
+            Connection::Pointer connection;
+            TimerWheel::Timer grace;
+        };
+        std::unordered_map<boost::uuids::uuid, std::unique_ptr<Detached>, boost::hash<boost::uuids::uuid>> _detached; // Sessions waiting for their clients to come back
+
+        struct StreamSetting
+        {
+            Connection::StreamID stream;
+            unsigned priority;
+            unsigned weight;
+        };
+        std::vector<StreamSetting> _streams;
+        MembershipHandler _membershipHandler;
+        int _spare; // Descriptor kept in reserve for turning connections away
+        TimerWheel::Timer _acceptRetry;
+        size_t _acceptsWaiting; // Accepts to start again once the backoff is over
+        TimerWheel::Clock::duration _backoff;
 };
 
 }
@@ -0,0 +1,185 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+#include <cstring>
+
+#include "shared.h"
+#include "capture.h"
+#include "real_server.h"
+#include "outgoing_connection.h"
+
+#ifdef USE_PANTHEIOS
+const PAN_CHAR_T PANTHEIOS_FE_PROCESS_IDENTITY[] = "replay";
+#endif
+
+/*
+ * Feeds the calls clients made in a capture back into a server, then reports how it coped.
+ *
+ * Usage: replay <capture file> [speed] [port]
+ *
+ * A speed of 1 (the default) replays at the original pace, 2 twice as fast, and so on;
+ * a speed of 0 sends everything as fast as possible.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Replayed
+{
+    Replayed()
+        : connection{}
+        , waiting{}
+    {
+    }
+
+    SydNet::Connection::Pointer connection;
+    std::map<SydNet::Frame::RequestID, Clock::time_point> waiting; // Sent calls awaiting results
+};
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <capture file> [speed] [port]" << std::endl;
+        return 1;
+    }
+
+    double speed = argc > 2 ? atof(argv[2]) : 1.0;
+    unsigned short port = argc > 3 ? atoi(argv[3]) : 2001;
+
+    try {
+        SydNet::CaptureReader reader{argv[1]};
+        SydNet::Connection::RPCInvoker rpcInvoker{RPCMethods()};
+
+        // The server gets its own thread so replaying doesn't hold it up. Its handlers are timed by the
+        // tracer, around each call alone, so neither our sending nor its own idling and framing count.
+        SydNet::IOService serverService;
+        SydNet::RealServer server{rpcInvoker, serverService, port};
+        server.trace();
+        std::thread serverThread{[&serverService] {
+            serverService.run();
+        }};
+
+        SydNet::IOService clientService;
+        std::map<boost::uuids::uuid, Replayed> clients;
+        std::vector<double> latencies;
+        size_t sent = 0;
+
+        Clock::time_point start = Clock::now();
+        uint64_t firstTime = 0;
+        bool first = true;
+
+        SydNet::Capture::Record record;
+        while (reader.next(record)) {
+            // Only what clients sent; results are answers to calls the server made, which nobody will make now
+            SydNet::Frame::RequestID requestID;
+            std::memcpy(&requestID, record.data, sizeof(requestID));
+            if (record.direction != SydNet::Capture::Inbound || requestID & SydNet::Frame::REQUEST_ID_RECEIVED_BIT) {
+                continue;
+            }
+
+            if (first) {
+                firstTime = record.time;
+                first = false;
+            }
+
+            if (speed > 0) {
+                Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::nanoseconds(static_cast<uint64_t>((record.time - firstTime) / speed)));
+                while (Clock::now() < due) {
+                    clientService.poll();
+                    std::this_thread::sleep_for(std::min<Clock::duration>(due - Clock::now(), std::chrono::milliseconds(1)));
+                }
+            }
+
+            Replayed & client = clients[record.uuid];
+            if (!client.connection) {
+                client.connection = SydNet::OutgoingConnection::create(rpcInvoker, clientService, "localhost", port);
+
+                // Only the timing of results matters here; nothing is run on the client side
+                Replayed * replayed = &client;
+                std::static_pointer_cast<SydNet::RealConnection>(client.connection)->frameHandler(
+                    [replayed, &latencies](const char * frame, size_t) {
+                        SydNet::Frame::RequestID requestID;
+                        std::memcpy(&requestID, frame, sizeof(requestID));
+                        auto iter = replayed->waiting.find(requestID & ~SydNet::Frame::REQUEST_ID_RECEIVED_BIT);
+                        if (requestID & SydNet::Frame::REQUEST_ID_RECEIVED_BIT && iter != replayed->waiting.end()) {
+                            latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - iter->second).count());
+                            replayed->waiting.erase(iter);
+                        }
+                        return true;
+                    });
+            }
+
+            if (requestID) {
+                client.waiting[requestID] = Clock::now();
+            }
+            std::static_pointer_cast<SydNet::RealConnection>(client.connection)->sendFrame(record.data, record.length);
+            ++sent;
+            clientService.poll();
+        }
+        double sendSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // Give the server a moment to finish what it was sent, and the last results to arrive
+        Clock::time_point settled = Clock::now() + std::chrono::milliseconds(100);
+        Clock::time_point giveUp = Clock::now() + std::chrono::seconds(2);
+        size_t expected = latencies.size();
+        for (auto & client: clients) {
+            expected += client.second.waiting.size();
+        }
+        while ((latencies.size() < expected || Clock::now() < settled) && Clock::now() < giveUp) {
+            clientService.poll();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        serverService.stop();
+        serverThread.join();
+
+        std::cout << "Replayed " << sent << " frames from " << clients.size() << " clients in " << sendSeconds << "s ("
+                  << (sendSeconds > 0 ? sent / sendSeconds : 0) << " frames/s)" << std::endl;
+        std::cout << "Server handler time: "
+                  << std::chrono::duration<double>(server.tracer()->spent(SydNet::Tracer::Handling)).count() << "s" << std::endl;
+        std::cout << "Results: " << latencies.size() << " of " << expected << std::endl;
+        if (!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&latencies](double p) { return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+            std::cout << "Latency (ms): p50 " << percentile(0.5) << ", p90 " << percentile(0.9)
+                      << ", p99 " << percentile(0.99) << ", max " << latencies.back() << std::endl;
+        }
+
+        clients.clear();
+    } catch (const std::exception & e) {
+        std::cerr << "Replay failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
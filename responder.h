@@ -0,0 +1,235 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "codec.h"
+
+namespace SydNet {
+
+/**
+ * A result that isn't ready yet, as the connection answering the call sees it.
+ */
+class Deferred
+{
+    public:
+        typedef std::shared_ptr<Deferred> Pointer;
+        typedef std::function<void(const std::string & result)> Sender;
+
+        /**
+         * Send the encoded result once there is one (straight away if there already is).
+         *
+         * @param sender    Called with the encoded result, on whichever thread it turns up on
+         */
+        virtual void attach(const Sender & sender) = 0;
+
+        /**
+         * Stop waiting for the result; if it turns up after all, it goes nowhere.
+         */
+        virtual void abandon() = 0;
+
+        /**
+         * Check whether the result is still to come.
+         *
+         * @return  True if it hasn't turned up and hasn't been given up on
+         */
+        virtual bool pending() const = 0;
+
+        virtual ~Deferred() {}
+};
+
+/**
+ * Returned by an RPC method that answers later, so it doesn't hold up the network thread while it works it
+ * out; the result is sent when respond() is called, from any thread. Only methods in a registry can do this.
+ *
+ *     SydNet::Responder<int> lookup(int key, SydNet::Connection::Pointer connection)
+ *     {
+ *         SydNet::Responder<int> responder;
+ *         database.find(key, [responder](int value) { responder.respond(value); });
+ *         return responder;
+ *     }
+ *
+ * The caller gets the int, the same as if the method had returned one.
+ */
+template<typename T>
+class Responder
+{
+    public:
+        typedef T Result;
+        typedef std::function<void(const T & result)> Handler;
+
+        Responder()
+            : _state{std::make_shared<State>()}
+        {
+        }
+
+        /**
+         * Fill in the result; only the first one counts.
+         *
+         * @param result    The result
+         */
+        void respond(const T & result) const
+        {
+            _state->respond(result);
+        }
+
+        /**
+         * Be handed the result once there is one (straight away if there already is).
+         *
+         * @param handler   Called with the result
+         */
+        void then(const Handler & handler) const
+        {
+            _state->then(handler);
+        }
+
+        /**
+         * Check whether the result is still to come.
+         *
+         * @return  True if it hasn't been filled in and hasn't been given up on
+         */
+        bool pending() const
+        {
+            return _state->pending();
+        }
+
+        /**
+         * Get the result as the connection answering the call sees it.
+         *
+         * @return  The deferred result
+         */
+        Deferred::Pointer deferred() const
+        {
+            return _state;
+        }
+
+    private:
+        class State: public Deferred
+        {
+            public:
+                State()
+                    : _mutex{}
+                    , _result{}
+                    , _handler{}
+                    , _abandoned{false}
+                {
+                }
+
+                void respond(const T & result)
+                {
+                    Handler handler;
+                    {
+                        std::lock_guard<std::mutex> lock{_mutex};
+                        if (_result || _abandoned) {
+                            return;
+                        }
+                        _result.reset(new T(result));
+                        handler.swap(_handler);
+                    }
+                    if (handler) {
+                        handler(*_result);
+                    }
+                }
+
+                void then(const Handler & handler)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock{_mutex};
+                        if (!_result) {
+                            _handler = handler;
+                            return;
+                        }
+                    }
+                    handler(*_result); // Never changes once it's set
+                }
+
+                virtual void attach(const Sender & sender)
+                {
+                    then([sender](const T & result) {
+                        std::ostringstream output;
+                        Codec::Value<T>::write(output, result);
+                        sender(output.str());
+                    });
+                }
+
+                virtual void abandon()
+                {
+                    std::lock_guard<std::mutex> lock{_mutex};
+                    _abandoned = true;
+                    _handler = Handler{};
+                }
+
+                virtual bool pending() const
+                {
+                    std::lock_guard<std::mutex> lock{_mutex};
+                    return !_result && !_abandoned;
+                }
+
+            private:
+                mutable std::mutex _mutex;
+                std::unique_ptr<T> _result;
+                Handler _handler;
+                bool _abandoned;
+        };
+
+        std::shared_ptr<State> _state;
+};
+
+/**
+ * What the caller of a method gets back: the method's result, or what its responder is filled in with.
+ */
+template<typename R>
+struct Returned
+{
+    typedef R type;
+
+    template<typename Callback>
+    static void deliver(R result, Callback callback)
+    {
+        callback(result);
+    }
+};
+
+template<typename T>
+struct Returned<Responder<T>>
+{
+    typedef T type;
+
+    template<typename Callback>
+    static void deliver(Responder<T> result, Callback callback)
+    {
+        result.then(callback);
+    }
+};
+
+}
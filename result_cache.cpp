@@ -0,0 +1,103 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "result_cache.h"
+
+namespace SydNet {
+
+/*****************
+ * Public methods
+ *****************/
+
+bool ResultCache::find(const char * params, size_t length, std::string & result)
+{
+    const std::string key(params, length);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto iter = _entries.find(key);
+    if (iter == _entries.end()) {
+        return false;
+    }
+
+    if (_ttl.count() && Clock::now() >= iter->second.expiry) {
+        _used.erase(iter->second.used);
+        _entries.erase(iter);
+        return false;
+    }
+
+    _used.splice(_used.begin(), _used, iter->second.used);
+    result = iter->second.result;
+    return true;
+}
+
+void ResultCache::store(const std::string & params, const std::string & result)
+{
+    Clock::time_point expiry = _ttl.count() ? Clock::now() + _ttl : Clock::time_point::max();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto iter = _entries.find(params);
+    if (iter != _entries.end()) {
+        iter->second.result = result;
+        iter->second.expiry = expiry;
+        _used.splice(_used.begin(), _used, iter->second.used);
+        return;
+    }
+
+    if (_entries.size() >= _capacity) {
+        _entries.erase(_entries.find(*_used.back())); // By position: the key it'd go by is the entry's own
+        _used.pop_back();
+    }
+
+    iter = _entries.insert(std::make_pair(params, Entry{result, expiry, Used::iterator{}})).first;
+    _used.push_front(&iter->first);
+    iter->second.used = _used.begin();
+}
+
+void ResultCache::invalidate(const std::string & params)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto iter = _entries.find(params);
+    if (iter != _entries.end()) {
+        _used.erase(iter->second.used);
+        _entries.erase(iter);
+    }
+}
+
+void ResultCache::clear()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _entries.clear();
+    _used.clear();
+}
+
+size_t ResultCache::size() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _entries.size();
+}
+
+}
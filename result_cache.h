@@ -0,0 +1,122 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace SydNet {
+
+/**
+ * Encoded results of a method that's a pure function of its arguments, looked up by its encoded arguments.
+ *
+ * It holds a bounded number of results, letting the least recently used go first once it's full, and each
+ * result can be given a time to live. Connections on any thread can share one.
+ */
+class ResultCache
+{
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        /**
+         * Create an empty cache.
+         *
+         * @param entries   Most results kept
+         * @param ttl       How long a result stays good (zero for as long as it's kept)
+         */
+        ResultCache(size_t entries, Clock::duration ttl)
+            : _capacity{std::max<size_t>(entries, 1)}
+            , _ttl{ttl}
+            , _mutex{}
+            , _entries{}
+            , _used{}
+        {
+        }
+
+        /**
+         * Look up the result for some arguments.
+         *
+         * @param params    Encoded arguments
+         * @param length    Length of the encoded arguments
+         * @param result    Set to the encoded result, if there is one
+         * @return          True if there was a result, and it was still good
+         */
+        bool find(const char * params, size_t length, std::string & result);
+
+        /**
+         * Keep the result for some arguments, in place of any already kept.
+         *
+         * @param params    Encoded arguments
+         * @param result    Encoded result
+         */
+        void store(const std::string & params, const std::string & result);
+
+        /**
+         * Forget the result for some arguments.
+         *
+         * @param params    Encoded arguments
+         */
+        void invalidate(const std::string & params);
+
+        /**
+         * Forget every result.
+         */
+        void clear();
+
+        /**
+         * Get how many results are kept.
+         *
+         * @return  Number of results, including any that have expired but not been looked up since
+         */
+        size_t size() const;
+
+        ResultCache & operator=(const ResultCache &) = delete;
+        ResultCache(const ResultCache &) = delete;
+
+    private:
+        typedef std::list<const std::string *> Used;
+
+        struct Entry
+        {
+            std::string result;
+            Clock::time_point expiry;
+            Used::iterator used; // Where it is in the order of use
+        };
+
+        const size_t _capacity;
+        const Clock::duration _ttl;
+        mutable std::mutex _mutex;
+        std::unordered_map<std::string, Entry> _entries; // By encoded arguments
+        Used _used; // Arguments of the entries, most recently used first
+};
+
+}
@@ -0,0 +1,445 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <boost/serialization/string.hpp>
+
+#include "codec.h"
+#include "responder.h"
+
+/**
+ * Macros used to list functions in a registry, named the same way as the RPC macros.
+ */
+#define RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&x), &x>("rpc_" #x)                 // Both
+#define CLIENT_RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&x), &x>("client_rpc_" #x)   // Client
+#define SERVER_RPC_ENTRY(x) SydNet::RPCRegistry::entry<decltype(&x), &x>("server_rpc_" #x)   // Server
+
+/**
+ * Registry the RPC macros check their methods against at compile time. A program defines it, after
+ * #undef'ing this default, to the struct listing its methods.
+ */
+#define SYDNET_RPC_REGISTRY SydNet::RPCRegistry::Unchecked
+
+namespace SydNet {
+
+class Connection;
+
+/**
+ * Compile-time lists of RPC methods.
+ *
+ * A registry is a struct with a constexpr array of entries:
+ *
+ *     struct Methods
+ *     {
+ *         static constexpr SydNet::RPCRegistry::Entry entries[] = {
+ *             CLIENT_RPC_ENTRY(printMessage),
+ *             SERVER_RPC_ENTRY(sendMessage),
+ *         };
+ *     };
+ *
+ * Table<Methods> finds a perfect hash for the names when it's compiled, so a name is found with one hash
+ * and one comparison, and fails to build if a method is listed twice. Methods in a registry are encoded with
+ * Codec rather than by the invoker they're attached to, so both ends must use the registry. Their arguments
+ * are decoded straight from the receive buffer, so parameters taking a StringView don't copy anything.
+ */
+namespace RPCRegistry {
+    typedef std::shared_ptr<Connection> Pointer;
+    typedef Deferred::Pointer (*Thunk)(const char * input, size_t length, std::ostream & output, Pointer connection);
+
+    struct Entry
+    {
+        const char * name;
+        size_t length;
+        uint32_t hash;
+        const void * type; // Stands for the function's type, so calls can be checked against it
+        bool answers; // Whether it has a result to send back
+        Thunk thunk; // Decodes the parameters, calls the function and encodes its result (or hands back its responder's)
+    };
+
+    // One object for each function type, whose address stands for the type at compile time
+    template<typename Function>
+    struct TypeOf
+    {
+        static const char tag;
+    };
+
+    template<typename Function>
+    const char TypeOf<Function>::tag = 0;
+
+    constexpr size_t length(const char * name, size_t counted = 0)
+    {
+        return *name ? length(name + 1, counted + 1) : counted;
+    }
+
+    /**
+     * FNV-1a hash of a name, usable at compile time.
+     */
+    constexpr uint32_t hash(const char * name, uint32_t value = 2166136261u)
+    {
+        return *name ? hash(name + 1, (value ^ static_cast<uint8_t>(*name)) * 16777619u) : value;
+    }
+
+    /**
+     * The same hash, for names only known at run time.
+     */
+    inline uint32_t hash(const char * name, size_t length)
+    {
+        uint32_t value = 2166136261u;
+        for (size_t i = 0; i < length; ++i) {
+            value = (value ^ static_cast<uint8_t>(name[i])) * 16777619u;
+        }
+        return value;
+    }
+
+    // Index sequences for unpacking tuples and building tables, made by halves to keep the recursion shallow
+    template<size_t...> struct Indices {};
+
+    template<typename First, typename Second> struct JoinIndices;
+    template<size_t... I, size_t... J> struct JoinIndices<Indices<I...>, Indices<J...>>
+    {
+        typedef Indices<I..., (sizeof...(I) + J)...> type;
+    };
+
+    template<size_t N> struct MakeIndices
+    {
+        typedef typename JoinIndices<typename MakeIndices<N / 2>::type, typename MakeIndices<N - N / 2>::type>::type type;
+    };
+    template<> struct MakeIndices<0> { typedef Indices<> type; };
+    template<> struct MakeIndices<1> { typedef Indices<0> type; };
+
+    // Writes arguments as the types of the parameters they're for
+    template<typename... Params>
+    struct Encode
+    {
+        static void write(std::ostream &) {}
+    };
+
+    template<typename Param, typename... Params>
+    struct Encode<Param, Params...>
+    {
+        template<typename Arg, typename... Args>
+        static void write(std::ostream & output, Arg && arg, Args && ... args)
+        {
+            Codec::Value<typename std::decay<Param>::type>::write(output, std::forward<Arg>(arg));
+            Encode<Params...>::write(output, std::forward<Args>(args)...);
+        }
+
+        static void write(std::ostream &) {} // Only the connection is left
+    };
+
+    template<typename Tuple, size_t... I>
+    void decode(Codec::Reader & reader, Tuple & values, Indices<I...>)
+    {
+        // In order, since braced lists are evaluated left to right
+        int expand[] = {0, (std::get<I>(values) = Codec::Value<typename std::tuple_element<I, Tuple>::type>::read(reader), 0)...};
+        (void)expand;
+    }
+
+    // Calls a function, writing its result if it has one, or handing back its result to come
+    template<typename Result>
+    struct Call
+    {
+        template<typename Function, typename Tuple, size_t... I>
+        static Deferred::Pointer run(Function function, Tuple & values, Pointer connection, std::ostream & output, Indices<I...>)
+        {
+            Codec::Value<typename std::decay<Result>::type>::write(output, function(std::get<I>(values)..., connection));
+            return Deferred::Pointer{};
+        }
+    };
+
+    template<>
+    struct Call<void>
+    {
+        template<typename Function, typename Tuple, size_t... I>
+        static Deferred::Pointer run(Function function, Tuple & values, Pointer connection, std::ostream &, Indices<I...>)
+        {
+            function(std::get<I>(values)..., connection);
+            return Deferred::Pointer{};
+        }
+    };
+
+    template<typename T>
+    struct Call<Responder<T>>
+    {
+        template<typename Function, typename Tuple, size_t... I>
+        static Deferred::Pointer run(Function function, Tuple & values, Pointer connection, std::ostream &, Indices<I...>)
+        {
+            return function(std::get<I>(values)..., connection).deferred();
+        }
+    };
+
+    template<typename Function, Function function>
+    struct Method;
+
+    template<typename Result, typename... Params, Result (*function)(Params...)>
+    struct Method<Result (*)(Params...), function>
+    {
+        static_assert(sizeof...(Params) > 0, "RPC methods take the connection as their last parameter");
+
+        typedef typename MakeIndices<sizeof...(Params) - 1>::type Arguments;
+
+        static Deferred::Pointer thunk(const char * input, size_t length, std::ostream & output, Pointer connection)
+        {
+            // The last value is the connection, which isn't sent
+            std::tuple<typename std::decay<Params>::type...> values;
+            Codec::Reader reader{input, length};
+            decode(reader, values, Arguments{});
+            return Call<typename std::decay<Result>::type>::run(function, values, connection, output, Arguments{});
+        }
+    };
+
+    // Whether a method takes views or packed arrays, which only the registry's encoding can decode
+    template<typename... Params>
+    struct TakesEncoded: std::false_type {};
+
+    template<typename Param, typename... Params>
+    struct TakesEncoded<Param, Params...>: std::integral_constant<bool,
+        Codec::OnlyEncoded<typename std::decay<Param>::type>::value || TakesEncoded<Params...>::value> {};
+
+    template<typename Function>
+    struct OnlyInRegistry;
+
+    template<typename Result>
+    struct Defers: std::false_type {};
+
+    template<typename T>
+    struct Defers<Responder<T>>: std::true_type {};
+
+    // Whether a method takes or returns what only the registry's encoding can, or answers through a responder
+    template<typename Result, typename... Params>
+    struct OnlyInRegistry<Result (*)(Params...)>: std::integral_constant<bool, TakesEncoded<Params...>::value
+        || Codec::OnlyEncoded<typename std::decay<Result>::type>::value || Defers<typename std::decay<Result>::type>::value> {};
+
+    template<typename Function>
+    struct Answers;
+
+    template<typename Result, typename... Params>
+    struct Answers<Result (*)(Params...)>: std::integral_constant<bool, !std::is_void<Result>::value> {};
+
+    /**
+     * Make a registry entry; used by the entry macros.
+     */
+    template<typename Function, Function function>
+    constexpr Entry entry(const char * name)
+    {
+        return Entry{name, length(name), hash(name), &TypeOf<Function>::tag, Answers<Function>::value, &Method<Function, function>::thunk};
+    }
+
+    /**
+     * Encode the arguments of a call to a method in a registry.
+     */
+    template<typename Result, typename... Params, typename... Args>
+    void serialize(Result (*)(Params...), std::ostream & output, Args && ... args)
+    {
+        Encode<Params...>::write(output, std::forward<Args>(args)...);
+    }
+
+    /**
+     * Decode the result of a call to a method in a registry.
+     */
+    template<typename Result, typename... Params>
+    typename Returned<typename std::decay<Result>::type>::type deserialize(Result (*)(Params...), const char * input, size_t length)
+    {
+        Codec::Reader reader{input, length};
+        return Codec::Value<typename Returned<typename std::decay<Result>::type>::type>::read(reader);
+    }
+
+    // Where a hash lands in a table of the given size (a power of two)
+    constexpr uint32_t position(uint32_t hash, uint32_t seed, uint32_t size)
+    {
+        return (((hash ^ seed) * 0x9E3779B1u) >> 16) & (size - 1);
+    }
+
+    constexpr bool collides(const Entry * entries, size_t count, uint32_t seed, uint32_t size, size_t i, size_t j)
+    {
+        return j < count && (position(entries[i].hash, seed, size) == position(entries[j].hash, seed, size)
+                || collides(entries, count, seed, size, i, j + 1));
+    }
+
+    constexpr bool perfect(const Entry * entries, size_t count, uint32_t seed, uint32_t size, size_t i = 0)
+    {
+        return i >= count || (!collides(entries, count, seed, size, i, i + 1) && perfect(entries, count, seed, size, i + 1));
+    }
+
+    constexpr bool repeated(const Entry * entries, size_t count, size_t i, size_t j)
+    {
+        return j < count && (entries[i].hash == entries[j].hash || repeated(entries, count, i, j + 1));
+    }
+
+    constexpr bool distinct(const Entry * entries, size_t count, size_t i = 0)
+    {
+        return i >= count || (!repeated(entries, count, i, i + 1) && distinct(entries, count, i + 1));
+    }
+
+    static const uint32_t SEEDS_PER_SIZE = 64;
+    static const uint32_t MAX_TABLE_SIZE = 1 << 14;
+
+    // First seed giving a perfect hash at this size, or SEEDS_PER_SIZE if there isn't one
+    constexpr uint32_t findSeed(const Entry * entries, size_t count, uint32_t size, uint32_t seed = 0)
+    {
+        return seed >= SEEDS_PER_SIZE || perfect(entries, count, seed, size) ? seed
+            : findSeed(entries, count, size, seed + 1);
+    }
+
+    // Smallest size (from twice the count) with a perfect hash, doubling until there is one
+    constexpr uint32_t findSize(const Entry * entries, size_t count, uint32_t size)
+    {
+        return size >= MAX_TABLE_SIZE || findSeed(entries, count, size) < SEEDS_PER_SIZE ? size
+            : findSize(entries, count, size * 2);
+    }
+
+    constexpr uint32_t initialSize(size_t count, uint32_t size = 2)
+    {
+        return size >= 2 * count ? size : initialSize(count, size * 2);
+    }
+
+    // Entry landing in a slot, or count if none does
+    constexpr uint16_t slot(const Entry * entries, size_t count, uint32_t seed, uint32_t size, uint32_t target, size_t i = 0)
+    {
+        return i >= count ? count
+            : position(entries[i].hash, seed, size) == target ? i
+            : slot(entries, count, seed, size, target, i + 1);
+    }
+
+    template<typename Registry>
+    struct Size
+    {
+        static constexpr size_t COUNT = sizeof(Registry::entries) / sizeof(Entry);
+        static constexpr uint32_t SIZE = distinct(Registry::entries, COUNT) ? findSize(Registry::entries, COUNT, initialSize(COUNT)) : 1;
+        static constexpr uint32_t SEED = findSeed(Registry::entries, COUNT, SIZE);
+
+        static_assert(COUNT > 0 && COUNT < 0xFFFF, "A registry needs between 1 and 65534 RPC methods");
+        static_assert(distinct(Registry::entries, COUNT), "An RPC method is registered twice");
+        static_assert(SEED < SEEDS_PER_SIZE || SIZE == 1, "No perfect hash for the RPC methods could be found");
+    };
+
+    template<typename Registry, typename Positions = typename MakeIndices<Size<Registry>::SIZE>::type>
+    struct Table;
+
+    template<typename Registry, size_t... Position>
+    struct Table<Registry, Indices<Position...>>: Size<Registry>
+    {
+        typedef Size<Registry> Base;
+
+        /**
+         * Find a method by name.
+         *
+         * @param name    Name of RPC method
+         * @param length  Length of the name
+         * @return        Its entry, or NULL if it isn't in the registry
+         */
+        static const Entry * find(const char * name, size_t length)
+        {
+            uint32_t nameHash = hash(name, length);
+            const Entry & entry = Registry::entries[slots[position(nameHash, Base::SEED, Base::SIZE)] % Base::COUNT];
+            return entry.hash == nameHash && entry.length == length && !std::memcmp(entry.name, name, length) ? &entry : NULL;
+        }
+
+        static constexpr uint16_t slots[] = {slot(Registry::entries, Base::COUNT, Base::SEED, Base::SIZE, Position)...};
+    };
+
+    template<typename Registry, size_t... Position>
+    constexpr uint16_t Table<Registry, Indices<Position...>>::slots[];
+
+    // Accepts every method; used when a program hasn't named its registry
+    struct Unchecked {};
+
+    constexpr bool same(const char * first, const char * second)
+    {
+        return *first == *second && (!*first || same(first + 1, second + 1));
+    }
+
+    template<typename Registry, size_t I, size_t Count>
+    struct Find
+    {
+        // Index of the entry with the name (compared in full, not just by hash), or Count if there's none
+        static constexpr size_t index(const char * name)
+        {
+            return same(Registry::entries[I].name, name) ? I : Find<Registry, I + 1, Count>::index(name);
+        }
+    };
+
+    template<typename Registry, size_t Count>
+    struct Find<Registry, Count, Count>
+    {
+        static constexpr size_t index(const char *) { return Count; }
+    };
+
+    template<typename Registry>
+    struct Lookup
+    {
+        static constexpr size_t COUNT = sizeof(Registry::entries) / sizeof(Entry);
+
+        static constexpr size_t index(const char * name)
+        {
+            return Find<Registry, 0, COUNT>::index(name);
+        }
+
+        static constexpr bool registered(size_t index)
+        {
+            return index < COUNT;
+        }
+
+        // Whether the entry was made from the same function type (an unregistered method is reported as such instead)
+        template<typename Function>
+        static constexpr bool takes(size_t index)
+        {
+            return index >= COUNT || Registry::entries[index].type == &TypeOf<Function>::tag;
+        }
+    };
+
+    template<>
+    struct Lookup<Unchecked>
+    {
+        static constexpr size_t index(const char *) { return 0; }
+        static constexpr bool registered(size_t) { return true; }
+        template<typename Function> static constexpr bool takes(size_t) { return true; }
+    };
+
+    /**
+     * Check at compile time that a method is registered under the name it's being called by, and with the same
+     * signature; used by the RPC macros.
+     */
+    template<typename Registry, size_t Index, typename Function>
+    Function checked(Function function)
+    {
+        static_assert(Lookup<Registry>::registered(Index), "RPC method is not registered on that side");
+        static_assert(Lookup<Registry>::template takes<Function>(Index), "RPC method is registered with a different signature");
+        return function;
+    }
+}
+
+}
@@ -28,6 +28,7 @@ or implied, of Christopher Allen Ogden.
 #pragma once
 
 #include "connection.h"
+#include "interest_grid.h"
 
 namespace SydNet {
 
@@ -36,6 +37,7 @@ class Server
     public:
         Server(const Connection::RPCInvoker & invoker)
             : _invoker(invoker)
+            , _interest{}
         {
         }
 
@@ -56,9 +58,20 @@ class Server
          */
         virtual Connection::ConnectionMap & clients() = 0;
 
+        /**
+         * Get the interest grid tracking where the clients are
+         *
+         * @return  Interest grid
+         */
+        InterestGrid & interest()
+        {
+            return _interest;
+        }
+
         virtual ~Server() {}
     private:
         Connection::RPCInvoker _invoker;
+        InterestGrid _interest;
 };
 
 }
@@ -27,21 +27,56 @@ or implied, of Christopher Allen Ogden.
 */
 #include "shared.h"
 
+#include <cmath>
 #include <iostream>
 #include <boost/lexical_cast.hpp>
 
-void printMessage(const std::string & message, SydNet::Connection::Pointer connection)
+#include "interest_grid.h"
+
+static void printRelayed(int result)
+{
+    std::cout << "Relayed " << result << std::endl;
+}
+
+void printMessage(SydNet::StringView message, SydNet::Connection::Pointer connection)
 {
     std::cout << message << std::endl;
     if (message == "Tick!") {
         connection->execute(SERVER_RPC(gotMessage));
+        connection->executeCallback(SERVER_RPC(relayMul), printRelayed, 3);
     }
 }
 
-void sendMessage(const std::string & message, SydNet::Connection::Pointer connection)
+void sendMessage(SydNet::StringView message, SydNet::Connection::Pointer connection)
 {
+    std::string text = boost::lexical_cast<std::string>(connection->uuid()) + ": ";
+    text.append(message.data(), message.length());
+
     for (auto & peer: connection->peers()) {
-        SydNet::Connection::Pointer{peer.second}->execute(CLIENT_RPC(printMessage), boost::lexical_cast<std::string>(connection->uuid()) + ": " + message);
+        SydNet::Connection::Pointer{peer.second}->execute(CLIENT_RPC(printMessage), text);
+    }
+}
+
+void sendNearbyMessage(SydNet::StringView message, SydNet::Connection::Pointer connection)
+{
+    float x, y;
+    SydNet::InterestGrid * grid = connection->interest();
+    if (!grid || !grid->locate(connection->uuid(), x, y)) {
+        return; // Nobody can see a client that isn't anywhere
+    }
+
+    std::string text = boost::lexical_cast<std::string>(connection->uuid()) + ": ";
+    text.append(message.data(), message.length());
+    grid->broadcast(connection->peers(), x, y, CLIENT_RPC(printMessage), text);
+}
+
+void updatePosition(float x, float y, SydNet::Connection::Pointer connection)
+{
+    if (!std::isfinite(x) || !std::isfinite(y)) {
+        return; // Nowhere anyone could be
+    }
+    if (SydNet::InterestGrid * grid = connection->interest()) {
+        grid->position(connection->uuid(), x, y);
     }
 }
 
@@ -61,12 +96,30 @@ void gotMessage(SydNet::Connection::Pointer connection)
     connection->executeCallback(CLIENT_RPC(mul), std::bind(gotMessageResult, std::placeholders::_1, 2), 3);
 }
 
+SydNet::Responder<int> relayMul(int x, SydNet::Connection::Pointer connection)
+{
+    // Ask another client, and answer once it has, without holding up the network thread meanwhile
+    SydNet::Responder<int> responder;
+    for (auto & peer: connection->peers()) {
+        SydNet::Connection::Pointer other{peer.second};
+        if (other != connection) {
+            other->executeCallback(CLIENT_RPC(mul), [responder](int result) { responder.respond(result); }, x);
+            return responder;
+        }
+    }
+
+    responder.respond(x * 5); // Nobody else to ask
+    return responder;
+}
+
+constexpr SydNet::RPCRegistry::Entry GameRPCs::entries[];
+
 SydNet::Connection::RPCInvoker RPCMethods()
 {
     SydNet::Connection::RPCInvoker invoker;
-    invoker.registerFunction(CLIENT_RPC(printMessage));
-    invoker.registerFunction(SERVER_RPC(sendMessage));
-    invoker.registerFunction(SERVER_RPC(gotMessage));
-    invoker.registerFunction(CLIENT_RPC(mul));
+    invoker.registry<GameRPCs>();
+    invoker.offload(SERVER_RPC(gotMessage));
+    invoker.coalesce(SERVER_RPC(updatePosition)); // Only where the client is now matters
+    invoker.cache(CLIENT_RPC(mul), 256); // Depends on nothing but its argument
     return invoker;
 }
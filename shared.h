@@ -29,12 +29,35 @@ or implied, of Christopher Allen Ogden.
 
 #include "connection.h"
 
-void printMessage(const std::string & message, SydNet::Connection::Pointer connection);
+void printMessage(SydNet::StringView message, SydNet::Connection::Pointer connection);
 
-void sendMessage(const std::string & message, SydNet::Connection::Pointer connection);
+void sendMessage(SydNet::StringView message, SydNet::Connection::Pointer connection);
+
+void sendNearbyMessage(SydNet::StringView message, SydNet::Connection::Pointer connection);
+
+void updatePosition(float x, float y, SydNet::Connection::Pointer connection);
 
 int mul(int x, SydNet::Connection::Pointer connection);
 
 void gotMessage(SydNet::Connection::Pointer connection);
 
+SydNet::Responder<int> relayMul(int x, SydNet::Connection::Pointer connection);
+
+// Every RPC method in the game
+struct GameRPCs
+{
+    static constexpr SydNet::RPCRegistry::Entry entries[] = {
+        CLIENT_RPC_ENTRY(printMessage),
+        SERVER_RPC_ENTRY(sendMessage),
+        SERVER_RPC_ENTRY(sendNearbyMessage),
+        SERVER_RPC_ENTRY(updatePosition),
+        SERVER_RPC_ENTRY(gotMessage),
+        CLIENT_RPC_ENTRY(mul),
+        SERVER_RPC_ENTRY(relayMul),
+    };
+};
+
+#undef SYDNET_RPC_REGISTRY
+#define SYDNET_RPC_REGISTRY GameRPCs
+
 SydNet::Connection::RPCInvoker RPCMethods();
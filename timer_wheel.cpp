@@ -0,0 +1,171 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "timer_wheel.h"
+
+namespace SydNet {
+
+/*****************
+ * Public methods
+ *****************/
+
+TimerWheel::TimerWheel(IOService & ioService, Clock::duration resolution)
+    : _timer{ioService}
+    , _resolution{resolution}
+    , _start{Clock::now()}
+    , _now{0}
+    , _count{0}
+    , _armed{false}
+    , _slots{}
+{
+}
+
+TimerWheel::~TimerWheel()
+{
+    // Timers that outlive us must not reach back in when they're cancelled
+    for (Link (& level)[SLOTS]: _slots) {
+        for (Link & slot: level) {
+            while (slot.linked()) {
+                Timer & timer = static_cast<Timer &>(*slot.next);
+                timer.unlink();
+                timer._wheel = NULL;
+            }
+        }
+    }
+}
+
+void TimerWheel::schedule(Timer & timer, Clock::duration delay, const Timer::Handler & handler)
+{
+    timer.cancel();
+
+    if (!_count && !_armed) {
+        _now = (Clock::now() - _start) / _resolution; // Nothing to go off while idle; skip straight here
+    }
+
+    // Round up so a timer never goes off early, and always at least a tick from now
+    Clock::duration sinceTick = Clock::now() - _start - _resolution * _now;
+    uint64_t ticks = (delay + sinceTick + _resolution - Clock::duration{1}) / _resolution;
+    timer._expiry = _now + std::max<uint64_t>(ticks, 1);
+    timer._handler = handler;
+    timer._wheel = this;
+    insert(timer);
+    ++_count;
+
+    arm();
+}
+
+
+/******************
+* Private methods
+******************/
+
+void TimerWheel::insert(Timer & timer)
+{
+    // The highest byte that differs from now picks the level; the timer's byte there picks the slot
+    uint64_t difference = timer._expiry ^ _now;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && difference >> ((level + 1) * SLOT_BITS)) {
+        ++level;
+    }
+
+    unsigned slot = (timer._expiry >> (level * SLOT_BITS)) & (SLOTS - 1);
+    timer.insertBefore(_slots[level][slot]);
+}
+
+void TimerWheel::tick()
+{
+    ++_now;
+
+    // Move timers down from every level the one below it just wrapped into, highest first
+    unsigned levels = 1;
+    while (levels < LEVELS && !(_now & ((uint64_t{1} << (levels * SLOT_BITS)) - 1))) {
+        ++levels;
+    }
+    for (unsigned level = levels - 1; level > 0; --level) {
+        Link & slot = _slots[level][(_now >> (level * SLOT_BITS)) & (SLOTS - 1)];
+        while (slot.linked()) {
+            Timer & timer = static_cast<Timer &>(*slot.next);
+            timer.unlink();
+            insert(timer);
+        }
+    }
+
+    // Take the due timers out first so handlers can schedule and cancel freely
+    Link & slot = _slots[0][_now & (SLOTS - 1)];
+    Link due;
+    if (slot.linked()) {
+        due.next = slot.next;
+        due.prev = slot.prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        slot.next = slot.prev = &slot;
+    }
+
+    while (due.linked()) {
+        Timer & timer = static_cast<Timer &>(*due.next);
+        timer.cancel();
+        Timer::Handler handler;
+        handler.swap(timer._handler);
+        handler();
+    }
+}
+
+void TimerWheel::arm()
+{
+    if (_armed) {
+        return;
+    }
+    _armed = true;
+
+    Clock::time_point next = _start + _resolution * (_now + 1);
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(next - Clock::now());
+    _timer.expires_from_now(boost::posix_time::microseconds(std::max<int64_t>(wait.count(), 0)));
+    _timer.async_wait(std::bind(&TimerWheel::handleTimer, this, std::placeholders::_1));
+}
+
+void TimerWheel::handleTimer(const boost::system::error_code & error)
+{
+    if (error == boost::asio::error::operation_aborted) {
+        return; // The wheel may be gone
+    }
+    _armed = false;
+    if (error) {
+        return;
+    }
+
+    uint64_t target = (Clock::now() - _start) / _resolution;
+    while (_now < target && _count) {
+        tick();
+    }
+
+    // Only keep ticking while there's something left to go off
+    if (_count) {
+        arm();
+    }
+}
+
+}
@@ -0,0 +1,189 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <boost/asio.hpp>
+
+#include "io_service.h"
+
+namespace SydNet {
+
+/**
+ * Hierarchical timing wheel: any number of timers on a single asio timer.
+ *
+ * Each level has 256 slots; a timer goes in the lowest level whose slot range reaches its expiry
+ * and moves down a level each time the level below wraps around. Timers are intrusive, so
+ * scheduling and cancelling are O(1) and don't allocate.
+ *
+ * Share it with whatever schedules timers on it for as long as they might, so it outlives them; should it go
+ * first anyway, it lets go of the timers still scheduled.
+ */
+class TimerWheel
+{
+    public:
+        typedef std::chrono::steady_clock Clock;
+        typedef std::shared_ptr<TimerWheel> Pointer;
+
+    private:
+        struct Link
+        {
+            Link()
+                : next{this}
+                , prev{this}
+            {
+            }
+
+            void unlink()
+            {
+                prev->next = next;
+                next->prev = prev;
+                next = prev = this;
+            }
+
+            void insertBefore(Link & link)
+            {
+                next = &link;
+                prev = link.prev;
+                prev->next = this;
+                link.prev = this;
+            }
+
+            bool linked() const
+            {
+                return next != this;
+            }
+
+            Link * next;
+            Link * prev;
+
+            Link & operator=(const Link &) = delete;
+            Link(const Link &) = delete;
+        };
+
+    public:
+        /**
+         * A timer; embed it in whatever owns it.
+         */
+        class Timer: private Link
+        {
+            public:
+                typedef std::function<void()> Handler;
+
+                Timer()
+                    : Link{}
+                    , _wheel{NULL}
+                    , _expiry{0}
+                    , _handler{}
+                {
+                }
+
+                /**
+                 * Check whether the timer is waiting to go off.
+                 *
+                 * @return  True if scheduled
+                 */
+                bool pending() const
+                {
+                    return linked();
+                }
+
+                /**
+                 * Stop the timer from going off (does nothing if it isn't scheduled).
+                 */
+                void cancel()
+                {
+                    if (linked()) {
+                        unlink();
+                        --_wheel->_count;
+                    }
+                }
+
+                ~Timer()
+                {
+                    cancel();
+                }
+
+                Timer & operator=(const Timer &) = delete;
+                Timer(const Timer &) = delete;
+
+            private:
+                friend class TimerWheel;
+
+                TimerWheel * _wheel;
+                uint64_t _expiry; // In ticks
+                Handler _handler;
+        };
+
+        /**
+         * Create a wheel.
+         *
+         * @param ioService     IO service the timers go off on
+         * @param resolution    Length of a tick; timers go off on the first tick after they expire
+         */
+        TimerWheel(IOService & ioService, Clock::duration resolution = std::chrono::milliseconds(10));
+
+        ~TimerWheel();
+
+        /**
+         * Schedule a timer, replacing whatever it was scheduled for before.
+         *
+         * @param timer     Timer to schedule
+         * @param delay     How long from now it should go off
+         * @param handler   Function to call when it goes off
+         */
+        void schedule(Timer & timer, Clock::duration delay, const Timer::Handler & handler);
+
+        TimerWheel & operator=(const TimerWheel &) = delete;
+        TimerWheel(const TimerWheel &) = delete;
+
+    private:
+        static const unsigned SLOT_BITS = 8;
+        static const unsigned SLOTS = 1 << SLOT_BITS;
+        static const unsigned LEVELS = 64 / SLOT_BITS;
+
+        void insert(Timer & timer);
+
+        void tick();
+
+        void arm();
+
+        void handleTimer(const boost::system::error_code & error);
+
+        boost::asio::deadline_timer _timer;
+        Clock::duration _resolution;
+        Clock::time_point _start;
+        uint64_t _now; // Ticks since the start
+        size_t _count; // Timers scheduled
+        bool _armed;
+        Link _slots[LEVELS][SLOTS];
+};
+
+}
@@ -0,0 +1,186 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "tracer.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+#include <boost/uuid/uuid_io.hpp>
+
+namespace SydNet {
+
+namespace {
+    const char * const STAGE_NAMES[Tracer::STAGES] = {"waiting", "handling", "sending", "network", "round trip"};
+
+    int64_t nanoseconds(Tracer::Duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    }
+
+    double microseconds(int64_t nanoseconds)
+    {
+        return nanoseconds / 1000.0;
+    }
+}
+
+/*****************
+ * Public methods
+ *****************/
+
+void Tracer::record(const std::string & method, Stage stage, Duration duration)
+{
+    // Clocks on either end can make a difference come out slightly negative
+    int64_t elapsed = std::max<int64_t>(nanoseconds(duration), 0);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _methods[method][stage].add(elapsed);
+}
+
+void Tracer::clock(const boost::uuids::uuid & connection, Duration rtt, Duration offset)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _rtt.add(std::max<int64_t>(nanoseconds(rtt), 0));
+    _clocks[connection] = Estimate{rtt, offset};
+}
+
+void Tracer::forget(const boost::uuids::uuid & connection)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _clocks.erase(connection);
+}
+
+Tracer::Duration Tracer::spent(Stage stage) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    uint64_t sum = 0;
+    for (const auto & method: _methods) {
+        sum += method.second[stage].sum();
+    }
+    return std::chrono::duration_cast<Duration>(std::chrono::nanoseconds(sum));
+}
+
+void Tracer::report(std::ostream & output) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::ios::fmtflags flags = output.flags();
+    output << std::fixed << std::setprecision(1);
+
+    output << "Latency (us)" << std::setw(36) << "count" << std::setw(10) << "p50" << std::setw(10) << "p90"
+           << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    auto line = [&output](const std::string & name, const Histogram & histogram) {
+        output << "  " << std::left << std::setw(36) << name << std::right << std::setw(10) << histogram.total()
+               << std::setw(10) << microseconds(histogram.percentile(0.5))
+               << std::setw(10) << microseconds(histogram.percentile(0.9))
+               << std::setw(10) << microseconds(histogram.percentile(0.99))
+               << std::setw(10) << microseconds(histogram.max()) << std::endl;
+    };
+
+    for (const auto & method: _methods) {
+        output << method.first << std::endl;
+        for (unsigned stage = 0; stage < STAGES; ++stage) {
+            if (method.second[stage].total()) {
+                line(STAGE_NAMES[stage], method.second[stage]);
+            }
+        }
+    }
+
+    if (_rtt.total()) {
+        output << "Connections" << std::endl;
+        line("rtt", _rtt);
+
+        // Offsets can be either way, so they don't go in a histogram
+        std::vector<int64_t> offsets;
+        for (const auto & estimate: _clocks) {
+            offsets.push_back(nanoseconds(estimate.second.offset));
+        }
+        std::sort(offsets.begin(), offsets.end());
+        output << "  clock offset of " << offsets.size() << " connections: min " << microseconds(offsets.front())
+               << ", median " << microseconds(offsets[offsets.size() / 2]) << ", max " << microseconds(offsets.back()) << std::endl;
+    }
+
+    output.flags(flags);
+}
+
+void Tracer::reset()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _methods.clear();
+    _rtt = Histogram{};
+    _clocks.clear();
+}
+
+/*****************
+ * Private methods
+ *****************/
+
+void Tracer::Histogram::add(uint64_t nanoseconds)
+{
+    ++_counts[bucket(nanoseconds)];
+    ++_total;
+    _sum += nanoseconds;
+    _max = std::max(_max, nanoseconds);
+}
+
+uint64_t Tracer::Histogram::percentile(double p) const
+{
+    uint64_t rank = static_cast<uint64_t>(p * _total);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i) {
+        seen += _counts[i];
+        if (seen > rank) {
+            return std::min(lowest(i), _max);
+        }
+    }
+    return _max;
+}
+
+unsigned Tracer::Histogram::bucket(uint64_t value)
+{
+    if (value < LINEAR) {
+        return static_cast<unsigned>(value);
+    }
+
+    // The top bit picks the power of two, and the SUB_BITS below it which eighth of it
+    unsigned top = 63 - __builtin_clzll(value);
+    unsigned sub = static_cast<unsigned>(value >> (top - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+    return LINEAR + (top - SUB_BITS - 1) * (1 << SUB_BITS) + sub;
+}
+
+uint64_t Tracer::Histogram::lowest(unsigned bucket)
+{
+    if (bucket < LINEAR) {
+        return bucket;
+    }
+
+    unsigned top = (bucket - LINEAR) / (1 << SUB_BITS) + SUB_BITS + 1;
+    uint64_t sub = (bucket - LINEAR) % (1 << SUB_BITS);
+    return ((1 << SUB_BITS) + sub) << (top - SUB_BITS);
+}
+
+}
@@ -0,0 +1,179 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <boost/uuid/uuid.hpp>
+
+namespace SydNet {
+
+/**
+ * Latency breakdown of the calls going through connections that trace.
+ *
+ * Each method gets a histogram per stage, so a slow call can be put down to the queues, the
+ * network or the handler. Connections also report their round trip time and how far the peer's
+ * clock is from ours. Connections on any thread can share one.
+ */
+class Tracer
+{
+    public:
+        typedef std::chrono::steady_clock::duration Duration;
+
+        typedef enum {
+            Waiting = 0, // Received until its handler started (callee)
+            Handling, // Handler started until the result was ready (callee)
+            Sending, // Called until the call was written out (caller)
+            Network, // Time on the wire there and back: the round trip less the peer's part in it (caller)
+            RoundTrip, // Called until the result came back (caller)
+            STAGES
+        } Stage;
+
+        Tracer()
+            : _mutex{}
+            , _methods{}
+            , _rtt{}
+            , _clocks{}
+        {
+        }
+
+        /**
+         * Record how long a call spent in a stage.
+         *
+         * @param method    Name of the RPC method
+         * @param stage     Stage it was in
+         * @param duration  How long it was there
+         */
+        void record(const std::string & method, Stage stage, Duration duration);
+
+        /**
+         * Record the latest estimate of a connection's round trip time and clock offset.
+         *
+         * @param connection    UUID of the connection
+         * @param rtt           Round trip time, less the time the peer took to answer
+         * @param offset        How far the peer's clock is ahead of ours
+         */
+        void clock(const boost::uuids::uuid & connection, Duration rtt, Duration offset);
+
+        /**
+         * Drop a connection's clock estimate once it's gone.
+         *
+         * @param connection    UUID of the connection
+         */
+        void forget(const boost::uuids::uuid & connection);
+
+        /**
+         * Get how long calls spent in a stage altogether, whatever the method.
+         *
+         * @param stage     Stage they were in
+         * @return          Total time spent there
+         */
+        Duration spent(Stage stage) const;
+
+        /**
+         * Write out the percentiles of every stage of every method, and the connections' clocks.
+         *
+         * @param output    Where to write them
+         */
+        void report(std::ostream & output) const;
+
+        /**
+         * Forget everything recorded so far.
+         */
+        void reset();
+
+        Tracer & operator=(const Tracer &) = delete;
+        Tracer(const Tracer &) = delete;
+
+    private:
+        /**
+         * Counts of durations in buckets a power of two wide, split in eight,
+         * so any percentile comes out within an eighth of the true one.
+         */
+        class Histogram
+        {
+            public:
+                Histogram()
+                    : _counts{}
+                    , _total{0}
+                    , _sum{0}
+                    , _max{0}
+                {
+                }
+
+                void add(uint64_t nanoseconds);
+
+                uint64_t percentile(double p) const;
+
+                uint64_t total() const
+                {
+                    return _total;
+                }
+
+                uint64_t sum() const
+                {
+                    return _sum;
+                }
+
+                uint64_t max() const
+                {
+                    return _max;
+                }
+
+            private:
+                static const unsigned SUB_BITS = 3;
+                static const unsigned LINEAR = 2 << SUB_BITS; // Small values get a bucket each
+                static const unsigned BUCKETS = LINEAR + (64 - SUB_BITS - 1) * (1 << SUB_BITS);
+
+                static unsigned bucket(uint64_t value);
+
+                static uint64_t lowest(unsigned bucket);
+
+                std::array<uint64_t, BUCKETS> _counts;
+                uint64_t _total;
+                uint64_t _sum; // Of every value added
+                uint64_t _max;
+        };
+
+        struct Estimate
+        {
+            Duration rtt;
+            Duration offset;
+        };
+
+        mutable std::mutex _mutex;
+        std::map<std::string, std::array<Histogram, STAGES>> _methods;
+        Histogram _rtt; // Of every connection
+        std::map<boost::uuids::uuid, Estimate> _clocks; // Latest for each connection that has reported
+};
+
+}
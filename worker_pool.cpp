@@ -0,0 +1,157 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#include "worker_pool.h"
+
+#include "log.h"
+
+namespace SydNet {
+
+static thread_local bool workerThread = false;
+
+/*****************
+ * Public methods
+ *****************/
+
+WorkerPool::WorkerPool(size_t threads, size_t capacity)
+    : _queue{capacity}
+    , _threads{}
+    , _stopping{false}
+    , _sleeping{0}
+    , _waiting{0}
+    , _rooms{}
+    , _mutex{}
+    , _wakeup{}
+{
+    for (size_t i = 0; i < threads; ++i) {
+        _threads.push_back(std::thread{&WorkerPool::work, this});
+    }
+}
+
+bool WorkerPool::submit(Job & job, const Job & room)
+{
+    if (!_queue.push(job)) {
+        // Workers are behind; leave the job with the caller rather than block its thread waiting for room
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _rooms.push_back(room);
+            ++_waiting;
+        }
+
+        // A worker may have taken a job before it could see us waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!_queue.push(job)) {
+            return false;
+        }
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load()) {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _wakeup.notify_one();
+    }
+    return true;
+}
+
+bool WorkerPool::onWorkerThread()
+{
+    return workerThread;
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _stopping = true;
+        _wakeup.notify_all();
+    }
+
+    for (auto & thread: _threads) {
+        thread.join();
+    }
+}
+
+
+/******************
+* Private methods
+******************/
+
+void WorkerPool::work()
+{
+    workerThread = true;
+
+    Job job;
+    while (true) {
+        if (_queue.pop(job)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_waiting.load()) {
+                makeRoom();
+            }
+
+            try {
+                job();
+            } catch (const std::exception & e) {
+                LOG_ERROR("Exception in worker: ", e.what());
+            }
+            job = Job{};
+            continue;
+        }
+
+        if (_stopping) {
+            break;
+        }
+
+        // Nothing to do; park until a job arrives
+        std::unique_lock<std::mutex> lock{_mutex};
+        ++_sleeping;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        _wakeup.wait(lock, [this] { return _stopping || !_queue.empty(); });
+        --_sleeping;
+    }
+}
+
+void WorkerPool::makeRoom()
+{
+    Job room;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        if (_rooms.empty()) {
+            return;
+        }
+        room = std::move(_rooms.front());
+        _rooms.pop_front();
+        --_waiting;
+    }
+
+    try {
+        room();
+    } catch (const std::exception & e) {
+        LOG_ERROR("Exception in worker: ", e.what());
+    }
+}
+
+}
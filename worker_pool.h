@@ -0,0 +1,95 @@
+/*
+Copyright 2011 Christopher Allen Ogden. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY CHRISTOPHER ALLEN OGDEN ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CHRISTOPHER ALLEN OGDEN OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Christopher Allen Ogden.
+*/
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "mpmc_queue.h"
+
+namespace SydNet {
+
+/**
+ * Threads that run RPC handlers away from the network thread.
+ */
+class WorkerPool
+{
+    public:
+        typedef std::function<void()> Job;
+
+        /**
+         * Start the worker threads.
+         *
+         * @param threads   Number of worker threads
+         * @param capacity  Most jobs that can be waiting; must be a power of two
+         * @throw std::invalid_argument if the capacity isn't a power of two
+         */
+        WorkerPool(size_t threads, size_t capacity = 4096);
+
+        /**
+         * Hand a job to the workers without waiting for them.
+         *
+         * @param job   Job to run; left alone if the queue is full
+         * @param room  If the queue is full, called on a worker thread once a job has been taken off it (possibly
+         *              even if this one went in after all)
+         * @return      False if the queue is full
+         */
+        bool submit(Job & job, const Job & room);
+
+        /**
+         * Check whether the calling thread is one of the workers of any pool.
+         *
+         * @return  True if called from a worker thread
+         */
+        static bool onWorkerThread();
+
+        ~WorkerPool();
+
+        WorkerPool & operator=(const WorkerPool &) = delete;
+        WorkerPool(const WorkerPool &) = delete;
+
+    private:
+        void work();
+
+        void makeRoom();
+
+        MPMCQueue<Job> _queue;
+        std::vector<std::thread> _threads;
+        std::atomic<bool> _stopping;
+        std::atomic<size_t> _sleeping; // Workers parked on the condition variable
+        std::atomic<size_t> _waiting; // Submitters waiting for room
+        std::deque<Job> _rooms; // What to call for each of them, guarded by the mutex
+        std::mutex _mutex;
+        std::condition_variable _wakeup;
+};
+
+}